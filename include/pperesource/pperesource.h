@@ -23,15 +23,100 @@
 
 typedef struct ppelib_handle_s ppelib_handle;
 
+// pread()-style callback: read size bytes at offset into buffer, return the number of bytes read
+typedef size_t (*ppelib_read_func)(void *userdata, uint8_t *buffer, size_t offset, size_t size);
+
+// Sequential writer callback: write size bytes from buffer, return the number of bytes written
+typedef size_t (*ppelib_write_func)(void *userdata, const uint8_t *buffer, size_t size);
+
+// What ppelib_create_from_buffer_ex() leaves out. Skipped parts aren't
+// written back either, except for resources, which stay as they were.
+typedef enum {
+	// No overlay, writing drops it
+	PPELIB_PARSE_SKIP_OVERLAY = 1 << 0,
+	// No resource tree
+	PPELIB_PARSE_SKIP_RESOURCES = 1 << 1,
+	// The resource tree without payloads, versioninfo and icons. The table
+	// can still be written back, but not after changing it.
+	PPELIB_PARSE_SKIP_RESOURCE_DATA = 1 << 2,
+	PPELIB_PARSE_SKIP_VERSIONINFO = 1 << 3,
+	PPELIB_PARSE_SKIP_ICONS = 1 << 4,
+	// Check the whole file but keep nothing that isn't needed for that. Like
+	// ppelib_create_from_buffer_borrowed() the buffer has to outlive the handle.
+	PPELIB_PARSE_VALIDATE_ONLY = 1 << 5,
+} ppelib_parse_flags;
+
+#define PPELIB_PROBE_MAX_SECTIONS 96
+#define PPELIB_PROBE_MAX_DATA_DIRECTORIES 16
+
+typedef struct ppelib_probe_section_s {
+	char name[9];
+	uint32_t virtual_size;
+	uint32_t virtual_address;
+	uint32_t size_of_raw_data;
+	uint32_t pointer_to_raw_data;
+	uint32_t characteristics;
+} ppelib_probe_section;
+
+typedef struct ppelib_probe_data_directory_s {
+	uint32_t virtual_address;
+	uint32_t size;
+} ppelib_probe_data_directory;
+
+// What ppelib_probe() can tell from the headers alone. Fixed size so it can
+// live on the stack.
+typedef struct ppelib_probe_info_s {
+	size_t pe_header_offset;
+
+	uint16_t machine;
+	uint16_t number_of_sections;
+	uint32_t time_date_stamp;
+	uint16_t size_of_optional_header;
+	uint16_t characteristics;
+	uint16_t magic;
+	uint32_t address_of_entry_point;
+	uint64_t image_base;
+	uint32_t section_alignment;
+	uint32_t file_alignment;
+	uint32_t size_of_image;
+	uint32_t size_of_headers;
+	uint32_t checksum;
+	uint16_t subsystem;
+	uint16_t dll_characteristics;
+	uint32_t number_of_rva_and_sizes;
+
+	// Only the first PPELIB_PROBE_MAX_SECTIONS are recorded, number_of_sections
+	// has the real count
+	uint16_t numb_sections;
+	ppelib_probe_section sections[PPELIB_PROBE_MAX_SECTIONS];
+
+	uint32_t numb_data_directories;
+	ppelib_probe_data_directory data_directories[PPELIB_PROBE_MAX_DATA_DIRECTORIES];
+} ppelib_probe_info;
+
 const char *ppelib_error();
 
 ppelib_handle *ppelib_create_from_buffer(const uint8_t *buffer, size_t size);
+ppelib_handle *ppelib_create_from_buffer_borrowed(const uint8_t *buffer, size_t size);
+ppelib_handle *ppelib_create_from_buffer_ex(const uint8_t *buffer, size_t size, uint32_t flags);
 ppelib_handle *ppelib_create_from_file(const char *filename);
-size_t ppelib_write_to_buffer(ppelib_handle *pe, const uint8_t *buffer, size_t size);
-size_t ppelib_write_to_file(ppelib_handle *pe, const char *filename);
+ppelib_handle *ppelib_create_from_file_mapped(const char *filename);
+ppelib_handle *ppelib_create_from_reader(ppelib_read_func read, void *userdata, size_t size);
+// Reads the headers without allocating anything. Returns the size of the
+// header region, 0 on error.
+size_t ppelib_probe(const uint8_t *buffer, size_t size, ppelib_probe_info *probe);
+size_t ppelib_write_to_buffer(const ppelib_handle *pe, uint8_t *buffer, size_t size);
+size_t ppelib_write_to_file(const ppelib_handle *pe, const char *filename);
+// Writes at fd's current position and leaves it after the image, the way
+// write() does. Nothing past the image is truncated.
+size_t ppelib_write_to_fd(const ppelib_handle *pe, int fd);
+size_t ppelib_write_to_sink(const ppelib_handle *pe, ppelib_write_func write, void *userdata);
+size_t ppelib_patch_file(ppelib_handle *pe, const char *filename);
 
 void ppelib_destroy(ppelib_handle *pe);
 
 void ppelib_resources_delete(ppelib_handle *pe);
+// Store resources with identical contents once when writing
+void ppelib_resources_share_data(ppelib_handle *pe, uint8_t share);
 
 #endif /* _PPERESOURCE_H_ */
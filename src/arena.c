@@ -0,0 +1,104 @@
+/* Copyright 2021 Hein-Pieter van Braam-Stewart
+ *
+ * This file is part of ppelib (Portable Portable Executable LIBrary)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "platform.h"
+#include "ppe_error.h"
+#include "utils.h"
+
+#define ARENA_HEADER ARENA_SIZE(sizeof(arena_block_t))
+#define ARENA_MIN_BLOCK 4096
+
+static arena_block_t *arena_add_block(arena_t *arena, size_t size) {
+	if (size > SIZE_MAX - ARENA_HEADER) {
+		return NULL;
+	}
+
+	arena_block_t *block = malloc(ARENA_HEADER + size);
+	if (!block) {
+		return NULL;
+	}
+
+	block->size = size;
+	block->used = 0;
+	block->next = arena->blocks;
+	arena->blocks = block;
+
+	return block;
+}
+
+// Makes sure the next size bytes of allocations come from one block
+void arena_reserve(arena_t *arena, size_t size) {
+	arena_block_t *block = arena->blocks;
+	if (block && block->size - block->used >= size) {
+		return;
+	}
+
+	if (!arena_add_block(arena, MAX(size, ARENA_MIN_BLOCK))) {
+		ppelib_set_error("Failed to allocate arena");
+	}
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+	if (size > SIZE_MAX - ARENA_ALIGN) {
+		ppelib_set_error("Allocation too large");
+		return NULL;
+	}
+
+	size = ARENA_SIZE(size);
+
+	arena_block_t *block = arena->blocks;
+	if (!block || block->size - block->used < size) {
+		// Grow geometrically so a bad reservation doesn't cost an allocation per call
+		size_t block_size = block ? MAX(block->size * 2, size) : MAX(size, ARENA_MIN_BLOCK);
+		block = arena_add_block(arena, block_size);
+		if (!block) {
+			ppelib_set_error("Failed to allocate arena");
+			return NULL;
+		}
+	}
+
+	void *ptr = (uint8_t *)block + ARENA_HEADER + block->used;
+	block->used += size;
+
+	return ptr;
+}
+
+void *arena_calloc(arena_t *arena, size_t size) {
+	void *ptr = arena_alloc(arena, size);
+	if (ptr) {
+		memset(ptr, 0, size);
+	}
+
+	return ptr;
+}
+
+void arena_free(arena_t *arena) {
+	arena_block_t *block = arena->blocks;
+	while (block) {
+		arena_block_t *next = block->next;
+		free(block);
+		block = next;
+	}
+
+	arena->blocks = NULL;
+}
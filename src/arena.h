@@ -0,0 +1,45 @@
+/* Copyright 2021 Hein-Pieter van Braam-Stewart
+ *
+ * This file is part of ppelib (Portable Portable Executable LIBrary)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PPELIB_ARENA_H_
+#define PPELIB_ARENA_H_
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#define ARENA_ALIGN _Alignof(max_align_t)
+// What an allocation of size bytes takes up in the arena
+#define ARENA_SIZE(size) (((size) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+typedef struct arena_block {
+	struct arena_block *next;
+	size_t size;
+	size_t used;
+} arena_block_t;
+
+// Bump allocator. Nothing is freed on its own, arena_free() releases
+// everything at once.
+typedef struct arena {
+	arena_block_t *blocks;
+} arena_t;
+
+void arena_reserve(arena_t *arena, size_t size);
+void *arena_alloc(arena_t *arena, size_t size);
+void *arena_calloc(arena_t *arena, size_t size);
+void arena_free(arena_t *arena);
+
+#endif /* PPELIB_ARENA_H_ */
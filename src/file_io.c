@@ -0,0 +1,812 @@
+/* Copyright 2021 Hein-Pieter van Braam-Stewart
+ *
+ * This file is part of ppelib (Portable Portable Executable LIBrary)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#if defined __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <fcntl.h>
+#include <io.h>
+#include <limits.h>
+#endif
+
+#if defined HAVE_PWRITEV
+#include <sys/uio.h>
+#endif
+
+#if defined HAVE_FALLOC_INSERT_RANGE
+#include <linux/falloc.h>
+#endif
+
+#if defined HAVE_FICLONERANGE
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+#include "file_io.h"
+#include "platform.h"
+#include "ppe_error.h"
+#include "utils.h"
+
+#define COPY_CHUNK_SIZE (1024 * 1024)
+#define COPY_RANGE_MIN (64 * 1024)
+#define WRITE_BATCH 64
+
+static const uint8_t zeroes[4096];
+
+#if !defined _WIN32
+void file_map(const char *filename, file_mapping_t *mapping) {
+	ppelib_reset_error();
+
+	mapping->data = NULL;
+	mapping->size = 0;
+	mapping->fd = -1;
+
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		ppelib_set_error("Failed to open file");
+		return;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < 0) {
+		close(fd);
+		ppelib_set_error("Unable to read file length");
+		return;
+	}
+
+	if (!st.st_size) {
+		close(fd);
+		ppelib_set_error("Empty file");
+		return;
+	}
+
+	// Private mappings never write back to the file. Note that pages we haven't
+	// touched yet still reflect outside changes to the file.
+	void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		close(fd);
+		ppelib_set_error("Failed to map file");
+		return;
+	}
+
+	// Kept open so ranges can be copied to the output without going through memory
+	mapping->data = data;
+	mapping->size = (size_t)st.st_size;
+	mapping->fd = fd;
+}
+
+void file_unmap(file_mapping_t *mapping) {
+	if (mapping->data) {
+		munmap(mapping->data, mapping->size);
+	}
+
+	if (mapping->fd >= 0) {
+		close(mapping->fd);
+	}
+
+	mapping->data = NULL;
+	mapping->size = 0;
+	mapping->fd = -1;
+}
+#else
+// No mmap() here, fall back to reading the whole file. Callers can't tell the difference.
+void file_map(const char *filename, file_mapping_t *mapping) {
+	ppelib_reset_error();
+
+	mapping->data = NULL;
+	mapping->size = 0;
+	mapping->fd = -1;
+
+	FILE *f = fopen(filename, "rb");
+	if (!f) {
+		ppelib_set_error("Failed to open file");
+		return;
+	}
+
+	fseek(f, 0, SEEK_END);
+	long ftell_size = ftell(f);
+	rewind(f);
+
+	if (ftell_size < 0) {
+		fclose(f);
+		ppelib_set_error("Unable to read file length");
+		return;
+	}
+
+	if (!ftell_size) {
+		fclose(f);
+		ppelib_set_error("Empty file");
+		return;
+	}
+
+	uint8_t *data = malloc((size_t)ftell_size);
+	if (!data) {
+		fclose(f);
+		ppelib_set_error("Failed to allocate file data");
+		return;
+	}
+
+	size_t retsize = fread(data, 1, (size_t)ftell_size, f);
+	fclose(f);
+
+	if (retsize != (size_t)ftell_size) {
+		free(data);
+		ppelib_set_error("Failed to read file data");
+		return;
+	}
+
+	mapping->data = data;
+	mapping->size = (size_t)ftell_size;
+}
+
+void file_unmap(file_mapping_t *mapping) {
+	free(mapping->data);
+
+	mapping->data = NULL;
+	mapping->size = 0;
+	mapping->fd = -1;
+}
+#endif
+
+#if !defined _WIN32
+int file_open_rw(const char *filename) {
+	int fd = open(filename, O_RDWR);
+	if (fd < 0) {
+		ppelib_set_error("Failed to open file");
+	}
+
+	return fd;
+}
+
+void file_close(int fd) {
+	if (close(fd) != 0) {
+		ppelib_set_error("Failed to write data");
+	}
+}
+
+size_t file_size(int fd) {
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < 0) {
+		ppelib_set_error("Unable to read file length");
+		return 0;
+	}
+
+	return (size_t)st.st_size;
+}
+
+size_t file_pread(int fd, uint8_t *buffer, size_t offset, size_t size) {
+	size_t total = 0;
+
+	while (total < size) {
+		ssize_t retsize = pread(fd, buffer + total, size - total, (off_t)(offset + total));
+		if (retsize < 0 && errno == EINTR) {
+			continue;
+		}
+		if (retsize <= 0) {
+			ppelib_set_error("Failed to read file data");
+			break;
+		}
+
+		total += (size_t)retsize;
+	}
+
+	return total;
+}
+
+size_t file_pwrite(int fd, const uint8_t *buffer, size_t offset, size_t size) {
+	size_t total = 0;
+
+	while (total < size) {
+		ssize_t retsize = pwrite(fd, buffer + total, size - total, (off_t)(offset + total));
+		if (retsize < 0 && errno == EINTR) {
+			continue;
+		}
+		if (retsize <= 0) {
+			ppelib_set_error("Failed to write data");
+			break;
+		}
+
+		total += (size_t)retsize;
+	}
+
+	return total;
+}
+#else
+int file_open_rw(const char *filename) {
+	int fd = _open(filename, _O_RDWR | _O_BINARY);
+	if (fd < 0) {
+		ppelib_set_error("Failed to open file");
+	}
+
+	return fd;
+}
+
+void file_close(int fd) {
+	if (_close(fd) != 0) {
+		ppelib_set_error("Failed to write data");
+	}
+}
+
+size_t file_size(int fd) {
+	__int64 size = _filelengthi64(fd);
+	if (size < 0) {
+		ppelib_set_error("Unable to read file length");
+		return 0;
+	}
+
+	return (size_t)size;
+}
+
+// No pread() here, seek and read instead. We're the only user of the descriptor.
+size_t file_pread(int fd, uint8_t *buffer, size_t offset, size_t size) {
+	if (_lseeki64(fd, (__int64)offset, SEEK_SET) < 0) {
+		ppelib_set_error("Failed to read file data");
+		return 0;
+	}
+
+	size_t total = 0;
+	while (total < size) {
+		int retsize = _read(fd, buffer + total, (unsigned int)MIN(size - total, INT_MAX));
+		if (retsize <= 0) {
+			ppelib_set_error("Failed to read file data");
+			break;
+		}
+
+		total += (size_t)retsize;
+	}
+
+	return total;
+}
+
+size_t file_pwrite(int fd, const uint8_t *buffer, size_t offset, size_t size) {
+	if (_lseeki64(fd, (__int64)offset, SEEK_SET) < 0) {
+		ppelib_set_error("Failed to write data");
+		return 0;
+	}
+
+	size_t total = 0;
+	while (total < size) {
+		int retsize = _write(fd, buffer + total, (unsigned int)MIN(size - total, INT_MAX));
+		if (retsize <= 0) {
+			ppelib_set_error("Failed to write data");
+			break;
+		}
+
+		total += (size_t)retsize;
+	}
+
+	return total;
+}
+#endif
+
+#if defined HAVE_FALLOC_INSERT_RANGE
+// Ranges can only be inserted and removed in whole filesystem blocks
+size_t file_block_size(int fd) {
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_blksize <= 0) {
+		return 0;
+	}
+
+	return (size_t)st.st_blksize;
+}
+
+// Not every filesystem supports these. Failing isn't an error, callers fall
+// back to rewriting the file and the file is left as it was.
+uint8_t file_insert_range(int fd, size_t offset, size_t size) {
+	return fallocate(fd, FALLOC_FL_INSERT_RANGE, (off_t)offset, (off_t)size) == 0;
+}
+
+uint8_t file_collapse_range(int fd, size_t offset, size_t size) {
+	return fallocate(fd, FALLOC_FL_COLLAPSE_RANGE, (off_t)offset, (off_t)size) == 0;
+}
+#else
+size_t file_block_size(int fd) {
+	(void)fd;
+	return 0;
+}
+
+uint8_t file_insert_range(int fd, size_t offset, size_t size) {
+	(void)fd;
+	(void)offset;
+	(void)size;
+	return 0;
+}
+
+uint8_t file_collapse_range(int fd, size_t offset, size_t size) {
+	(void)fd;
+	(void)offset;
+	(void)size;
+	return 0;
+}
+#endif
+
+size_t source_read(const source_t *source, uint8_t *buffer, size_t offset, size_t size) {
+	if (offset > source->size || size > source->size - offset) {
+		ppelib_set_error("Read past end of file");
+		return 0;
+	}
+
+	if (source->buffer) {
+		memcpy(buffer, source->buffer + offset, size);
+		return size;
+	}
+
+	size_t total = 0;
+	while (total < size) {
+		size_t retsize = source->read(source->userdata, buffer + total, offset + total, size - total);
+		if (!retsize || retsize > size - total) {
+			ppelib_set_error("Failed to read file data");
+			return total;
+		}
+
+		total += retsize;
+	}
+
+	return total;
+}
+
+// Whether filename is the file source was opened from. Writing to it would
+// pull the data out from under us.
+uint8_t source_is_file(const source_t *source, const char *filename) {
+#if !defined _WIN32
+	struct stat source_st;
+	struct stat file_st;
+
+	if (source->fd < 0 || fstat(source->fd, &source_st) != 0 || stat(filename, &file_st) != 0) {
+		return 0;
+	}
+
+	return source_st.st_dev == file_st.st_dev && source_st.st_ino == file_st.st_ino;
+#else
+	(void)source;
+	(void)filename;
+	return 0;
+#endif
+}
+
+uint8_t source_is_fd(const source_t *source, int fd) {
+#if !defined _WIN32
+	struct stat source_st;
+	struct stat fd_st;
+
+	if (source->fd < 0 || fstat(source->fd, &source_st) != 0 || fstat(fd, &fd_st) != 0) {
+		return 0;
+	}
+
+	return source_st.st_dev == fd_st.st_dev && source_st.st_ino == fd_st.st_ino;
+#else
+	(void)source;
+	(void)fd;
+	return 0;
+#endif
+}
+
+void write_plan_init(write_plan_t *plan, size_t max_segments) {
+	plan->headers = NULL;
+	plan->size = 0;
+	plan->numb_segments = 0;
+	plan->segments = calloc(max_segments, sizeof(write_segment_t));
+	if (!plan->segments && max_segments) {
+		ppelib_set_error("Failed to allocate write plan");
+	}
+}
+
+// Callers size the plan up front, there's no growing it here
+void write_plan_add(write_plan_t *plan, const uint8_t *data, const source_t *source, size_t source_offset, size_t size) {
+	if (!size) {
+		return;
+	}
+
+	plan->size += size;
+
+	if (!data && !source && plan->numb_segments) {
+		write_segment_t *last = &plan->segments[plan->numb_segments - 1];
+		if (!last->data && !last->source) {
+			last->size += size;
+			return;
+		}
+	}
+
+	write_segment_t *segment = &plan->segments[plan->numb_segments];
+	segment->data = data;
+	segment->source = source;
+	segment->source_offset = source_offset;
+	segment->size = size;
+
+	plan->numb_segments++;
+}
+
+void write_plan_free(write_plan_t *plan) {
+	free(plan->headers);
+	free(plan->segments);
+
+	plan->headers = NULL;
+	plan->segments = NULL;
+	plan->numb_segments = 0;
+	plan->size = 0;
+}
+
+// Where the segment's bytes live in memory, NULL if they have to be read or are zeroes
+static const uint8_t *segment_memory(const write_segment_t *segment) {
+	if (segment->data) {
+		return segment->data;
+	}
+
+	const source_t *source = segment->source;
+	if (!source || !source->buffer) {
+		return NULL;
+	}
+
+	if (segment->source_offset > source->size || segment->size > source->size - segment->source_offset) {
+		ppelib_set_error("Read past end of file");
+		return NULL;
+	}
+
+	return source->buffer + segment->source_offset;
+}
+
+size_t write_plan_to_sink(const write_plan_t *plan, ppelib_write_func write, void *userdata) {
+	size_t written = 0;
+	uint8_t *chunk = NULL;
+
+	for (size_t i = 0; i < plan->numb_segments; ++i) {
+		const write_segment_t *segment = &plan->segments[i];
+
+		const uint8_t *data = segment_memory(segment);
+		if (ppelib_error_peek()) {
+			goto out;
+		}
+
+		if (data) {
+			if (write(userdata, data, segment->size) != segment->size) {
+				ppelib_set_error("Failed to write data");
+				goto out;
+			}
+
+			written += segment->size;
+			continue;
+		}
+
+		if (segment->source && !chunk) {
+			chunk = malloc(COPY_CHUNK_SIZE);
+			if (!chunk) {
+				ppelib_set_error("Failed to allocate buffer");
+				goto out;
+			}
+		}
+
+		size_t offset = segment->source_offset;
+		size_t size = segment->size;
+		while (size) {
+			size_t this_size;
+
+			if (segment->source) {
+				this_size = MIN(size, COPY_CHUNK_SIZE);
+				if (source_read(segment->source, chunk, offset, this_size) != this_size) {
+					goto out;
+				}
+				data = chunk;
+			} else {
+				this_size = MIN(size, sizeof(zeroes));
+				data = zeroes;
+			}
+
+			if (write(userdata, data, this_size) != this_size) {
+				ppelib_set_error("Failed to write data");
+				goto out;
+			}
+
+			written += this_size;
+			offset += this_size;
+			size -= this_size;
+		}
+	}
+
+out:
+	free(chunk);
+	return written;
+}
+
+static size_t fd_write(void *userdata, const uint8_t *buffer, size_t size) {
+	int fd = *(int *)userdata;
+	size_t total = 0;
+
+	while (total < size) {
+#if !defined _WIN32
+		ssize_t retsize = write(fd, buffer + total, size - total);
+		if (retsize < 0 && errno == EINTR) {
+			continue;
+		}
+#else
+		int retsize = _write(fd, buffer + total, (unsigned int)MIN(size - total, INT_MAX));
+#endif
+		if (retsize <= 0) {
+			break;
+		}
+
+		total += (size_t)retsize;
+	}
+
+	return total;
+}
+
+#if defined HAVE_PWRITEV
+// Writes all of iov at offset, picking up after short writes
+static uint8_t write_iov(int fd, struct iovec *iov, int numb_iov, size_t offset) {
+	while (numb_iov) {
+		ssize_t retsize = pwritev(fd, iov, numb_iov, (off_t)offset);
+		if (retsize < 0 && errno == EINTR) {
+			continue;
+		}
+		if (retsize <= 0) {
+			return 0;
+		}
+
+		size_t done = (size_t)retsize;
+		offset += done;
+
+		while (numb_iov && done >= iov->iov_len) {
+			done -= iov->iov_len;
+			iov++;
+			numb_iov--;
+		}
+
+		if (numb_iov) {
+			iov->iov_base = (uint8_t *)iov->iov_base + done;
+			iov->iov_len -= done;
+		}
+	}
+
+	return 1;
+}
+
+// Copies a source range into fd at out_offset, through the kernel when it can
+static void copy_range(const source_t *source, size_t offset, size_t size, int fd, size_t out_offset) {
+#if defined HAVE_COPY_FILE_RANGE
+	if (source->fd >= 0) {
+		while (size) {
+			loff_t in_offset = (loff_t)offset;
+			loff_t to_offset = (loff_t)out_offset;
+			ssize_t copied = copy_file_range(source->fd, &in_offset, fd, &to_offset, size, 0);
+			if (copied <= 0) {
+				break;
+			}
+
+			offset += (size_t)copied;
+			out_offset += (size_t)copied;
+			size -= (size_t)copied;
+		}
+	}
+#endif
+
+	if (!size) {
+		return;
+	}
+
+	size_t chunk_size = MIN(size, COPY_CHUNK_SIZE);
+	uint8_t *chunk = malloc(chunk_size);
+	if (!chunk) {
+		ppelib_set_error("Failed to allocate buffer");
+		return;
+	}
+
+	while (size) {
+		size_t this_size = MIN(size, chunk_size);
+		if (source_read(source, chunk, offset, this_size) != this_size) {
+			break;
+		}
+
+		struct iovec iov = {chunk, this_size};
+		if (!write_iov(fd, &iov, 1, out_offset)) {
+			ppelib_set_error("Failed to write data");
+			break;
+		}
+
+		offset += this_size;
+		out_offset += this_size;
+		size -= this_size;
+	}
+
+	free(chunk);
+}
+
+// Copies a source range into fd at out_offset. On filesystems that can share
+// extents between files the whole blocks in the middle are cloned rather than
+// copied, the rest goes through copy_range().
+static void source_copy_to_fd(const source_t *source, size_t offset, size_t size, int fd, size_t out_offset) {
+	if (offset > source->size || size > source->size - offset) {
+		ppelib_set_error("Read past end of file");
+		return;
+	}
+
+#if defined HAVE_FICLONERANGE
+	struct stat st;
+	if (source->fd >= 0 && fstat(fd, &st) == 0 && st.st_blksize > 0) {
+		size_t block_size = (size_t)st.st_blksize;
+
+		// Cloning needs both ends on the same block boundary
+		size_t head = (block_size - offset % block_size) % block_size;
+		if (offset % block_size == out_offset % block_size && size > head) {
+			size_t clone_size = (size - head) - (size - head) % block_size;
+
+			if (clone_size) {
+				copy_range(source, offset, head, fd, out_offset);
+				if (ppelib_error_peek()) {
+					return;
+				}
+
+				struct file_clone_range range;
+				range.src_fd = source->fd;
+				range.src_offset = offset + head;
+				range.src_length = clone_size;
+				range.dest_offset = out_offset + head;
+
+				if (ioctl(fd, FICLONERANGE, &range) == 0) {
+					copy_range(source, offset + head + clone_size, size - head - clone_size, fd, out_offset + head + clone_size);
+				} else {
+					copy_range(source, offset + head, size - head, fd, out_offset + head);
+				}
+
+				return;
+			}
+		}
+	}
+#endif
+
+	copy_range(source, offset, size, fd, out_offset);
+}
+#endif
+
+// Writes the plan at fd's current position and leaves the position after it,
+// like write() would. Memory is handed to the kernel in batches with pwritev(),
+// unloaded ranges are copied straight from their file when possible. Pipes and
+// sockets are written to sequentially.
+size_t write_plan_to_fd(const write_plan_t *plan, int fd) {
+#if defined HAVE_PWRITEV
+	off_t position = lseek(fd, 0, SEEK_CUR);
+	if (position < 0) {
+		return write_plan_to_sink(plan, fd_write, &fd);
+	}
+
+	struct iovec iov[WRITE_BATCH];
+	int numb_iov = 0;
+	size_t start = (size_t)position;
+	size_t batch_offset = start;
+	size_t batch_size = 0;
+	size_t offset = start;
+
+	for (size_t i = 0; i < plan->numb_segments; ++i) {
+		const write_segment_t *segment = &plan->segments[i];
+
+		const uint8_t *data = segment_memory(segment);
+		if (ppelib_error_peek()) {
+			goto out;
+		}
+
+		// Let the kernel copy larger ranges from their file, even when they are mapped
+		if (segment->source && (!data || (segment->source->fd >= 0 && segment->size >= COPY_RANGE_MIN))) {
+			if (numb_iov && !write_iov(fd, iov, numb_iov, batch_offset)) {
+				ppelib_set_error("Failed to write data");
+				goto out;
+			}
+
+			numb_iov = 0;
+			batch_size = 0;
+			batch_offset = offset;
+
+			source_copy_to_fd(segment->source, segment->source_offset, segment->size, fd, offset);
+			if (ppelib_error_peek()) {
+				goto out;
+			}
+
+			offset += segment->size;
+			batch_offset = offset;
+			continue;
+		}
+
+		size_t size = segment->size;
+		while (size) {
+			if (numb_iov == WRITE_BATCH) {
+				if (!write_iov(fd, iov, numb_iov, batch_offset)) {
+					ppelib_set_error("Failed to write data");
+					goto out;
+				}
+
+				batch_offset += batch_size;
+				numb_iov = 0;
+				batch_size = 0;
+			}
+
+			size_t this_size = data ? size : MIN(size, sizeof(zeroes));
+			iov[numb_iov].iov_base = (void *)(data ? data : zeroes);
+			iov[numb_iov].iov_len = this_size;
+			numb_iov++;
+
+			if (data) {
+				data += this_size;
+			}
+
+			batch_size += this_size;
+			offset += this_size;
+			size -= this_size;
+		}
+	}
+
+	if (numb_iov && !write_iov(fd, iov, numb_iov, batch_offset)) {
+		ppelib_set_error("Failed to write data");
+		goto out;
+	}
+
+	batch_offset = offset;
+
+out:
+	// Everything before batch_offset made it to the file
+	lseek(fd, (off_t)batch_offset, SEEK_SET);
+	return batch_offset - start;
+#else
+	return write_plan_to_sink(plan, fd_write, &fd);
+#endif
+}
+
+#if defined _WIN32
+static size_t file_write(void *userdata, const uint8_t *buffer, size_t size) {
+	return fwrite(buffer, 1, size, (FILE *)userdata);
+}
+#endif
+
+size_t write_plan_to_file(const write_plan_t *plan, const char *filename) {
+#if !defined _WIN32
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		ppelib_set_error("Failed to open file");
+		return 0;
+	}
+
+	size_t written = write_plan_to_fd(plan, fd);
+
+	if (close(fd) != 0 && !ppelib_error_peek()) {
+		ppelib_set_error("Failed to write data");
+	}
+#else
+	FILE *f = fopen(filename, "wb");
+	if (!f) {
+		ppelib_set_error("Failed to open file");
+		return 0;
+	}
+
+	size_t written = write_plan_to_sink(plan, file_write, f);
+
+	if (fclose(f) != 0 && !ppelib_error_peek()) {
+		ppelib_set_error("Failed to write data");
+	}
+#endif
+
+	return written;
+}
@@ -0,0 +1,86 @@
+/* Copyright 2021 Hein-Pieter van Braam-Stewart
+ *
+ * This file is part of ppelib (Portable Portable Executable LIBrary)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PPELIB_FILE_IO_H_
+#define PPELIB_FILE_IO_H_
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "pperesource/pperesource.h"
+
+// Where data we haven't loaded yet can be fetched from. Either through read(),
+// or straight from buffer when the whole file is in memory. When fd isn't -1
+// it refers to the same file and is used to copy ranges without reading them.
+typedef struct source {
+	ppelib_read_func read;
+	void *userdata;
+	const uint8_t *buffer;
+	int fd;
+	size_t size;
+} source_t;
+
+// A run of output bytes. Taken from data, from source at source_offset, or
+// zeroes when neither is set. When both are set they hold the same bytes and
+// the writer picks whichever is cheaper.
+typedef struct write_segment {
+	const uint8_t *data;
+	const source_t *source;
+	size_t source_offset;
+	size_t size;
+} write_segment_t;
+
+// The output file as a list of segments in file order. Only headers is owned
+// by the plan, everything else points at data that already exists.
+typedef struct write_plan {
+	uint8_t *headers;
+	size_t size;
+	size_t numb_segments;
+	write_segment_t *segments;
+} write_plan_t;
+
+typedef struct file_mapping {
+	uint8_t *data;
+	size_t size;
+	int fd;
+} file_mapping_t;
+
+void file_map(const char *filename, file_mapping_t *mapping);
+void file_unmap(file_mapping_t *mapping);
+
+size_t source_read(const source_t *source, uint8_t *buffer, size_t offset, size_t size);
+int file_open_rw(const char *filename);
+void file_close(int fd);
+size_t file_size(int fd);
+size_t file_pread(int fd, uint8_t *buffer, size_t offset, size_t size);
+size_t file_pwrite(int fd, const uint8_t *buffer, size_t offset, size_t size);
+size_t file_block_size(int fd);
+uint8_t file_insert_range(int fd, size_t offset, size_t size);
+uint8_t file_collapse_range(int fd, size_t offset, size_t size);
+
+uint8_t source_is_file(const source_t *source, const char *filename);
+uint8_t source_is_fd(const source_t *source, int fd);
+
+void write_plan_init(write_plan_t *plan, size_t max_segments);
+void write_plan_add(write_plan_t *plan, const uint8_t *data, const source_t *source, size_t source_offset, size_t size);
+void write_plan_free(write_plan_t *plan);
+
+size_t write_plan_to_sink(const write_plan_t *plan, ppelib_write_func write, void *userdata);
+size_t write_plan_to_fd(const write_plan_t *plan, int fd);
+size_t write_plan_to_file(const write_plan_t *plan, const char *filename);
+
+#endif /* PPELIB_FILE_IO_H_ */
@@ -24,6 +24,7 @@
 #include "pe/constants.h"
 #include "resources/resource.h"
 
+#include "file_io.h"
 #include "main.h"
 #include "ppelib_internal.h"
 
@@ -33,8 +34,12 @@ EXPORT_SYM ppelib_file_t *ppelib_create() {
 	ppelib_file_t *pe = calloc(sizeof(ppelib_file_t), 1);
 	if (!pe) {
 		ppelib_set_error("Failed to allocate PE structure");
+		return NULL;
 	}
 
+	pe->mapping.fd = -1;
+	pe->source.fd = -1;
+
 	return pe;
 }
 
@@ -45,26 +50,54 @@ EXPORT_SYM void ppelib_destroy(ppelib_file_t *pe) {
 
 	if (pe->sections) {
 		for (uint16_t i = 0; i < pe->header.number_of_sections; ++i) {
-			free(pe->sections[i]->contents);
-			free(pe->sections[i]);
+			if (pe->sections[i]) {
+				section_free(pe->sections[i]);
+			}
 		}
 	}
 
 	resource_table_free(&pe->resource_table);
 
-	free(pe->stub);
+	if (!pe->stub_borrowed) {
+		free(pe->stub);
+	}
+	if (!pe->overlay_borrowed) {
+		free(pe->overlay);
+	}
 	free(pe->data_directories);
 	free(pe->sections);
-	free(pe->overlay);
+
+	// Everything borrowed from the mapping is gone now
+	file_unmap(&pe->mapping);
+
+	// Only this thread's, other threads close theirs when they destroy a handle
+	close_string_converters();
 
 	free(pe);
 	pe = NULL;
 }
 
-EXPORT_SYM ppelib_file_t *ppelib_create_from_buffer(const uint8_t *buffer, size_t size) {
+// Only the first buffer_size bytes of the size byte file are in buffer. Anything
+// past that is left in source and only fetched when needed.
+//
+// When borrow is set the buffer outlives the handle and the stub, section
+// contents, resource data and overlay point straight into it instead of
+// being copied.
+//
+// flags are ppelib_parse_flags, anything they skip is never looked at.
+static ppelib_file_t *parse_buffer(const uint8_t *buffer, size_t buffer_size, size_t size, const source_t *source, uint8_t borrow, uint32_t flags) {
 	ppelib_reset_error();
 
-	if (size < 2) {
+	if (flags & PPELIB_PARSE_VALIDATE_ONLY) {
+		borrow = 1;
+		flags |= PPELIB_PARSE_SKIP_OVERLAY | PPELIB_PARSE_SKIP_RESOURCE_DATA;
+	}
+
+	if (flags & PPELIB_PARSE_SKIP_RESOURCE_DATA) {
+		flags |= PPELIB_PARSE_SKIP_VERSIONINFO | PPELIB_PARSE_SKIP_ICONS;
+	}
+
+	if (buffer_size < 2) {
 		ppelib_set_error("Not a PE file (too small for MZ signature)");
 		return NULL;
 	}
@@ -80,25 +113,34 @@ EXPORT_SYM ppelib_file_t *ppelib_create_from_buffer(const uint8_t *buffer, size_
 		return NULL;
 	}
 
-	if (size < 0x3c + sizeof(uint32_t)) {
+	if (source) {
+		pe->source = *source;
+	}
+
+	if (buffer_size < 0x3c + sizeof(uint32_t)) {
 		ppelib_set_error("File too small for PE header");
 		goto out;
 	}
 
 	pe->pe_header_offset = read_uint32_t(buffer + 0x3C);
 
-	if (size < pe->pe_header_offset + sizeof(uint32_t)) {
+	if (buffer_size < pe->pe_header_offset + sizeof(uint32_t)) {
 		ppelib_set_error("Not a PE file (file too small)");
 		goto out;
 	}
 
 	pe->stub_size = pe->pe_header_offset;
-	pe->stub = malloc(pe->stub_size);
-	if (!pe->stub) {
-		ppelib_set_error("Couldn't allocate DOS stub");
-		goto out;
+	if (borrow) {
+		pe->stub = (uint8_t *)buffer;
+		pe->stub_borrowed = 1;
+	} else {
+		pe->stub = malloc(pe->stub_size);
+		if (!pe->stub) {
+			ppelib_set_error("Couldn't allocate DOS stub");
+			goto out;
+		}
+		memcpy(pe->stub, buffer, pe->stub_size);
 	}
-	memcpy(pe->stub, buffer, pe->stub_size);
 
 	uint32_t signature = read_uint32_t(buffer + pe->pe_header_offset);
 	if (signature != PE_SIGNATURE) {
@@ -108,7 +150,7 @@ EXPORT_SYM ppelib_file_t *ppelib_create_from_buffer(const uint8_t *buffer, size_
 
 	size_t header_offset = pe->pe_header_offset + 4;
 
-	size_t header_size = header_deserialize(buffer, size, header_offset, &pe->header);
+	size_t header_size = header_deserialize(buffer, buffer_size, header_offset, &pe->header);
 	if (ppelib_error_peek()) {
 		goto out;
 	}
@@ -121,11 +163,11 @@ EXPORT_SYM ppelib_file_t *ppelib_create_from_buffer(const uint8_t *buffer, size_
 	}
 
 	size_t data_directories_size = (pe->header.number_of_rva_and_sizes * DATA_DIRECTORY_SIZE);
-	if (header_offset + header_size + data_directories_size > size) {
+	if (header_offset + header_size + data_directories_size > buffer_size) {
 		pe->header.number_of_rva_and_sizes = MIN(pe->header.number_of_rva_and_sizes, 16);
 
 		data_directories_size = (pe->header.number_of_rva_and_sizes * DATA_DIRECTORY_SIZE);
-		if (header_offset + header_size + data_directories_size > size) {
+		if (header_offset + header_size + data_directories_size > buffer_size) {
 			ppelib_set_error("File too small for directory entries");
 			goto out;
 		}
@@ -133,7 +175,7 @@ EXPORT_SYM ppelib_file_t *ppelib_create_from_buffer(const uint8_t *buffer, size_
 
 	size_t section_offset = header_offset + COFF_HEADER_SIZE + pe->header.size_of_optional_header;
 	pe->start_of_section_data = ((size_t)(pe->header.number_of_sections) * SECTION_SIZE) + section_offset;
-	if (pe->start_of_section_data > size && pe->header.number_of_sections) {
+	if (pe->start_of_section_data > buffer_size && pe->header.number_of_sections) {
 		ppelib_set_error("File too small for section headers");
 		goto out;
 	}
@@ -162,7 +204,7 @@ EXPORT_SYM ppelib_file_t *ppelib_create_from_buffer(const uint8_t *buffer, size_
 	char first_section = 1;
 
 	for (uint16_t i = 0; i < pe->header.number_of_sections; ++i) {
-		size_t section_size = section_deserialize(buffer, size, offset, pe->sections[i]);
+		size_t section_size = section_deserialize(buffer, buffer_size, offset, pe->sections[i]);
 		if (ppelib_error_peek()) {
 			goto out;
 		}
@@ -187,14 +229,22 @@ EXPORT_SYM ppelib_file_t *ppelib_create_from_buffer(const uint8_t *buffer, size_
 			goto out;
 		}
 
-		section->contents = malloc(data_size);
-		if (!section->contents) {
-			ppelib_set_error("Failed to allocate section data");
-			goto out;
-		}
-
 		section->contents_size = data_size;
-		memcpy(section->contents, buffer + section->pointer_to_raw_data, section->contents_size);
+		if (section->pointer_to_raw_data + data_size > buffer_size) {
+			section->source = &pe->source;
+			section->source_offset = section->pointer_to_raw_data;
+		} else if (borrow) {
+			section->contents = (uint8_t *)buffer + section->pointer_to_raw_data;
+			section->contents_borrowed = 1;
+		} else {
+			section->contents = malloc(data_size);
+			if (!section->contents) {
+				ppelib_set_error("Failed to allocate section data");
+				goto out;
+			}
+
+			memcpy(section->contents, buffer + section->pointer_to_raw_data, section->contents_size);
+		}
 
 		if (section->pointer_to_raw_data) {
 			if (first_section) {
@@ -244,60 +294,54 @@ EXPORT_SYM ppelib_file_t *ppelib_create_from_buffer(const uint8_t *buffer, size_
 	}
 
 	pe->end_of_section_data = MAX(pe->end_of_section_data, header_offset + header_size);
-	if (size > pe->end_of_section_data) {
+	if (size > pe->end_of_section_data && !(flags & PPELIB_PARSE_SKIP_OVERLAY)) {
 		pe->overlay_size = size - pe->end_of_section_data;
-		pe->overlay = malloc(pe->overlay_size);
-		if (!pe->overlay) {
-			ppelib_set_error("Failed to allocate overlay data");
-			goto out;
-		}
+		if (source) {
+			// Overlays can be huge, never load them if we can get at them later
+			pe->overlay_source = &pe->source;
+			pe->overlay_source_offset = pe->end_of_section_data;
+		} else if (borrow) {
+			pe->overlay = (uint8_t *)buffer + pe->end_of_section_data;
+			pe->overlay_borrowed = 1;
+		} else {
+			pe->overlay = malloc(pe->overlay_size);
+			if (!pe->overlay) {
+				ppelib_set_error("Failed to allocate overlay data");
+				goto out;
+			}
 
-		memcpy(pe->overlay, buffer + pe->end_of_section_data, pe->overlay_size);
+			memcpy(pe->overlay, buffer + pe->end_of_section_data, pe->overlay_size);
+		}
 	}
 
-	if (pe->header.number_of_rva_and_sizes > DIR_RESOURCE_TABLE) {
+	// Pretend they're decoded already, that leaves them empty
+	pe->resource_table.versioninfo_decoded = !!(flags & PPELIB_PARSE_SKIP_VERSIONINFO);
+	pe->resource_table.icon_groups_decoded = !!(flags & PPELIB_PARSE_SKIP_ICONS);
+	pe->resource_table.data_skipped = !!(flags & PPELIB_PARSE_SKIP_RESOURCE_DATA);
+
+	if (pe->header.number_of_rva_and_sizes > DIR_RESOURCE_TABLE && !(flags & PPELIB_PARSE_SKIP_RESOURCES)) {
 		section_t *section = pe->data_directories[DIR_RESOURCE_TABLE].section;
 		size_t offset = pe->data_directories[DIR_RESOURCE_TABLE].offset;
 
 		if (section) {
+			// The only section a reader has to fetch up front. Mapped and
+			// borrowed contents stay where they are, resources borrow from them.
+			if (section->source) {
+				section_own_contents(section);
+				if (ppelib_error_peek()) {
+					goto out;
+				}
+			}
+
 			resource_table_deserialize(section, offset, &pe->resource_table);
 			if (ppelib_error_peek()) {
 				goto out;
 			}
-		}
-	}
 
-	{
-		size_t nmb = resource_count_by_type_id(&pe->resource_table, RT_VERSION);
-		if (nmb) {
-			pe->resource_table.numb_versioninfo = nmb;
-			pe->resource_table.versioninfo = calloc(sizeof(version_info_t) * nmb, 1);
-			for (size_t i = 0; i < nmb; ++i) {
-				resource_t *res = resource_get_by_type_id(&pe->resource_table, RT_VERSION, i);
-				versioninfo_deserialize(res, &pe->resource_table.versioninfo[i]);
-			}
-			if (ppelib_error_peek()) {
-				//printf("Versioninfo_deserialize: %s\n", ppelib_error());
-				//ppelib_reset_error();
-			}
+			resource_table_keep_original(&pe->resource_table, section, offset, pe->data_directories[DIR_RESOURCE_TABLE].size);
 		}
 	}
 
-	{
-		size_t nmb = resource_count_by_type_id(&pe->resource_table, RT_GROUP_ICON);
-		if (nmb) {
-			pe->resource_table.numb_icon_group = nmb;
-			pe->resource_table.icongroups = calloc(sizeof(icon_group_t) * nmb, 1);
-			for (size_t i = 0; i < nmb; ++i) {
-				resource_t *res = resource_get_by_type_id(&pe->resource_table, RT_GROUP_ICON, i);
-				icon_group_deserialize(&pe->resource_table, res, &pe->resource_table.icongroups[i]);
-			}
-			if (ppelib_error_peek()) {
-				//printf("Versioninfo_deserialize: %s\n", ppelib_error());
-				//ppelib_reset_error();
-			}
-		}
-	}
 out:
 	if (ppelib_error_peek()) {
 		ppelib_destroy(pe);
@@ -307,6 +351,89 @@ out:
 	return pe;
 }
 
+EXPORT_SYM ppelib_file_t *ppelib_create_from_buffer(const uint8_t *buffer, size_t size) {
+	return parse_buffer(buffer, size, size, NULL, 0, 0);
+}
+
+// The caller guarantees buffer stays valid and unchanged until ppelib_destroy()
+EXPORT_SYM ppelib_file_t *ppelib_create_from_buffer_borrowed(const uint8_t *buffer, size_t size) {
+	return parse_buffer(buffer, size, size, NULL, 1, 0);
+}
+
+EXPORT_SYM ppelib_file_t *ppelib_create_from_buffer_ex(const uint8_t *buffer, size_t size, uint32_t flags) {
+	return parse_buffer(buffer, size, size, NULL, 0, flags);
+}
+
+// How many bytes from the start of the file the headers take, as far as we can
+// tell from the first buffer_size bytes.
+static size_t header_region_size(const uint8_t *buffer, size_t buffer_size) {
+	if (buffer_size < 0x3c + sizeof(uint32_t) || read_uint16_t(buffer) != MZ_SIGNATURE) {
+		return 0x3c + sizeof(uint32_t);
+	}
+
+	size_t header_offset = (size_t)read_uint32_t(buffer + 0x3C) + 4;
+	size_t optional_header_offset = header_offset + COFF_HEADER_SIZE;
+
+	if (buffer_size < optional_header_offset + sizeof(uint16_t)) {
+		return optional_header_offset + sizeof(uint16_t);
+	}
+
+	uint16_t number_of_sections = read_uint16_t(buffer + header_offset + 2);
+	uint16_t size_of_optional_header = read_uint16_t(buffer + header_offset + 16);
+	uint16_t magic = read_uint16_t(buffer + optional_header_offset);
+
+	size_t end_of_section_table = optional_header_offset + size_of_optional_header + ((size_t)number_of_sections * SECTION_SIZE);
+	size_t end_of_header = optional_header_offset;
+	end_of_header += (magic == PE32PLUS_MAGIC) ? PEPLUS_OPTIONAL_HEADER_SIZE : PE_OPTIONAL_HEADER_SIZE;
+
+	if (buffer_size < end_of_header) {
+		return MAX(end_of_section_table, end_of_header);
+	}
+
+	size_t number_of_rva_and_sizes = read_uint32_t(buffer + end_of_header - 4);
+	if (number_of_rva_and_sizes > (UINT32_MAX / DATA_DIRECTORY_SIZE)) {
+		number_of_rva_and_sizes = 16;
+	}
+
+	return MAX(end_of_section_table, end_of_header + (number_of_rva_and_sizes * DATA_DIRECTORY_SIZE));
+}
+
+// Only reads the headers and the resource section. Other sections and the
+// overlay are fetched through read() when they're needed, so userdata has to
+// stay valid until ppelib_destroy().
+EXPORT_SYM ppelib_file_t *ppelib_create_from_reader(ppelib_read_func read, void *userdata, size_t size) {
+	ppelib_reset_error();
+
+	source_t source = {read, userdata, NULL, -1, size};
+
+	uint8_t *buffer = NULL;
+	size_t buffer_size = 0;
+	size_t wanted = MIN(size, 4096);
+
+	while (wanted > buffer_size) {
+		uint8_t *oldptr = buffer;
+		buffer = realloc(buffer, wanted);
+		if (!buffer) {
+			free(oldptr);
+			ppelib_set_error("Failed to allocate header data");
+			return NULL;
+		}
+
+		if (source_read(&source, buffer + buffer_size, buffer_size, wanted - buffer_size) != wanted - buffer_size) {
+			free(buffer);
+			return NULL;
+		}
+
+		buffer_size = wanted;
+		wanted = MIN(size, header_region_size(buffer, buffer_size));
+	}
+
+	ppelib_file_t *pe = parse_buffer(buffer, buffer_size, size, &source, 0, 0);
+	free(buffer);
+
+	return pe;
+}
+
 EXPORT_SYM ppelib_file_t *ppelib_create_from_file(const char *filename) {
 	ppelib_reset_error();
 	size_t file_size;
@@ -359,7 +486,128 @@ EXPORT_SYM ppelib_file_t *ppelib_create_from_file(const char *filename) {
 	return retval;
 }
 
-EXPORT_SYM size_t ppelib_write_to_buffer(const ppelib_file_t *pe, uint8_t *buffer, size_t buf_size) {
+EXPORT_SYM ppelib_file_t *ppelib_create_from_file_mapped(const char *filename) {
+	ppelib_reset_error();
+
+	file_mapping_t mapping;
+	file_map(filename, &mapping);
+	if (ppelib_error_peek()) {
+		return NULL;
+	}
+
+	source_t source = {NULL, NULL, mapping.data, mapping.fd, mapping.size};
+
+	ppelib_file_t *pe = parse_buffer(mapping.data, mapping.size, mapping.size, &source, 1, 0);
+	if (!pe) {
+		file_unmap(&mapping);
+		return NULL;
+	}
+
+	pe->mapping = mapping;
+	return pe;
+}
+
+// Reads the COFF/optional headers, data directories and section table without
+// allocating anything. Returns the size of the header region, 0 on error.
+EXPORT_SYM size_t ppelib_probe(const uint8_t *buffer, size_t size, ppelib_probe_info *probe) {
+	ppelib_reset_error();
+
+	memset(probe, 0, sizeof(ppelib_probe_info));
+
+	if (size < 2) {
+		ppelib_set_error("Not a PE file (too small for MZ signature)");
+		return 0;
+	}
+
+	uint16_t mz_signature = read_uint16_t(buffer);
+	if (mz_signature != MZ_SIGNATURE) {
+		ppelib_set_error("Not a PE file (MZ signature missing)");
+		return 0;
+	}
+
+	if (size < 0x3c + sizeof(uint32_t)) {
+		ppelib_set_error("File too small for PE header");
+		return 0;
+	}
+
+	probe->pe_header_offset = read_uint32_t(buffer + 0x3C);
+
+	if (size < probe->pe_header_offset + sizeof(uint32_t)) {
+		ppelib_set_error("Not a PE file (file too small)");
+		return 0;
+	}
+
+	uint32_t signature = read_uint32_t(buffer + probe->pe_header_offset);
+	if (signature != PE_SIGNATURE) {
+		ppelib_set_error("Not a PE file (PE00 signature missing)");
+		return 0;
+	}
+
+	size_t header_offset = probe->pe_header_offset + 4;
+
+	header_t header;
+	size_t header_size = header_deserialize(buffer, size, header_offset, &header);
+	if (ppelib_error_peek()) {
+		return 0;
+	}
+
+	probe->machine = header.machine;
+	probe->number_of_sections = header.number_of_sections;
+	probe->time_date_stamp = header.time_date_stamp;
+	probe->size_of_optional_header = header.size_of_optional_header;
+	probe->characteristics = header.characteristics;
+	probe->magic = header.magic;
+	probe->address_of_entry_point = header.address_of_entry_point;
+	probe->image_base = header.image_base;
+	probe->section_alignment = header.section_alignment;
+	probe->file_alignment = header.file_alignment;
+	probe->size_of_image = header.size_of_image;
+	probe->size_of_headers = header.size_of_headers;
+	probe->checksum = header.checksum;
+	probe->subsystem = header.subsystem;
+	probe->dll_characteristics = header.dll_characteristics;
+	probe->number_of_rva_and_sizes = header.number_of_rva_and_sizes;
+
+	probe->numb_data_directories = MIN(header.number_of_rva_and_sizes, PPELIB_PROBE_MAX_DATA_DIRECTORIES);
+
+	size_t offset = header_offset + header_size;
+	if (offset + (probe->numb_data_directories * DATA_DIRECTORY_SIZE) > size) {
+		ppelib_set_error("File too small for directory entries");
+		return 0;
+	}
+
+	for (uint32_t i = 0; i < probe->numb_data_directories; ++i) {
+		probe->data_directories[i].virtual_address = read_uint32_t(buffer + offset + 0);
+		probe->data_directories[i].size = read_uint32_t(buffer + offset + 4);
+
+		offset += DATA_DIRECTORY_SIZE;
+	}
+
+	size_t section_offset = header_offset + COFF_HEADER_SIZE + header.size_of_optional_header;
+	probe->numb_sections = MIN(header.number_of_sections, PPELIB_PROBE_MAX_SECTIONS);
+
+	offset = section_offset;
+	for (uint16_t i = 0; i < probe->numb_sections; ++i) {
+		section_t section;
+		offset += section_deserialize(buffer, size, offset, &section);
+		if (ppelib_error_peek()) {
+			return 0;
+		}
+
+		ppelib_probe_section *probe_section = &probe->sections[i];
+		memcpy(probe_section->name, section.name, sizeof(probe_section->name));
+		probe_section->virtual_size = section.virtual_size;
+		probe_section->virtual_address = section.virtual_address;
+		probe_section->size_of_raw_data = section.size_of_raw_data;
+		probe_section->pointer_to_raw_data = section.pointer_to_raw_data;
+		probe_section->characteristics = section.characteristics;
+	}
+
+	return section_offset + ((size_t)(header.number_of_sections) * SECTION_SIZE);
+}
+
+// Offset of the end of the section data, which is where the overlay starts
+static size_t section_data_end(const ppelib_file_t *pe) {
 	size_t size = 0;
 
 	size_t header_size = header_serialize(&pe->header, NULL, 0);
@@ -371,9 +619,6 @@ EXPORT_SYM size_t ppelib_write_to_buffer(const ppelib_file_t *pe, uint8_t *buffe
 	size_t pe_header_offset = pe->pe_header_offset + 4;
 	size_t section_header_offset = pe_header_offset + COFF_HEADER_SIZE + pe->header.size_of_optional_header;
 
-	uint32_t file_alignment = MAX(pe->header.file_alignment, 512);
-	file_alignment = MIN(file_alignment, UINT16_MAX);
-
 	for (uint16_t i = 0; i < pe->header.number_of_sections; ++i) {
 		section_t *section = pe->sections[i];
 
@@ -395,29 +640,32 @@ EXPORT_SYM size_t ppelib_write_to_buffer(const ppelib_file_t *pe, uint8_t *buffe
 	size = MAX(size, pe_header_offset + header_size + data_tables_size);
 	size = MAX(size, section_header_offset + section_header_size);
 
-	size_t end_of_section_data = size;
+	return size;
+}
 
-	size += pe->overlay_size;
+// Offset of the end of the stub, headers, data directories and section table
+static size_t headers_end(const ppelib_file_t *pe) {
+	size_t header_size = header_serialize(&pe->header, NULL, 0);
+	size_t data_tables_size = pe->header.number_of_rva_and_sizes * DATA_DIRECTORY_SIZE;
+	size_t section_header_size = pe->header.number_of_sections * SECTION_SIZE;
 
-	//	printf("dos_header_size: %zi\n", pe->stub_size);
-	//	//printf("dos_stub_size: %zi\n", dos_stub_size);
-	//	printf("header_size: %zi\n", header_size);
-	//	//printf("data_tables_size: %zi\n", data_tables_size);
-	//	printf("section_header_size: %zi\n", section_header_size);
-	//	printf("section_size: %zi\n", section_size);
-	//	printf("overlay_size: %zi\n", pe->overlay_size);
-	//	printf("total: %zi\n", size);
+	size_t pe_header_offset = pe->pe_header_offset + 4;
+	size_t section_header_offset = pe_header_offset + COFF_HEADER_SIZE + pe->header.size_of_optional_header;
 
-	if (!buffer) {
-		return size;
-	}
+	size_t size = pe->stub_size;
+	size = MAX(size, pe_header_offset + header_size + data_tables_size);
+	size = MAX(size, section_header_offset + section_header_size);
 
-	if (buffer && size > buf_size) {
-		ppelib_set_error("Target buffer too small.");
-		return 0;
-	}
+	return size;
+}
+
+// buffer has to be zeroed and at least headers_end() bytes
+static void write_headers(const ppelib_file_t *pe, uint8_t *buffer, size_t end_of_section_data) {
+	size_t header_size = header_serialize(&pe->header, NULL, 0);
+
+	size_t pe_header_offset = pe->pe_header_offset + 4;
+	size_t section_header_offset = pe_header_offset + COFF_HEADER_SIZE + pe->header.size_of_optional_header;
 
-	memset(buffer, 0, size);
 	memcpy(buffer, pe->stub, pe->stub_size);
 	write_uint32_t(buffer + pe->pe_header_offset, PE_SIGNATURE);
 	header_serialize(&pe->header, buffer, pe_header_offset);
@@ -442,62 +690,775 @@ EXPORT_SYM size_t ppelib_write_to_buffer(const ppelib_file_t *pe, uint8_t *buffe
 	}
 
 	offset = section_header_offset;
+	for (uint16_t i = 0; i < pe->header.number_of_sections; ++i) {
+		section_serialize(pe->sections[i], buffer, offset);
+		offset += SECTION_SIZE;
+	}
+}
+
+static size_t write_image(const ppelib_file_t *pe, uint8_t *buffer, size_t buf_size, uint8_t with_overlay) {
+	size_t end_of_section_data = section_data_end(pe);
+	size_t size = end_of_section_data;
+
+	if (with_overlay) {
+		size += pe->overlay_size;
+	}
+
+	if (!buffer) {
+		return size;
+	}
+
+	if (buffer && size > buf_size) {
+		ppelib_set_error("Target buffer too small.");
+		return 0;
+	}
+
+	memset(buffer, 0, size);
+	write_headers(pe, buffer, end_of_section_data);
+
 	for (uint16_t i = 0; i < pe->header.number_of_sections; ++i) {
 		section_t *section = pe->sections[i];
-		section_serialize(section, buffer, offset);
 
 		if (section->contents_size) {
-			memcpy(buffer + section->pointer_to_raw_data, section->contents, section->contents_size);
+			if (section->source) {
+				if (source_read(section->source, buffer + section->pointer_to_raw_data, section->source_offset, section->contents_size) != section->contents_size) {
+					return 0;
+				}
+			} else {
+				memcpy(buffer + section->pointer_to_raw_data, section->contents, section->contents_size);
+			}
 		}
-
-		offset += SECTION_SIZE;
 	}
 
-	if (pe->overlay_size) {
-		memcpy(buffer + end_of_section_data, pe->overlay, pe->overlay_size);
+	if (with_overlay && pe->overlay_size) {
+		if (pe->overlay_source) {
+			if (source_read(pe->overlay_source, buffer + end_of_section_data, pe->overlay_source_offset, pe->overlay_size) != pe->overlay_size) {
+				return 0;
+			}
+		} else {
+			memcpy(buffer + end_of_section_data, pe->overlay, pe->overlay_size);
+		}
 	}
 
 	return size;
 }
 
-EXPORT_SYM size_t ppelib_write_to_file(const ppelib_file_t *pe, const char *filename) {
-	ppelib_reset_error();
+static int compare_raw_data(const void *a, const void *b) {
+	const section_t *section_a = *(section_t *const *)a;
+	const section_t *section_b = *(section_t *const *)b;
 
-	FILE *f = fopen(filename, "wb");
-	if (!f) {
-		ppelib_set_error("Failed to open file");
+	if (section_a->pointer_to_raw_data < section_b->pointer_to_raw_data) {
+		return -1;
+	}
+	if (section_a->pointer_to_raw_data > section_b->pointer_to_raw_data) {
+		return 1;
+	}
+	return 0;
+}
+
+static uint8_t borrowed_from_source(const ppelib_file_t *pe, const uint8_t *data, size_t size) {
+	const source_t *source = &pe->source;
+
+	if (source->fd < 0 || !source->buffer || data < source->buffer) {
 		return 0;
 	}
 
-	size_t bufsize = ppelib_write_to_buffer(pe, NULL, 0);
+	return (size_t)(data - source->buffer) <= source->size && size <= source->size - (size_t)(data - source->buffer);
+}
+
+// Lays the image out as it will be written. Only the headers are rendered,
+// section contents and the overlay are written from wherever they are now.
+//
+// When in_memory is set, or when section contents overlap the headers or each
+// other, the whole image is rendered into the plan instead.
+static void build_write_plan(const ppelib_file_t *pe, write_plan_t *plan, uint8_t in_memory) {
+	uint16_t numb_sections = pe->header.number_of_sections;
+	size_t end_of_section_data = section_data_end(pe);
+	size_t header_end = headers_end(pe);
+	size_t numb_contents = 0;
+
+	section_t **sections = NULL;
+
+	write_plan_init(plan, 2 + (size_t)numb_sections * 2 + 1);
 	if (ppelib_error_peek()) {
-		fclose(f);
-		return 0;
+		return;
 	}
 
-	uint8_t *buffer = malloc(bufsize);
-	if (!buffer) {
+	if (!in_memory && numb_sections) {
+		sections = malloc(sizeof(section_t *) * numb_sections);
+		if (!sections) {
+			ppelib_set_error("Failed to allocate section list");
+			goto out;
+		}
+
+		for (uint16_t i = 0; i < numb_sections; ++i) {
+			if (pe->sections[i]->contents_size) {
+				sections[numb_contents++] = pe->sections[i];
+			}
+		}
+
+		qsort(sections, numb_contents, sizeof(section_t *), compare_raw_data);
+
+		size_t offset = header_end;
+		for (size_t i = 0; i < numb_contents; ++i) {
+			size_t start = sections[i]->pointer_to_raw_data;
+			if (start < offset || sections[i]->contents_size > end_of_section_data - start) {
+				in_memory = 1;
+				break;
+			}
+
+			offset = start + sections[i]->contents_size;
+		}
+	}
+
+	if (in_memory) {
+		size_t size = write_image(pe, NULL, 0, 1);
+
+		plan->headers = malloc(size);
+		if (!plan->headers && size) {
+			ppelib_set_error("Failed to allocate buffer");
+			goto out;
+		}
+
+		if (write_image(pe, plan->headers, size, 1) != size) {
+			goto out;
+		}
+
+		write_plan_add(plan, plan->headers, NULL, 0, size);
+		goto out;
+	}
+
+	plan->headers = calloc(header_end, 1);
+	if (!plan->headers) {
 		ppelib_set_error("Failed to allocate buffer");
-		fclose(f);
-		return 0;
+		goto out;
 	}
 
-	ppelib_write_to_buffer(pe, buffer, bufsize);
-	if (ppelib_error_peek()) {
-		fclose(f);
-		free(buffer);
-		return 0;
+	write_headers(pe, plan->headers, end_of_section_data);
+	write_plan_add(plan, plan->headers, NULL, 0, header_end);
+
+	size_t offset = header_end;
+	for (size_t i = 0; i < numb_contents; ++i) {
+		section_t *section = sections[i];
+
+		write_plan_add(plan, NULL, NULL, 0, section->pointer_to_raw_data - offset);
+		if (section->source) {
+			write_plan_add(plan, NULL, section->source, section->source_offset, section->contents_size);
+		} else if (section->contents_borrowed && borrowed_from_source(pe, section->contents, section->contents_size)) {
+			// Still what's in the file, so it can be copied from there too
+			write_plan_add(plan, section->contents, &pe->source, (size_t)(section->contents - pe->source.buffer), section->contents_size);
+		} else {
+			write_plan_add(plan, section->contents, NULL, 0, section->contents_size);
+		}
+
+		offset = section->pointer_to_raw_data + section->contents_size;
 	}
 
-	size_t written = fwrite(buffer, 1, bufsize, f);
-	fclose(f);
-	free(buffer);
+	write_plan_add(plan, NULL, NULL, 0, end_of_section_data - offset);
 
-	if (written != bufsize) {
-		ppelib_set_error("Failed to write data");
+	if (pe->overlay_source) {
+		write_plan_add(plan, NULL, pe->overlay_source, pe->overlay_source_offset, pe->overlay_size);
+	} else {
+		write_plan_add(plan, pe->overlay, NULL, 0, pe->overlay_size);
 	}
 
-	return written;
+out:
+	free(sections);
+}
+
+EXPORT_SYM size_t ppelib_write_to_buffer(const ppelib_file_t *pe, uint8_t *buffer, size_t buf_size) {
+	return write_image(pe, buffer, buf_size, 1);
+}
+
+EXPORT_SYM size_t ppelib_write_to_file(const ppelib_file_t *pe, const char *filename) {
+	ppelib_reset_error();
+
+	// Truncating the file we were loaded from would pull unloaded and borrowed
+	// data out from under us, so that's the one case where the whole image is
+	// rendered before the file is opened.
+	write_plan_t plan;
+	build_write_plan(pe, &plan, source_is_file(&pe->source, filename));
+	if (ppelib_error_peek()) {
+		write_plan_free(&plan);
+		return 0;
+	}
+
+	size_t written = write_plan_to_file(&plan, filename);
+	write_plan_free(&plan);
+
+	return written;
+}
+
+EXPORT_SYM size_t ppelib_write_to_fd(const ppelib_file_t *pe, int fd) {
+	ppelib_reset_error();
+
+	write_plan_t plan;
+	build_write_plan(pe, &plan, source_is_fd(&pe->source, fd));
+	if (ppelib_error_peek()) {
+		write_plan_free(&plan);
+		return 0;
+	}
+
+	size_t written = write_plan_to_fd(&plan, fd);
+	write_plan_free(&plan);
+
+	return written;
+}
+
+EXPORT_SYM size_t ppelib_write_to_sink(const ppelib_file_t *pe, ppelib_write_func write, void *userdata) {
+	ppelib_reset_error();
+
+	write_plan_t plan;
+	build_write_plan(pe, &plan, 0);
+	if (ppelib_error_peek()) {
+		write_plan_free(&plan);
+		return 0;
+	}
+
+	size_t written = write_plan_to_sink(&plan, write, userdata);
+	write_plan_free(&plan);
+
+	return written;
+}
+
+// 16 bit ones' complement sum of buffer, as laid out at an even file offset
+static uint32_t checksum_words(const uint8_t *buffer, size_t size) {
+	uint32_t sum = 0;
+
+	for (size_t i = 0; i < size; i += 2) {
+		sum += buffer[i];
+		if (i + 1 < size) {
+			sum += (uint32_t)buffer[i + 1] << 8;
+		}
+
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+
+	return sum;
+}
+
+// Writes size bytes of data at offset and keeps a running checksum of
+// what the file held before and what it holds now.
+static void patch_range(int fd, size_t fsize, size_t offset, const uint8_t *data, size_t size, uint32_t *old_sum, uint32_t *new_sum) {
+	// Widen to whole words so the old and new bytes line up in the checksum
+	size_t start = offset & ~(size_t)1;
+	size_t end = MIN(TO_NEAREST(offset + size, 2), fsize);
+
+	uint8_t *buffer = malloc(end - start);
+	if (!buffer) {
+		ppelib_set_error("Failed to allocate buffer");
+		return;
+	}
+
+	if (file_pread(fd, buffer, start, end - start) != end - start) {
+		goto out;
+	}
+
+	*old_sum += checksum_words(buffer, end - start);
+	memcpy(buffer + (offset - start), data, size);
+	*new_sum += checksum_words(buffer, end - start);
+
+	file_pwrite(fd, buffer, start, end - start);
+
+out:
+	free(buffer);
+}
+
+// Whether the file on disk has the same layout as pe. Returns the file's checksum.
+static uint8_t patch_layout_matches(const ppelib_file_t *pe, int fd, size_t fsize, uint32_t *checksum) {
+	size_t header_end = headers_end(pe);
+	if (header_end > fsize) {
+		return 0;
+	}
+
+	uint8_t *buffer = malloc(header_end);
+	if (!buffer) {
+		ppelib_set_error("Failed to allocate buffer");
+		return 0;
+	}
+
+	uint8_t retval = 0;
+	ppelib_probe_info probe;
+
+	if (file_pread(fd, buffer, 0, header_end) != header_end) {
+		goto out;
+	}
+
+	if (!ppelib_probe(buffer, header_end, &probe)) {
+		ppelib_reset_error();
+		goto out;
+	}
+
+	if (probe.pe_header_offset != pe->pe_header_offset || probe.numb_sections != pe->header.number_of_sections ||
+			probe.size_of_optional_header != pe->header.size_of_optional_header ||
+			probe.numb_data_directories != pe->header.number_of_rva_and_sizes) {
+		goto out;
+	}
+
+	for (uint16_t i = 0; i < probe.numb_sections; ++i) {
+		const section_t *section = pe->sections[i];
+		const ppelib_probe_section *file_section = &probe.sections[i];
+
+		if (section->virtual_address != file_section->virtual_address || section->virtual_size != file_section->virtual_size ||
+				section->pointer_to_raw_data != file_section->pointer_to_raw_data || section->size_of_raw_data != file_section->size_of_raw_data) {
+			goto out;
+		}
+	}
+
+	const data_directory_t *dir = &pe->data_directories[DIR_RESOURCE_TABLE];
+	const ppelib_probe_data_directory *file_dir = &probe.data_directories[DIR_RESOURCE_TABLE];
+	if (file_dir->virtual_address != dir->section->virtual_address + dir->offset || file_dir->size != dir->size) {
+		goto out;
+	}
+
+	*checksum = probe.checksum;
+	retval = 1;
+
+out:
+	free(buffer);
+	return retval;
+}
+
+static uint32_t checksum_fold(uint32_t sum) {
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (sum & 0xffff) + (sum >> 16);
+}
+
+// The checksum is the file's words summed up plus its length. Takes the sum of
+// the bytes that were replaced and of what replaced them. Most files don't
+// have a checksum, and one that was wrong before stays wrong.
+static uint32_t checksum_update(uint32_t checksum, size_t old_size, size_t new_size, uint32_t old_sum, uint32_t new_sum) {
+	if (!checksum || checksum < old_size || checksum - old_size > 0xffff) {
+		return checksum;
+	}
+
+	uint32_t sum = checksum - (uint32_t)old_size;
+	sum += checksum_fold(new_sum) + (0xffff - checksum_fold(old_sum));
+
+	return checksum_fold(sum) + (uint32_t)new_size;
+}
+
+// Rewrites the resource table where it is when it fits. Returns 0 when it doesn't.
+static size_t patch_in_place(ppelib_file_t *pe, int fd, size_t fsize, uint32_t checksum) {
+	data_directory_t *dir = &pe->data_directories[DIR_RESOURCE_TABLE];
+	section_t *section = dir->section;
+	uint16_t section_index = section_find_index(pe, section);
+
+	// A table that has its section to itself can grow into the rest of it, as
+	// long as that doesn't change the size of the image.
+	uint8_t whole_section = !dir->offset && section->contents_size == dir->size;
+	size_t region_size = dir->size;
+	if (whole_section) {
+		region_size = MIN(section->size_of_raw_data, TO_NEAREST(section->virtual_size, pe->header.section_alignment));
+	}
+
+	size_t table_size = resource_table_serialize(NULL, 0, &pe->resource_table);
+	if (ppelib_error_peek()) {
+		return 0;
+	}
+
+	if (!table_size || table_size > region_size || dir->offset + region_size > section->size_of_raw_data ||
+			section->pointer_to_raw_data + dir->offset + region_size > fsize) {
+		return 0;
+	}
+
+	// Shrinking it past a page boundary would leave SizeOfImage too large
+	if (whole_section && TO_NEAREST(table_size, pe->header.section_alignment) != TO_NEAREST(section->virtual_size, pe->header.section_alignment)) {
+		return 0;
+	}
+
+	size_t written = 0;
+	uint8_t *region = calloc(region_size, 1);
+	if (!region) {
+		ppelib_set_error("Failed to allocate buffer");
+		return 0;
+	}
+
+	section_t table_section = {0};
+	table_section.virtual_address = section->virtual_address + (uint32_t)dir->offset;
+	table_section.contents = region;
+	table_section.contents_size = region_size;
+
+	if (resource_table_serialize(&table_section, 0, &pe->resource_table) != table_size) {
+		goto out;
+	}
+
+	// Bring the handle in line with what's going to be in the file
+	section_own_contents(section);
+	if (ppelib_error_peek()) {
+		goto out;
+	}
+
+	if (whole_section) {
+		uint8_t *contents = realloc(section->contents, table_size);
+		if (!contents) {
+			ppelib_set_error("Failed to allocate section data");
+			goto out;
+		}
+
+		memcpy(contents, region, table_size);
+		section->contents = contents;
+		section->contents_size = table_size;
+		section->virtual_size = (uint32_t)table_size;
+	} else {
+		memcpy(section->contents + dir->offset, region, region_size);
+	}
+
+	dir->size = table_size;
+
+	size_t header_size = header_serialize(&pe->header, NULL, 0);
+	size_t dir_offset = pe->pe_header_offset + 4 + header_size + DIR_RESOURCE_TABLE * DATA_DIRECTORY_SIZE;
+	size_t section_header_offset = pe->pe_header_offset + 4 + COFF_HEADER_SIZE + pe->header.size_of_optional_header + (size_t)section_index * SECTION_SIZE;
+	size_t checksum_offset = pe->pe_header_offset + 4 + 84;
+
+	uint8_t dir_size[4];
+	write_uint32_t(dir_size, (uint32_t)table_size);
+
+	uint8_t section_header[SECTION_SIZE] = {0};
+	section_serialize(section, section_header, 0);
+
+	uint32_t old_sum = 0;
+	uint32_t new_sum = 0;
+
+	patch_range(fd, fsize, section->pointer_to_raw_data + dir->offset, region, region_size, &old_sum, &new_sum);
+	if (!ppelib_error_peek()) {
+		patch_range(fd, fsize, dir_offset + 4, dir_size, 4, &old_sum, &new_sum);
+	}
+	if (!ppelib_error_peek()) {
+		patch_range(fd, fsize, section_header_offset, section_header, SECTION_SIZE, &old_sum, &new_sum);
+	}
+	if (ppelib_error_peek()) {
+		goto out;
+	}
+
+	written = region_size + 4 + SECTION_SIZE;
+
+	uint32_t new_checksum = checksum_update(checksum, fsize, fsize, old_sum, new_sum);
+	if (new_checksum != checksum) {
+		pe->header.checksum = new_checksum;
+
+		uint8_t checksum_bytes[4];
+		write_uint32_t(checksum_bytes, new_checksum);
+		if (file_pwrite(fd, checksum_bytes, checksum_offset, 4) == 4) {
+			written += 4;
+		}
+	}
+
+out:
+	free(region);
+	return written;
+}
+
+typedef struct section_layout {
+	section_t *section;
+	size_t pointer_to_raw_data;
+	size_t size_of_raw_data;
+} section_layout_t;
+
+// Lays the handle out for the new resource table and, when that only moved
+// what comes after the resource section, opens up or closes the gap in the
+// file instead of rewriting it. Then writes the headers and the resource
+// section. Returns 0 when that isn't possible, pe has been updated either way.
+static size_t patch_resize(ppelib_file_t *pe, int fd, size_t fsize, uint32_t checksum) {
+	uint16_t numb_sections = pe->header.number_of_sections;
+	section_t *rsrc = pe->data_directories[DIR_RESOURCE_TABLE].section;
+	size_t rsrc_offset = rsrc->pointer_to_raw_data;
+	size_t old_raw = rsrc->size_of_raw_data;
+	size_t old_end_of_section_data = section_data_end(pe);
+	size_t old_header_end = headers_end(pe);
+	uint32_t old_symbol_table = pe->header.pointer_to_symbol_table;
+
+	size_t written = 0;
+	uint8_t *old_headers = NULL;
+	uint8_t *new_headers = NULL;
+	uint8_t *region = NULL;
+
+	section_layout_t *layout = malloc(sizeof(section_layout_t) * numb_sections);
+	if (!layout) {
+		ppelib_set_error("Failed to allocate section list");
+		return 0;
+	}
+
+	for (uint16_t i = 0; i < numb_sections; ++i) {
+		layout[i].section = pe->sections[i];
+		layout[i].pointer_to_raw_data = pe->sections[i]->pointer_to_raw_data;
+		layout[i].size_of_raw_data = pe->sections[i]->size_of_raw_data;
+	}
+
+	update_resource_table(pe);
+	if (ppelib_error_peek()) {
+		goto out;
+	}
+
+	size_t block_size = file_block_size(fd);
+	if (!block_size || old_end_of_section_data + pe->overlay_size != fsize ||
+			pe->header.number_of_sections != numb_sections || pe->data_directories[DIR_RESOURCE_TABLE].section != rsrc ||
+			rsrc->pointer_to_raw_data != rsrc_offset) {
+		goto out;
+	}
+
+	// Only whole blocks can be inserted or removed, the resource section
+	// soaks up the difference.
+	size_t new_raw = rsrc->size_of_raw_data;
+	uint8_t grow = new_raw > old_raw;
+	size_t shift;
+	if (grow) {
+		shift = TO_NEAREST(new_raw - old_raw, block_size);
+	} else {
+		shift = (old_raw - new_raw) - (old_raw - new_raw) % block_size;
+	}
+	size_t padded_raw = grow ? old_raw + shift : old_raw - shift;
+
+	// The gap goes inside the old resource section, which is rewritten anyway
+	size_t gap_offset;
+	if (grow) {
+		gap_offset = (rsrc_offset + old_raw) - (rsrc_offset + old_raw) % block_size;
+		if (gap_offset < rsrc_offset) {
+			goto out;
+		}
+	} else {
+		gap_offset = TO_NEAREST(rsrc_offset, block_size);
+		if (gap_offset + shift > rsrc_offset + old_raw) {
+			goto out;
+		}
+	}
+
+	// Sections that follow have to stay file aligned when they move
+	if (shift % pe->header.file_alignment) {
+		goto out;
+	}
+
+	size_t first_section_data = rsrc_offset;
+	for (uint16_t i = 0; i < numb_sections; ++i) {
+		section_t *section = layout[i].section;
+		if (section == rsrc || !layout[i].size_of_raw_data) {
+			continue;
+		}
+
+		first_section_data = MIN(first_section_data, layout[i].pointer_to_raw_data);
+
+		if (section->size_of_raw_data != layout[i].size_of_raw_data) {
+			goto out;
+		}
+
+		// Anything sharing file space with the resource section can't be moved as a whole
+		if (layout[i].pointer_to_raw_data + layout[i].size_of_raw_data > rsrc_offset && layout[i].pointer_to_raw_data < rsrc_offset + old_raw) {
+			goto out;
+		}
+	}
+
+	size_t header_end = MAX(old_header_end, headers_end(pe));
+	if (header_end > first_section_data) {
+		goto out;
+	}
+
+	// The generic layout starts whatever follows the resource section on a
+	// section alignment boundary. Instead the resource section is padded to
+	// padded_raw and everything past it moves by whole blocks.
+	rsrc->size_of_raw_data = (uint32_t)padded_raw;
+	for (uint16_t i = 0; i < numb_sections; ++i) {
+		section_t *section = layout[i].section;
+		if (section == rsrc || !section->size_of_raw_data) {
+			continue;
+		}
+
+		if (layout[i].pointer_to_raw_data >= rsrc_offset + old_raw) {
+			section->pointer_to_raw_data = (uint32_t)(grow ? layout[i].pointer_to_raw_data + shift : layout[i].pointer_to_raw_data - shift);
+		} else {
+			section->pointer_to_raw_data = (uint32_t)layout[i].pointer_to_raw_data;
+		}
+	}
+
+	if (old_symbol_table >= rsrc_offset + old_raw) {
+		pe->header.pointer_to_symbol_table = grow ? old_symbol_table + (uint32_t)shift : old_symbol_table - (uint32_t)shift;
+	}
+
+	size_t new_fsize = grow ? fsize + shift : fsize - shift;
+	if (section_data_end(pe) + pe->overlay_size != new_fsize) {
+		goto out;
+	}
+
+	old_headers = malloc(header_end);
+	new_headers = calloc(header_end, 1);
+	region = calloc(MAX(old_raw, padded_raw), 1);
+	if (!old_headers || !new_headers || !region) {
+		ppelib_set_error("Failed to allocate buffer");
+		goto out;
+	}
+
+	// Sum up what's being replaced before it's gone. The checksum itself
+	// isn't part of the sum.
+	size_t checksum_offset = pe->pe_header_offset + 4 + 84;
+	if (file_pread(fd, old_headers, 0, header_end) != header_end || file_pread(fd, region, rsrc_offset, old_raw) != old_raw) {
+		goto out;
+	}
+
+	write_uint32_t(old_headers + checksum_offset, 0);
+	uint32_t old_sum = checksum_words(old_headers, header_end);
+	old_sum += checksum_words(region, old_raw);
+
+	memset(region, 0, MAX(old_raw, padded_raw));
+	memcpy(region, rsrc->contents, MIN(rsrc->contents_size, padded_raw));
+
+	pe->header.checksum = 0;
+	write_headers(pe, new_headers, section_data_end(pe));
+	uint32_t new_sum = checksum_words(new_headers, header_end);
+	new_sum += checksum_words(region, padded_raw);
+
+	pe->header.checksum = checksum_update(checksum, fsize, new_fsize, old_sum, new_sum);
+	write_uint32_t(new_headers + checksum_offset, pe->header.checksum);
+
+	if (shift) {
+		uint8_t moved = grow ? file_insert_range(fd, gap_offset, shift) : file_collapse_range(fd, gap_offset, shift);
+		if (!moved) {
+			goto out;
+		}
+	}
+
+	if (file_pwrite(fd, new_headers, 0, header_end) != header_end || file_pwrite(fd, region, rsrc_offset, padded_raw) != padded_raw) {
+		goto out;
+	}
+
+	written = header_end + padded_raw;
+
+out:
+	free(region);
+	free(new_headers);
+	free(old_headers);
+	free(layout);
+	return written;
+}
+
+// Moving blocks around in the file pe is mapped from leaves everything that
+// points into the mapping pointing at the wrong data. Maps it again and points
+// everything at where it is now.
+static void remap_file(ppelib_file_t *pe, const char *filename) {
+	file_mapping_t mapping;
+	file_map(filename, &mapping);
+	if (ppelib_error_peek()) {
+		return;
+	}
+
+	size_t end_of_section_data = section_data_end(pe);
+	if (end_of_section_data + pe->overlay_size > mapping.size) {
+		file_unmap(&mapping);
+		ppelib_set_error("File changed while patching");
+		return;
+	}
+
+	pe->source.buffer = mapping.data;
+	pe->source.fd = mapping.fd;
+	pe->source.size = mapping.size;
+
+	if (pe->stub_borrowed) {
+		pe->stub = mapping.data;
+	}
+
+	for (uint16_t i = 0; i < pe->header.number_of_sections; ++i) {
+		section_t *section = pe->sections[i];
+
+		if (section->contents_borrowed) {
+			section->contents = mapping.data + section->pointer_to_raw_data;
+		} else if (section->source) {
+			section->source_offset = section->pointer_to_raw_data;
+		}
+	}
+
+	if (pe->overlay_borrowed) {
+		pe->overlay = mapping.data + end_of_section_data;
+	} else if (pe->overlay_source) {
+		pe->overlay_source_offset = end_of_section_data;
+	}
+
+	file_unmap(&pe->mapping);
+	pe->mapping = mapping;
+}
+
+// Writes pe's resources back into filename. When the file still has the
+// layout pe was loaded with only the parts that changed are written:
+// - if the new resource table fits where the old one was, the table, its
+//   data directory entry, the section header and the checksum
+// - if the resource section has to grow or shrink and the filesystem can
+//   insert or remove blocks in the middle of a file, the headers and the
+//   resource section
+// Anything else rewrites the whole file.
+//
+// Only resource changes are patched in, other changes to pe need a full write.
+EXPORT_SYM size_t ppelib_patch_file(ppelib_file_t *pe, const char *filename) {
+	ppelib_reset_error();
+
+	size_t written = 0;
+	int fd = -1;
+
+	if (pe->header.number_of_rva_and_sizes <= DIR_RESOURCE_TABLE || !pe->data_directories[DIR_RESOURCE_TABLE].section) {
+		goto rewrite;
+	}
+
+	// Payloads borrowed from the mapping would change along with the file
+	if (pe->mapping.data && source_is_file(&pe->source, filename)) {
+		resource_table_own_data(&pe->resource_table, pe->mapping.data, pe->mapping.size);
+		if (ppelib_error_peek()) {
+			return 0;
+		}
+	}
+
+	update_versioninfo(pe);
+
+	fd = file_open_rw(filename);
+	if (fd < 0) {
+		ppelib_reset_error();
+		goto rewrite;
+	}
+
+	size_t fsize = file_size(fd);
+	uint32_t checksum = 0;
+	if (ppelib_error_peek() || !patch_layout_matches(pe, fd, fsize, &checksum)) {
+		ppelib_reset_error();
+		goto rewrite;
+	}
+
+	written = patch_in_place(pe, fd, fsize, checksum);
+	if (!written && !ppelib_error_peek()) {
+		uint8_t mapped = pe->mapping.data && source_is_fd(&pe->source, fd);
+
+		written = patch_resize(pe, fd, fsize, checksum);
+		if (!written && !ppelib_error_peek()) {
+			goto write;
+		}
+
+		if (written && mapped) {
+			file_close(fd);
+			fd = -1;
+			remap_file(pe, filename);
+		}
+	}
+
+	if (fd >= 0) {
+		file_close(fd);
+	}
+
+	return ppelib_error_peek() ? 0 : written;
+
+rewrite:
+	update_resource_table(pe);
+
+write:
+	if (fd >= 0) {
+		file_close(fd);
+	}
+
+	if (ppelib_error_peek()) {
+		return 0;
+	}
+
+	uint8_t mapped = pe->mapping.data && source_is_file(&pe->source, filename);
+
+	written = ppelib_write_to_file(pe, filename);
+	if (written && mapped && !ppelib_error_peek()) {
+		remap_file(pe, filename);
+	}
+
+	return ppelib_error_peek() ? 0 : written;
 }
 
 void recalculate_sections(ppelib_file_t *pe) {
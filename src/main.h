@@ -20,12 +20,13 @@
 
 typedef struct data_directory data_directory_t;
 
+#include "file_io.h"
 #include "pe/data_directory_private.h"
 #include "pe/header_private.h"
 #include "pe/section_private.h"
 #include "resources/resource.h"
 
-typedef struct ppelib_file {
+typedef struct ppelib_handle_s {
 	size_t start_of_section_va;
 	size_t pe_header_offset;
 
@@ -44,16 +45,34 @@ typedef struct ppelib_file {
 
 	size_t stub_size;
 	uint8_t *stub;
+	uint8_t stub_borrowed;
 
 	size_t overlay_size;
 	uint8_t *overlay;
+	uint8_t overlay_borrowed;
+
+	// When set the overlay hasn't been loaded and lives at overlay_source_offset
+	const source_t *overlay_source;
+	size_t overlay_source_offset;
+
+	file_mapping_t mapping;
+	source_t source;
 } ppelib_file_t;
 
 EXPORT_SYM void ppelib_destroy(ppelib_file_t *pe);
 EXPORT_SYM ppelib_file_t *ppelib_create_from_buffer(const uint8_t *buffer, size_t size);
+EXPORT_SYM ppelib_file_t *ppelib_create_from_buffer_borrowed(const uint8_t *buffer, size_t size);
+EXPORT_SYM ppelib_file_t *ppelib_create_from_buffer_ex(const uint8_t *buffer, size_t size, uint32_t flags);
 EXPORT_SYM ppelib_file_t *ppelib_create_from_file(const char *filename);
+EXPORT_SYM ppelib_file_t *ppelib_create_from_file_mapped(const char *filename);
+EXPORT_SYM ppelib_file_t *ppelib_create_from_reader(ppelib_read_func read, void *userdata, size_t size);
+EXPORT_SYM size_t ppelib_probe(const uint8_t *buffer, size_t size, ppelib_probe_info *probe);
 EXPORT_SYM size_t ppelib_write_to_buffer(const ppelib_file_t *pe, uint8_t *buffer, size_t buf_size);
 EXPORT_SYM size_t ppelib_write_to_file(const ppelib_file_t *pe, const char *filename);
+EXPORT_SYM size_t ppelib_write_to_fd(const ppelib_file_t *pe, int fd);
+EXPORT_SYM size_t ppelib_patch_file(ppelib_file_t *pe, const char *filename);
+EXPORT_SYM size_t ppelib_write_to_sink(const ppelib_file_t *pe, ppelib_write_func write, void *userdata);
+EXPORT_SYM void ppelib_resources_share_data(ppelib_file_t *pe, uint8_t share);
 
 void ppelib_recalculate(ppelib_file_t *pe);
 
@@ -29,7 +29,7 @@
 #include "platform.h"
 #include "utils.h"
 
-typedef struct ppelib_file ppelib_file_t;
+typedef struct ppelib_handle_s ppelib_file_t;
 
 typedef struct data_directory {
 	section_t *section;
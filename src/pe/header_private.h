@@ -24,7 +24,7 @@
 
 #include "pe/constants.h"
 
-typedef struct ppelib_file ppelib_file_t;
+typedef struct ppelib_handle_s ppelib_file_t;
 
 #define HEADER_SIZE 92
 
@@ -61,6 +61,43 @@ void *section_rva_to_pointer(const section_t *section, size_t rva) {
 	return section->contents + offset;
 }
 
+void section_own_contents(section_t *section) {
+	if (!section->contents_borrowed && !section->source) {
+		return;
+	}
+
+	uint8_t *contents = NULL;
+	if (section->contents_size) {
+		contents = malloc(section->contents_size);
+		if (!contents) {
+			ppelib_set_error("Failed to allocate section data");
+			return;
+		}
+
+		if (section->source) {
+			source_read(section->source, contents, section->source_offset, section->contents_size);
+			if (ppelib_error_peek()) {
+				free(contents);
+				return;
+			}
+		} else {
+			memcpy(contents, section->contents, section->contents_size);
+		}
+	}
+
+	section->contents = contents;
+	section->contents_borrowed = 0;
+	section->source = NULL;
+}
+
+void section_free(section_t *section) {
+	if (!section->contents_borrowed) {
+		free(section->contents);
+	}
+
+	free(section);
+}
+
 section_t *section_find_by_virtual_address(ppelib_file_t *pe, size_t va) {
 	for (uint16_t i = 0; i < pe->header.number_of_sections; ++i) {
 		section_t *section = pe->sections[i];
@@ -168,6 +205,11 @@ void section_excise(ppelib_file_t *pe, uint16_t section_index, size_t start, siz
 		return;
 	}
 
+	section_own_contents(section);
+	if (ppelib_error_peek()) {
+		return;
+	}
+
 	uint16_t retval = buffer_excise(&pe->sections[section_index]->contents, section->contents_size, start, end);
 	if (!retval) {
 		ppelib_set_error("Failed to allocate new section contents");
@@ -202,6 +244,11 @@ void section_insert_capacity(ppelib_file_t *pe, uint16_t section_index, size_t s
 		return;
 	}
 
+	section_own_contents(section);
+	if (ppelib_error_peek()) {
+		return;
+	}
+
 	uint8_t *oldptr = section->contents;
 	section->contents = realloc(section->contents, section->contents_size + size);
 	if (!section->contents) {
@@ -241,6 +288,11 @@ void section_resize(ppelib_file_t *pe, uint16_t section_index, size_t size) {
 		return;
 	}
 
+	section_own_contents(section);
+	if (ppelib_error_peek()) {
+		return;
+	}
+
 	uint8_t *oldptr = section->contents;
 	section->contents = realloc(section->contents, size);
 	if (!section->contents) {
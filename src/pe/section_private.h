@@ -22,9 +22,10 @@
 #include <stddef.h>
 #include <stdio.h>
 
+#include "file_io.h"
 #include "pe/constants.h"
 
-typedef struct ppelib_file ppelib_file_t;
+typedef struct ppelib_handle_s ppelib_file_t;
 
 #define SECTION_SIZE 40
 
@@ -45,11 +46,19 @@ typedef struct section {
 
 	uint8_t *contents;
 	size_t contents_size;
+	// Contents point into a buffer we don't own (e.g. a file mapping)
+	uint8_t contents_borrowed;
+
+	// When set the contents haven't been loaded yet and live at source_offset in source
+	const source_t *source;
+	size_t source_offset;
 } section_t;
 
 size_t section_serialize(const section_t *section, uint8_t *buffer, const size_t offset);
 size_t section_deserialize(const uint8_t *buffer, const size_t size, const size_t offset, section_t *section);
 void section_fprint(FILE *stream, const section_t *section);
 void section_print(const section_t *section);
+void section_own_contents(section_t *section);
+void section_free(section_t *section);
 
 #endif /* PPELIB_SECTION_PRIVATE_H_  */
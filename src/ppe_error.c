@@ -36,6 +36,14 @@ void ppelib_set_error_func(const char *function, const char *error) {
 	ppelib_cur_error = ppelib_error_str;
 }
 
+// Sets an error as ppelib_error() returned it earlier, without another prefix
+void ppelib_restore_error(const char *error) {
+	strncpy(ppelib_error_str, error, sizeof(ppelib_error_str) - 1);
+	ppelib_error_str[sizeof(ppelib_error_str) - 1] = 0;
+
+	ppelib_cur_error = ppelib_error_str;
+}
+
 void ppelib_reset_error() {
 	ppelib_cur_error = NULL;
 }
@@ -21,6 +21,8 @@
 #include <string.h>
 #include <time.h>
 
+#include "lodepng.h"
+
 #include "pe/constants.h"
 
 #include "platform.h"
@@ -30,12 +32,26 @@
 #include "resources/resource.h"
 #include "utils.h"
 
+static void icon_drop_cache(icon_t *icon) {
+	free(icon->rgba);
+	free(icon->png);
+
+	icon->decoded_from = NULL;
+	icon->decoded_size = 0;
+	icon->rgba = NULL;
+	icon->rgba_width = 0;
+	icon->rgba_height = 0;
+	icon->png = NULL;
+	icon->png_size = 0;
+}
+
 void icon_group_free(icon_group_t *icon_group) {
 	for (size_t i = 0; i < icon_group->numb_icons; ++i) {
-		free(icon_group->icons[i].data);
+		icon_drop_cache(&icon_group->icons[i]);
 	}
 
 	free(icon_group->icons);
+	free(icon_group->error);
 }
 
 void icon_group_print(icon_group_t *icon_group) {
@@ -60,3 +76,240 @@ void icon_group_print(icon_group_t *icon_group) {
 		}
 	}
 }
+
+static char get_dib_mask(const uint8_t *mask, size_t mask_bytes_per_line, uint32_t height, uint32_t x, uint32_t y) {
+	size_t mask_offset = (height - y - 1) * mask_bytes_per_line + (x / 8);
+	uint8_t bit_offset = 7 - (x % 8);
+
+	return !!CHECK_BIT(mask[mask_offset], 1 << bit_offset);
+}
+
+static uint8_t *decode_dib(const uint8_t *buffer, size_t size, uint32_t *out_width, uint32_t *out_height) {
+	if (size < 4) {
+		ppelib_set_error("DIB file too small");
+		return NULL;
+	}
+
+	uint32_t header_size = read_uint32_t(buffer);
+
+	if (size < header_size) {
+		ppelib_set_error("DIB file too small for header");
+		return NULL;
+	}
+
+	if (header_size != 40) {
+		ppelib_set_error("Unknown DIB header size");
+		return NULL;
+	}
+
+	uint32_t width = read_uint32_t(buffer + 4);
+	uint32_t height = read_uint32_t(buffer + 8);
+	//uint16_t planes = read_uint16_t(buffer + 12);
+	uint16_t bpp = read_uint16_t(buffer + 14);
+	//uint32_t compression = read_uint32_t(buffer + 16);
+	//uint32_t image_size = read_uint32_t(buffer + 20);
+	//uint32_t horizontal_bpm = read_uint32_t(buffer + 24);
+	//uint32_t vertical_bpm = read_uint32_t(buffer + 28);
+	uint32_t palette_colors = read_uint32_t(buffer + 32);
+	//uint32_t important_colors = read_uint32_t(buffer + 36);
+
+	// Also keeps the line arithmetic below from overflowing
+	if (!width || width > UINT16_MAX || height < 2 || height / 2 > UINT16_MAX) {
+		ppelib_set_error("Invalid DIB dimensions");
+		return NULL;
+	}
+
+	size_t pixel_offset = header_size;
+
+	switch (bpp) {
+	case 1:
+		palette_colors = palette_colors ? palette_colors : 2;
+		break;
+	case 4:
+		palette_colors = palette_colors ? palette_colors : 16;
+		break;
+	case 8:
+		palette_colors = palette_colors ? palette_colors : 256;
+		break;
+	case 24:
+	case 32:
+		palette_colors = 0;
+		break;
+	default:
+		ppelib_set_error("Unknown BPP");
+		return NULL;
+		break;
+	}
+
+	if (palette_colors > 256) {
+		ppelib_set_error("Too many DIB palette colors");
+		return NULL;
+	}
+
+	pixel_offset += (palette_colors * 4);
+
+	// Both the pixel and the mask rows are padded to whole 32 bit words
+	uint32_t image_height = height / 2;
+	size_t bytes_per_line = (((size_t)width * bpp + 31) / 32) * 4;
+	size_t mask_bytes_per_line = (((size_t)width + 31) / 32) * 4;
+
+	size_t mask_start = pixel_offset + image_height * bytes_per_line;
+
+	if (size < mask_start + (image_height * mask_bytes_per_line)) {
+		ppelib_set_error("Not enough space for DIB image data");
+		return NULL;
+	}
+
+	uint8_t *image = calloc((size_t)width * image_height * 4, 1);
+	if (!image) {
+		ppelib_set_error("Failed to allocate DIB image");
+		return NULL;
+	}
+
+	for (uint32_t y = 0; y < image_height; y++) {
+		const uint8_t *line = buffer + pixel_offset + (image_height - y - 1) * bytes_per_line;
+
+		for (uint32_t x = 0; x < width; x++) {
+			if (get_dib_mask(buffer + mask_start, mask_bytes_per_line, image_height, x, y)) {
+				continue;
+			}
+
+			uint8_t *out = image + ((size_t)y * width + x) * 4;
+			size_t bit = (size_t)x * bpp;
+
+			if (bpp <= 8) {
+				// Pixels are packed from the high bits of each byte down
+				uint8_t shift = (uint8_t)(8 - bpp - (bit % 8));
+				uint8_t pixel = (uint8_t)((line[bit / 8] >> shift) & ((1 << bpp) - 1));
+
+				if (pixel >= palette_colors) {
+					pixel = 0;
+				}
+
+				const uint8_t *palette = buffer + header_size + (pixel * 4);
+
+				out[0] = palette[2]; // R
+				out[1] = palette[1]; // G
+				out[2] = palette[0]; // B
+
+				if (palette[3]) {
+					out[3] = palette[3]; // A
+				} else {
+					out[3] = 0xFF; // A
+				}
+			} else {
+				const uint8_t *pixel = line + bit / 8;
+
+				out[0] = pixel[2]; // R
+				out[1] = pixel[1]; // G
+				out[2] = pixel[0]; // B
+
+				if (bpp == 24) {
+					out[3] = 0xff; // A
+				} else {
+					out[3] = pixel[3]; // A
+				}
+			}
+		}
+	}
+
+	*out_width = width;
+	*out_height = image_height;
+	return image;
+}
+
+// The resource the icon is read from. Anything cached from different data is
+// thrown away.
+static const resource_t *icon_source(icon_t *icon) {
+	const resource_t *resource = icon->resource;
+	if (!resource || (!resource->data && resource->size)) {
+		ppelib_set_error("Icon data isn't available");
+		return NULL;
+	}
+
+	if (icon->decoded_from != resource->data || icon->decoded_size != resource->size) {
+		icon_drop_cache(icon);
+		icon->decoded_from = resource->data;
+		icon->decoded_size = resource->size;
+	}
+
+	return resource;
+}
+
+const uint8_t *icon_decode_rgba(icon_t *icon, uint32_t *width, uint32_t *height) {
+	ppelib_reset_error();
+
+	const resource_t *resource = icon_source(icon);
+	if (!resource) {
+		return NULL;
+	}
+
+	if (!icon->rgba) {
+		if (icon->type == ICON_TYPE_PNG) {
+			uint8_t *image = NULL;
+			unsigned png_width, png_height;
+			LodePNGState state;
+
+			lodepng_state_init(&state);
+			state.decoder.zlibsettings.ignore_adler32 = 1;
+			unsigned error = lodepng_decode(&image, &png_width, &png_height, &state, resource->data, resource->size);
+			lodepng_state_cleanup(&state);
+			if (error) {
+				free(image);
+				ppelib_set_error("Failed to decode png");
+				return NULL;
+			}
+
+			icon->rgba = image;
+			icon->rgba_width = png_width;
+			icon->rgba_height = png_height;
+		} else {
+			icon->rgba = decode_dib(resource->data, resource->size, &icon->rgba_width, &icon->rgba_height);
+			if (!icon->rgba) {
+				return NULL;
+			}
+		}
+	}
+
+	*width = icon->rgba_width;
+	*height = icon->rgba_height;
+	return icon->rgba;
+}
+
+const uint8_t *icon_export_png(icon_t *icon, size_t *size) {
+	ppelib_reset_error();
+
+	const resource_t *resource = icon_source(icon);
+	if (!resource) {
+		return NULL;
+	}
+
+	// Already a PNG file
+	if (icon->type == ICON_TYPE_PNG) {
+		*size = resource->size;
+		return resource->data;
+	}
+
+	if (!icon->png) {
+		uint32_t width, height;
+		const uint8_t *image = icon_decode_rgba(icon, &width, &height);
+		if (!image) {
+			return NULL;
+		}
+
+		unsigned char *png = NULL;
+		size_t png_size = 0;
+		unsigned error = lodepng_encode32(&png, &png_size, image, width, height);
+		if (error) {
+			free(png);
+			ppelib_set_error("Failed to encode png");
+			return NULL;
+		}
+
+		icon->png = png;
+		icon->png_size = png_size;
+	}
+
+	*size = icon->png_size;
+	return icon->png;
+}
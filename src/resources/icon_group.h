@@ -19,6 +19,7 @@
 #define SRC_RESOURCES_ICON_GROUP_H_
 
 #include <stddef.h>
+#include <stdint.h>
 
 typedef struct resource_table resource_table_t;
 typedef struct resource resource_t;
@@ -52,9 +53,19 @@ typedef struct icon {
 	uint16_t bpp;
 
 	size_t size;
-	uint8_t *data;
 
+	// Where the image is read from, NULL once that resource is deleted
 	resource_t *resource;
+
+	// Filled in by icon_decode_rgba() and icon_export_png(), only valid for
+	// the resource data they were made from
+	const uint8_t *decoded_from;
+	size_t decoded_size;
+	uint8_t *rgba;
+	uint32_t rgba_width;
+	uint32_t rgba_height;
+	uint8_t *png;
+	size_t png_size;
 } icon_t;
 
 typedef struct icon_group {
@@ -62,10 +73,17 @@ typedef struct icon_group {
 	icon_t *icons;
 
 	resource_t *resource;
+	// What went wrong decoding it, NULL when nothing did
+	char *error;
 } icon_group_t;
 
 void icon_group_free(icon_group_t *icon_group);
 void icon_group_deserialize(resource_table_t *resource_table, resource_t *resource, icon_group_t *icon_group);
 void icon_group_print(icon_group_t *icon_group);
 
+// 8 bit RGBA pixels, owned by the icon
+const uint8_t *icon_decode_rgba(icon_t *icon, uint32_t *width, uint32_t *height);
+// The icon as a PNG file, owned by the icon or its resource
+const uint8_t *icon_export_png(icon_t *icon, size_t *size);
+
 #endif /* SRC_RESOURCES_ICON_GROUP_H_ */
@@ -21,8 +21,6 @@
 #include <string.h>
 #include <time.h>
 
-#include "lodepng.h"
-
 #include "pe/constants.h"
 
 #include "platform.h"
@@ -49,173 +47,72 @@ static int bppcmp(const void *a, const void *b) {
 }
 
 static resource_t *find_icon(const resource_table_t *resource_table, uint16_t icon_id, uint32_t language_id) {
-	resource_t *icon = NULL;
-
-	for (size_t i = 0; i < resource_table->size; ++i) {
-		resource_t *resource = resource_table->resources[i];
-		if (resource->type_id == RT_ICON && resource->name_id == icon_id) {
-			icon = resource;
-			if (resource->language_id == language_id) {
-				return icon;
-			}
-		}
-	}
-
-	return icon;
+	return resource_index_find(&resource_table->index, RT_ICON, icon_id, language_id);
 }
 
-static char get_dib_mask(const uint8_t *mask, uint32_t width, uint32_t height, uint32_t x, uint32_t y) {
-	size_t mask_bytes_per_line = TO_NEAREST(width / 8, 4);
-
-	size_t mask_offset = ((height / 2) - y - 1) * mask_bytes_per_line + (x / 8);
-	uint8_t bit_offset = 7 - (x % 8);
-
-	return !!CHECK_BIT(mask[mask_offset], 1 << bit_offset);
+static uint32_t read_uint32_be(const uint8_t *buffer) {
+	return ((uint32_t)buffer[0] << 24) | ((uint32_t)buffer[1] << 16) | ((uint32_t)buffer[2] << 8) | buffer[3];
 }
 
-static void decode_dib(const uint8_t *buffer, size_t size, resource_t *resource) {
-	if (size < 4) {
-		ppelib_set_error("DIB file too small");
-		return;
-	}
-
-	uint32_t header_size = read_uint32_t(buffer);
-
-	if (size < header_size) {
-		ppelib_set_error("DIB file too small for header");
+// Takes the dimensions from the IHDR chunk, the group entry may be off
+static void parse_png_header(const uint8_t *buffer, size_t size, icon_t *icon) {
+	// Signature, chunk length and type, then IHDR
+	if (size < 33 || memcmp(buffer + 12, "IHDR", 4) != 0) {
 		return;
 	}
 
-	if (header_size != 40) {
-		ppelib_set_error("Unknown DIB header size");
-		return;
-	}
+	uint32_t width = read_uint32_be(buffer + 16);
+	uint32_t height = read_uint32_be(buffer + 20);
+	uint8_t bit_depth = read_uint8_t(buffer + 24);
+	uint8_t color_type = read_uint8_t(buffer + 25);
 
-	uint32_t width = read_uint32_t(buffer + 4);
-	uint32_t height = read_uint32_t(buffer + 8);
-	uint16_t planes = read_uint16_t(buffer + 12);
-	uint16_t bpp = read_uint16_t(buffer + 14);
-	uint32_t compression = read_uint32_t(buffer + 16);
-	//uint32_t image_size = read_uint32_t(buffer + 20);
-	//uint32_t horizontal_bpm = read_uint32_t(buffer + 24);
-	//uint32_t vertical_bpm = read_uint32_t(buffer + 28);
-	uint32_t palette_colors = read_uint32_t(buffer + 32);
-	uint32_t important_colors = read_uint32_t(buffer + 36);
-
-	printf("DIB: planes: %i, bpp: %i, compression: %i, palette_colors: %i, important_colors: %i\n", planes, bpp, compression, palette_colors, important_colors);
-	size_t pixel_offset = header_size;
-
-	uint16_t channels = bpp / 8;
-	uint16_t divider = 1;
-
-	switch (bpp) {
-	case 1:
+	uint8_t channels = 0;
+	switch (color_type) {
+	case 0:
+	case 3:
 		channels = 1;
-		divider = 8;
-		palette_colors = palette_colors ? palette_colors : 2;
 		break;
-	case 4:
-		channels = 1;
-		divider = 2;
-		palette_colors = palette_colors ? palette_colors : 16;
+	case 2:
+		channels = 3;
 		break;
-	case 8:
-		palette_colors = palette_colors ? palette_colors : 256;
+	case 4:
+		channels = 2;
 		break;
-	case 24:
-	case 32:
-		palette_colors = 0;
+	case 6:
+		channels = 4;
 		break;
 	default:
-		ppelib_set_error("Unknown BPP\n");
-		return;
 		break;
 	}
 
-	pixel_offset += (palette_colors * 4);
-
-	size_t bytes_per_line = TO_NEAREST((width * channels) / divider, 4);
-	size_t mask_bytes_per_line = TO_NEAREST(width / 8, 4);
+	if (width && width <= UINT16_MAX && height && height <= UINT16_MAX) {
+		icon->width = (uint16_t)width;
+		icon->height = (uint16_t)height;
+	}
 
-	size_t mask_start = pixel_offset + (height / 2) * bytes_per_line;
+	if (channels) {
+		icon->bpp = bit_depth * channels;
+	}
+}
 
-	if (size < mask_start + ((height / 2) * mask_bytes_per_line)) {
-		ppelib_set_error("Not enough space for DIB image data");
+// Same for BITMAPINFOHEADER, whose height covers both the image and its mask
+static void parse_dib_header(const uint8_t *buffer, size_t size, icon_t *icon) {
+	if (size < 40 || read_uint32_t(buffer) < 40) {
 		return;
 	}
 
-	uint8_t *image = calloc(width * (height / 2) * 4, 1);
-
-	size_t image_offset = 0;
-	for (uint32_t y = 0; y < height / 2; y++) {
-		for (uint32_t x = 0; x < width / divider; x++) {
-			size_t bmp_offset = pixel_offset + ((height / 2) - y - 1) * bytes_per_line + channels * x;
-
-			for (uint8_t i = 0; i < divider; ++i) {
-				if (!get_dib_mask(buffer + mask_start, width, height, (x * divider) + i, y)) {
-					if (bpp <= 8) {
-						uint8_t pixel = 0;
-
-						if (bpp == 1) {
-							pixel = !!CHECK_BIT(buffer[bmp_offset], 1 << (7 - i));
-						} else if (bpp == 4) {
-							pixel = (buffer[bmp_offset] >> ((1 - i) * 4)) & 0x0F;
-						} else if (bpp == 8) {
-							pixel = buffer[bmp_offset];
-						}
-
-						if (pixel > palette_colors) {
-							pixel = 0;
-						}
-
-						const uint8_t *palette = buffer + header_size + (pixel * 4);
-
-						image[image_offset + 0] = palette[2]; // R
-						image[image_offset + 1] = palette[1]; // G
-						image[image_offset + 2] = palette[0]; // B
-
-						if (palette[3]) {
-							image[image_offset + 3] = palette[3]; // A
-						} else {
-							image[image_offset + 3] = 0xFF; // A
-						}
-
-					} else if (bpp >= 24) {
-						const uint8_t *pixel = buffer + bmp_offset;
-
-						image[image_offset + 0] = pixel[2]; // R
-						image[image_offset + 1] = pixel[1]; // G
-						image[image_offset + 2] = pixel[0]; // B
-
-						if (bpp == 24) {
-							image[image_offset + 3] = 0xff; // A
-						} else {
-							image[image_offset + 3] = pixel[3]; // A
-						}
-					}
-				}
-
-				image_offset += 4;
-			}
-		}
-	}
+	uint32_t width = read_uint32_t(buffer + 4);
+	uint32_t height = read_uint32_t(buffer + 8) / 2;
+	uint16_t bpp = read_uint16_t(buffer + 14);
 
-#ifndef FUZZ
-	unsigned char *png;
-	size_t pngsize;
-	unsigned error = lodepng_encode32(&png, &pngsize, image, width, height / 2);
-	if (error) {
-		ppelib_set_error("Failed to encode png");
+	if (width && width <= UINT16_MAX && height && height <= UINT16_MAX) {
+		icon->width = (uint16_t)width;
+		icon->height = (uint16_t)height;
 	}
 
-	free(resource->data);
-	resource->data = png;
-	resource->size = pngsize;
-#else
-	(void)resource;
-#endif
-
-	free(image);
+	if (bpp) {
+		icon->bpp = bpp;
+	}
 }
 
 static void parse_icon(const uint8_t *buffer, size_t size, size_t offset, resource_table_t *resource_table, icon_group_t *icon_group) {
@@ -265,44 +162,13 @@ static void parse_icon(const uint8_t *buffer, size_t size, size_t offset, resour
 	icon->bpp = bpp;
 
 	icon->size = icon_res->size;
-	icon->data = malloc(icon_res->size);
 	icon->resource = icon_res;
-	memcpy(icon->data, icon_res->data, icon->size);
 
 	if (icon->type == ICON_TYPE_PNG) {
-#ifndef FUZZ
-		uint32_t error;
-		uint8_t *image = 0;
-		uint32_t png_width, png_height;
-		//size_t pngsize;
-		LodePNGState state;
-
-		lodepng_state_init(&state);
-		state.decoder.zlibsettings.ignore_adler32 = 1;
-		//state.decoder.ignore_crc = 1;
-		error = lodepng_decode(&image, &png_width, &png_height, &state, icon->data, icon->size);
-		if (error) {
-			ppelib_set_error("Failed to decode png");
-			//printf("%s\n", lodepng_error_text(error));
-			return;
-		}
-		//uint32_t png_bpp = lodepng_get_bpp(&state.info_png.color);
-		//printf("Size: %ix%i@%i png: %ix%i@%i\n", icon->width, icon->height, icon->bpp, png_width, png_height, png_bpp);
-
-		lodepng_state_cleanup(&state);
-		free(image);
-#endif
+		parse_png_header(icon_res->data, icon_res->size, icon);
 	} else {
-		//printf("Icon: %i\n", icon_id);
-		decode_dib(icon->data, icon->size, icon_res);
+		parse_dib_header(icon_res->data, icon_res->size, icon);
 	}
-
-	char filename[100];
-	int fs = snprintf(filename, 99, "dump/icon%i_%i.png", icon_res->name_id, icon_res->language_id);
-	filename[fs] = 0;
-	FILE *fp = fopen(filename, "w");
-	fwrite(icon_res->data, icon_res->size, 1, fp);
-	fclose(fp);
 }
 
 void icon_group_deserialize(resource_table_t *resource_table, resource_t *resource, icon_group_t *icon_group) {
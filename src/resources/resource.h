@@ -21,10 +21,12 @@
 #include <inttypes.h>
 #include <stddef.h>
 
+#include "arena.h"
 #include "pe/constants.h"
 #include "pe/section_private.h"
 
 #include "resources/icon_group.h"
+#include "resources/resource_index.h"
 #include "resources/versioninfo.h"
 
 typedef struct resource {
@@ -50,6 +52,16 @@ typedef struct resource {
 
 	size_t size;
 	uint8_t *data;
+	// Data points into the input buffer or the table's arena, which outlive us
+	uint8_t data_borrowed;
+	// The struct and its strings live in the table's arena
+	uint8_t in_arena;
+	// The payload changed since the table was last written
+	uint8_t dirty;
+
+	// Where the parsed data entry and payload sit in the resource section
+	uint32_t entry_offset;
+	uint32_t data_offset;
 } resource_t;
 
 typedef struct resource_table {
@@ -61,29 +73,89 @@ typedef struct resource_table {
 	uint16_t minor_version;
 
 	resource_t **resources;
-
+	resource_index_t index;
+	arena_t arena;
+
+	// Write identical payloads once and point every data entry at that copy
+	uint8_t share_data;
+	// Parsed without payloads, only the original can be written back
+	uint8_t data_skipped;
+	// Cached by resource_table_serialize, dropped whenever the table changes
+	struct resource_layout *layout;
+
+	// The section the table was parsed from. Its bytes, with changed payloads
+	// patched in, are written back as-is until something other than a
+	// payload changes, then NULL.
+	section_t *original_section;
+	size_t original_size;
+	// Section offset the original was parsed from, the resource count and the
+	// table RVA its data entries are relative to
+	size_t original_offset;
+	size_t original_count;
+	size_t original_rva;
+
+	// Decoded on first access through resource_get_*
+	uint8_t versioninfo_decoded;
 	size_t numb_versioninfo;
 	version_info_t *versioninfo;
 
+	uint8_t icon_groups_decoded;
 	size_t numb_icon_group;
 	icon_group_t *icongroups;
 } resource_table_t;
 
+// Which resources resource_table_filter removes. Only the criteria set in
+// match are checked, a resource has to meet all of them.
+typedef enum {
+	RESOURCE_MATCH_TYPE = 1 << 0,
+	RESOURCE_MATCH_NAME = 1 << 1,
+	RESOURCE_MATCH_LANGUAGE = 1 << 2,
+	RESOURCE_MATCH_SIZE = 1 << 3,
+	RESOURCE_MATCH_CALLBACK = 1 << 4,
+} resource_match_t;
+
+typedef struct resource_filter {
+	uint32_t match;
+
+	// A string when set, otherwise the id
+	const char *type;
+	uint32_t type_id;
+	const char *name;
+	uint32_t name_id;
+	const char *language;
+	uint32_t language_id;
+
+	// Inclusive
+	size_t min_size;
+	size_t max_size;
+
+	uint8_t (*callback)(const resource_t *resource, void *userdata);
+	void *userdata;
+} resource_filter_t;
+
 void resource_table_free(resource_table_t *resource_table);
+size_t resource_table_filter(resource_table_t *resource_table, const resource_filter_t *filter);
 void resource_delete(resource_table_t *resource_table, resource_t *resource);
+void resource_set_data(resource_t *resource, uint8_t *data, size_t size);
+void resource_table_reindex(resource_table_t *resource_table);
+void resource_table_invalidate_layout(resource_table_t *resource_table);
+void resource_table_mark_modified(resource_table_t *resource_table);
+void resource_table_own_data(resource_table_t *resource_table, const uint8_t *start, size_t size);
+void resource_table_keep_original(resource_table_t *resource_table, section_t *section, size_t offset, size_t size);
 
 size_t resource_table_deserialize(const section_t *section, const size_t offset, resource_table_t *resource_table);
-size_t resource_table_serialize(const section_t *section, const size_t offset, resource_table_t *resource_table);
+size_t resource_table_serialize(section_t *section, const size_t offset, resource_table_t *resource_table);
 void resource_table_print(resource_table_t *resource_table);
+void update_versioninfo(ppelib_file_t *pe);
 void update_resource_table(ppelib_file_t *pe);
 
 size_t resource_get_by_type_name(char *type);
 size_t resource_count_by_type_id(const resource_table_t *resource_table, uint32_t type);
 resource_t *resource_get_by_type_id(const resource_table_t *resource_table, uint32_t type, size_t idx);
 
-size_t resource_get_numb_versioninfo(const resource_table_t *resource_table);
-version_info_t *resource_get_versioninfo(const resource_table_t *resource_table, size_t idx);
+size_t resource_get_numb_versioninfo(resource_table_t *resource_table);
+version_info_t *resource_get_versioninfo(resource_table_t *resource_table, size_t idx);
 
-size_t resource_get_numb_icon_group(const resource_table_t *resource_table);
-icon_group_t *resource_get_icon_group(const resource_table_t *resource_table, size_t idx);
+size_t resource_get_numb_icon_group(resource_table_t *resource_table);
+icon_group_t *resource_get_icon_group(resource_table_t *resource_table, size_t idx);
 #endif /* SRC_RESOURCES_RESOURCE_H_ */
@@ -0,0 +1,261 @@
+/* Copyright 2021 Hein-Pieter van Braam-Stewart
+ *
+ * This file is part of ppelib (Portable Portable Executable LIBrary)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platform.h"
+#include "ppe_error.h"
+#include "resources/resource.h"
+#include "resources/resource_index.h"
+
+#define INDEX_MIN_BUCKETS 64
+#define INDEX_TYPE_BUCKETS 64
+
+static uint32_t hash_id(uint32_t id, const char *string) {
+	if (!string) {
+		return id * 2654435761u;
+	}
+
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for (const char *c = string; *c; ++c) {
+		hash ^= (uint8_t)*c;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static size_t hash_resource(const resource_index_t *index, uint32_t type_id, const char *type, uint32_t name_id,
+		const char *name) {
+	uint32_t hash = hash_id(type_id, type) * 31 + hash_id(name_id, name);
+	return (hash ^ (hash >> 16)) & (index->numb_buckets - 1);
+}
+
+static int same_id(uint32_t a_id, const char *a, uint32_t b_id, const char *b) {
+	if (a || b) {
+		return a && b && strcmp(a, b) == 0;
+	}
+
+	return a_id == b_id;
+}
+
+static void bucket_append(resource_index_bucket_t *bucket, resource_index_node_t *node) {
+	node->next = NULL;
+	if (bucket->tail) {
+		bucket->tail->next = node;
+	} else {
+		bucket->head = node;
+	}
+	bucket->tail = node;
+}
+
+static int grow_buckets(resource_index_t *index) {
+	size_t numb_buckets = index->numb_buckets ? index->numb_buckets * 2 : INDEX_MIN_BUCKETS;
+	resource_index_bucket_t *buckets = calloc(numb_buckets, sizeof(resource_index_bucket_t));
+	if (!buckets) {
+		return 0;
+	}
+
+	resource_index_bucket_t *old_buckets = index->buckets;
+	size_t old_numb_buckets = index->numb_buckets;
+	index->buckets = buckets;
+	index->numb_buckets = numb_buckets;
+
+	// Walking the old chains front to back keeps table order within each new chain
+	for (size_t i = 0; i < old_numb_buckets; ++i) {
+		resource_index_node_t *node = old_buckets[i].head;
+		while (node) {
+			resource_index_node_t *next = node->next;
+			resource_t *r = node->resource;
+			bucket_append(&buckets[hash_resource(index, r->type_id, r->type, r->name_id, r->name)], node);
+			node = next;
+		}
+	}
+
+	free(old_buckets);
+	return 1;
+}
+
+static resource_type_list_t **type_slot(const resource_index_t *index, uint32_t type_id) {
+	resource_type_list_t **slot = &index->types[hash_id(type_id, NULL) % index->numb_type_buckets];
+	while (*slot && (*slot)->type_id != type_id) {
+		slot = &(*slot)->next;
+	}
+
+	return slot;
+}
+
+void resource_index_add(resource_index_t *index, resource_t *resource) {
+	if (!index->types) {
+		index->types = calloc(INDEX_TYPE_BUCKETS, sizeof(resource_type_list_t *));
+		if (!index->types) {
+			ppelib_set_error("Failed to allocate resource index");
+			return;
+		}
+		index->numb_type_buckets = INDEX_TYPE_BUCKETS;
+	}
+
+	if (index->size >= index->numb_buckets && !grow_buckets(index)) {
+		ppelib_set_error("Failed to allocate resource index");
+		return;
+	}
+
+	resource_type_list_t **slot = type_slot(index, resource->type_id);
+	if (!*slot) {
+		*slot = calloc(sizeof(resource_type_list_t), 1);
+		if (!*slot) {
+			ppelib_set_error("Failed to allocate resource index");
+			return;
+		}
+		(*slot)->type_id = resource->type_id;
+	}
+
+	resource_type_list_t *list = *slot;
+	if (list->size == list->capacity) {
+		size_t capacity = list->capacity ? list->capacity * 2 : 8;
+		resource_t **resources = realloc(list->resources, capacity * sizeof(resource_t *));
+		if (!resources) {
+			ppelib_set_error("Failed to allocate resource index");
+			return;
+		}
+		list->resources = resources;
+		list->capacity = capacity;
+	}
+
+	resource_index_node_t *node = malloc(sizeof(resource_index_node_t));
+	if (!node) {
+		ppelib_set_error("Failed to allocate resource index");
+		return;
+	}
+
+	node->resource = resource;
+	bucket_append(&index->buckets[hash_resource(index, resource->type_id, resource->type, resource->name_id,
+			resource->name)], node);
+	list->resources[list->size++] = resource;
+	index->size++;
+}
+
+void resource_index_remove(resource_index_t *index, resource_t *resource) {
+	if (!index->numb_buckets) {
+		return;
+	}
+
+	resource_index_bucket_t *bucket = &index->buckets[hash_resource(index, resource->type_id, resource->type,
+			resource->name_id, resource->name)];
+
+	resource_index_node_t *prev = NULL;
+	for (resource_index_node_t *node = bucket->head; node; prev = node, node = node->next) {
+		if (node->resource != resource) {
+			continue;
+		}
+
+		if (prev) {
+			prev->next = node->next;
+		} else {
+			bucket->head = node->next;
+		}
+		if (bucket->tail == node) {
+			bucket->tail = prev;
+		}
+
+		free(node);
+		index->size--;
+		break;
+	}
+
+	resource_type_list_t **slot = type_slot(index, resource->type_id);
+	resource_type_list_t *list = *slot;
+	if (!list) {
+		return;
+	}
+
+	for (size_t i = 0; i < list->size; ++i) {
+		if (list->resources[i] == resource) {
+			--list->size;
+			memmove(&list->resources[i], &list->resources[i + 1], (list->size - i) * sizeof(resource_t *));
+			break;
+		}
+	}
+
+	if (!list->size) {
+		*slot = list->next;
+		free(list->resources);
+		free(list);
+	}
+}
+
+void resource_index_free(resource_index_t *index) {
+	for (size_t i = 0; i < index->numb_buckets; ++i) {
+		resource_index_node_t *node = index->buckets[i].head;
+		while (node) {
+			resource_index_node_t *next = node->next;
+			free(node);
+			node = next;
+		}
+	}
+	free(index->buckets);
+
+	for (size_t i = 0; i < index->numb_type_buckets; ++i) {
+		resource_type_list_t *list = index->types[i];
+		while (list) {
+			resource_type_list_t *next = list->next;
+			free(list->resources);
+			free(list);
+			list = next;
+		}
+	}
+	free(index->types);
+
+	memset(index, 0, sizeof(resource_index_t));
+}
+
+const resource_type_list_t *resource_index_get_type(const resource_index_t *index, uint32_t type_id) {
+	if (!index->types) {
+		return NULL;
+	}
+
+	return *type_slot(index, type_id);
+}
+
+// First resource matching all three ids, or failing that the last one
+// matching type and name in any language
+resource_t *resource_index_find(const resource_index_t *index, uint32_t type_id, uint32_t name_id,
+		uint32_t language_id) {
+	if (!index->numb_buckets) {
+		return NULL;
+	}
+
+	resource_t *found = NULL;
+	resource_index_node_t *node = index->buckets[hash_resource(index, type_id, NULL, name_id, NULL)].head;
+	for (; node; node = node->next) {
+		resource_t *r = node->resource;
+		if (!same_id(r->type_id, r->type, type_id, NULL) || !same_id(r->name_id, r->name, name_id, NULL)) {
+			continue;
+		}
+
+		found = r;
+		if (!r->language && r->language_id == language_id) {
+			return r;
+		}
+	}
+
+	return found;
+}
@@ -0,0 +1,67 @@
+/* Copyright 2021 Hein-Pieter van Braam-Stewart
+ *
+ * This file is part of ppelib (Portable Portable Executable LIBrary)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SRC_RESOURCES_RESOURCE_INDEX_H_
+#define SRC_RESOURCES_RESOURCE_INDEX_H_
+
+#include <inttypes.h>
+#include <stddef.h>
+
+struct resource;
+
+typedef struct resource_index_node {
+	struct resource *resource;
+	struct resource_index_node *next;
+} resource_index_node_t;
+
+typedef struct resource_index_bucket {
+	resource_index_node_t *head;
+	resource_index_node_t *tail;
+} resource_index_bucket_t;
+
+// All resources with one type_id, in resource table order
+typedef struct resource_type_list {
+	uint32_t type_id;
+	size_t size;
+	size_t capacity;
+	struct resource **resources;
+
+	struct resource_type_list *next;
+} resource_type_list_t;
+
+// Lookup structure kept next to resource_table_t::resources. Resources are
+// hashed on type and name; all languages of a name share a chain, in table
+// order, so a lookup can fall back to any language.
+typedef struct resource_index {
+	size_t size;
+
+	size_t numb_buckets;
+	resource_index_bucket_t *buckets;
+
+	size_t numb_type_buckets;
+	resource_type_list_t **types;
+} resource_index_t;
+
+void resource_index_add(resource_index_t *index, struct resource *resource);
+void resource_index_remove(resource_index_t *index, struct resource *resource);
+void resource_index_free(resource_index_t *index);
+
+const resource_type_list_t *resource_index_get_type(const resource_index_t *index, uint32_t type_id);
+struct resource *resource_index_find(const resource_index_t *index, uint32_t type_id, uint32_t name_id,
+		uint32_t language_id);
+
+#endif /* SRC_RESOURCES_RESOURCE_INDEX_H_ */
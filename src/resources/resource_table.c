@@ -24,15 +24,34 @@
 #include "platform.h"
 #include "ppe_error.h"
 #include "resources/resource.h"
+#include "utils.h"
 
 void resource_free(resource_t *resource) {
+	if (!resource->data_borrowed) {
+		free(resource->data);
+	}
+
+	if (resource->in_arena) {
+		return;
+	}
+
 	free(resource->type);
 	free(resource->name);
 	free(resource->language);
-	free(resource->data);
 	free(resource);
 }
 
+void resource_set_data(resource_t *resource, uint8_t *data, size_t size) {
+	if (!resource->data_borrowed) {
+		free(resource->data);
+	}
+
+	resource->data = data;
+	resource->size = size;
+	resource->data_borrowed = 0;
+	resource->dirty = 1;
+}
+
 void resource_table_free(resource_table_t *resource_table) {
 	for (size_t i = 0; i < resource_table->numb_versioninfo; ++i) {
 		versioninfo_free(&resource_table->versioninfo[i]);
@@ -48,82 +67,403 @@ void resource_table_free(resource_table_t *resource_table) {
 		resource_free(resource_table->resources[i]);
 	}
 	free(resource_table->resources);
+	resource_index_free(&resource_table->index);
+	arena_free(&resource_table->arena);
+	resource_table_mark_modified(resource_table);
 }
 
-size_t resource_count_by_type_id(const resource_table_t *resource_table, uint32_t type) {
-	ppelib_reset_error();
+// Something other than a payload changed, so the table has to be laid out
+// from scratch the next time it's written
+void resource_table_mark_modified(resource_table_t *resource_table) {
+	resource_table->original_section = NULL;
+	resource_table_invalidate_layout(resource_table);
+}
 
-	size_t size = 0;
+// Remembers where the freshly parsed table lives so it can be written back
+// without laying it out again. Tables with anything outside the data
+// directory's range are always laid out.
+void resource_table_keep_original(resource_table_t *resource_table, section_t *section, size_t offset, size_t size) {
+	if (!resource_table->size || !size || offset > section->contents_size || size > section->contents_size - offset) {
+		return;
+	}
 
 	for (size_t i = 0; i < resource_table->size; ++i) {
-		if (resource_table->resources[i]->type_id == type) {
-			++size;
+		const resource_t *resource = resource_table->resources[i];
+		if (resource->entry_offset < offset || resource->entry_offset + 16 > offset + size) {
+			return;
+		}
+
+		size_t data_size = read_uint32_t(section->contents + resource->entry_offset + 4);
+		if (resource->data_offset < offset || resource->data_offset + data_size > offset + size) {
+			return;
 		}
 	}
 
-	return size;
+	resource_table->original_section = section;
+	resource_table->original_size = size;
+	resource_table->original_offset = offset;
+	resource_table->original_count = resource_table->size;
+	resource_table->original_rva = section->virtual_address + offset;
+}
+
+static uint8_t data_points_into(const resource_t *resource, const uint8_t *start, size_t size) {
+	return resource->data && resource->data >= start && (size_t)(resource->data - start) < size;
+}
+
+// Moves payloads that point into start..start + size into the arena, for when
+// those bytes are about to change
+void resource_table_own_data(resource_table_t *resource_table, const uint8_t *start, size_t size) {
+	size_t bytes = 0;
+	for (size_t i = 0; i < resource_table->size; ++i) {
+		const resource_t *resource = resource_table->resources[i];
+		if (data_points_into(resource, start, size)) {
+			bytes += ARENA_SIZE(resource->size);
+		}
+	}
+
+	if (!bytes) {
+		return;
+	}
+
+	arena_reserve(&resource_table->arena, bytes);
+	if (ppelib_error_peek()) {
+		return;
+	}
+
+	for (size_t i = 0; i < resource_table->size; ++i) {
+		resource_t *resource = resource_table->resources[i];
+		if (!data_points_into(resource, start, size)) {
+			continue;
+		}
+
+		uint8_t *data = arena_alloc(&resource_table->arena, resource->size);
+		if (!data) {
+			return;
+		}
+
+		memcpy(data, resource->data, resource->size);
+		resource->data = data;
+	}
+
+	// The layout still points at the old copies
+	resource_table_invalidate_layout(resource_table);
+}
+
+// Rebuild the index after the resources array was reordered
+void resource_table_reindex(resource_table_t *resource_table) {
+	resource_index_free(&resource_table->index);
+
+	for (size_t i = 0; i < resource_table->size; ++i) {
+		resource_index_add(&resource_table->index, resource_table->resources[i]);
+	}
+}
+
+size_t resource_count_by_type_id(const resource_table_t *resource_table, uint32_t type) {
+	ppelib_reset_error();
+
+	const resource_type_list_t *list = resource_index_get_type(&resource_table->index, type);
+	if (!list) {
+		return 0;
+	}
+
+	return list->size;
 }
 
 resource_t *resource_get_by_type_id(const resource_table_t *resource_table, uint32_t type, size_t idx) {
 	ppelib_reset_error();
 
-	size_t size = 0;
+	const resource_type_list_t *list = resource_index_get_type(&resource_table->index, type);
+	if (!list || idx >= list->size) {
+		return NULL;
+	}
 
-	for (size_t i = 0; i < resource_table->size; ++i) {
-		if (resource_table->resources[i]->type_id == type) {
-			if (size == idx) {
-				return resource_table->resources[i];
-			}
-			++size;
+	return list->resources[idx];
+}
+
+static uint8_t match_string_or_id(const char *string, uint32_t id, const char *want, uint32_t want_id) {
+	if (want) {
+		return string && strcmp(string, want) == 0;
+	}
+
+	return !string && id == want_id;
+}
+
+static uint8_t resource_matches(const resource_t *resource, const resource_filter_t *filter) {
+	if ((filter->match & RESOURCE_MATCH_TYPE) && !match_string_or_id(resource->type, resource->type_id, filter->type, filter->type_id)) {
+		return 0;
+	}
+
+	if ((filter->match & RESOURCE_MATCH_NAME) && !match_string_or_id(resource->name, resource->name_id, filter->name, filter->name_id)) {
+		return 0;
+	}
+
+	if ((filter->match & RESOURCE_MATCH_LANGUAGE) &&
+			!match_string_or_id(resource->language, resource->language_id, filter->language, filter->language_id)) {
+		return 0;
+	}
+
+	if ((filter->match & RESOURCE_MATCH_SIZE) && (resource->size < filter->min_size || resource->size > filter->max_size)) {
+		return 0;
+	}
+
+	if ((filter->match & RESOURCE_MATCH_CALLBACK) && !filter->callback(resource, filter->userdata)) {
+		return 0;
+	}
+
+	return 1;
+}
+
+static int pointer_cmp(const void *a, const void *b) {
+	uintptr_t pa = (uintptr_t)(*(resource_t *const *)a);
+	uintptr_t pb = (uintptr_t)(*(resource_t *const *)b);
+
+	return (pa > pb) - (pa < pb);
+}
+
+static uint8_t is_removed(resource_t **removed, size_t numb_removed, resource_t *resource) {
+	return resource && bsearch(&resource, removed, numb_removed, sizeof(resource_t *), &pointer_cmp);
+}
+
+// Forgets the versioninfo and icon groups parsed from removed resources,
+// which has to be sorted. Icons whose own resource went stay in their group
+// without an image, decoding or exporting them fails from then on.
+static void drop_dependents(resource_table_t *resource_table, resource_t **removed, size_t numb_removed) {
+	size_t numb_versioninfo = 0;
+	for (size_t i = 0; i < resource_table->numb_versioninfo; ++i) {
+		version_info_t *versioninfo = &resource_table->versioninfo[i];
+
+		if (is_removed(removed, numb_removed, versioninfo->resource)) {
+			versioninfo_free(versioninfo);
+		} else {
+			resource_table->versioninfo[numb_versioninfo++] = *versioninfo;
 		}
 	}
+	resource_table->numb_versioninfo = numb_versioninfo;
 
-	return NULL;
+	size_t numb_icon_group = 0;
+	for (size_t i = 0; i < resource_table->numb_icon_group; ++i) {
+		icon_group_t *icon_group = &resource_table->icongroups[i];
+
+		if (is_removed(removed, numb_removed, icon_group->resource)) {
+			icon_group_free(icon_group);
+			continue;
+		}
+
+		for (size_t k = 0; k < icon_group->numb_icons; ++k) {
+			if (is_removed(removed, numb_removed, icon_group->icons[k].resource)) {
+				icon_group->icons[k].resource = NULL;
+			}
+		}
+
+		resource_table->icongroups[numb_icon_group++] = *icon_group;
+	}
+	resource_table->numb_icon_group = numb_icon_group;
 }
 
-void resource_delete(resource_table_t *resource_table, resource_t *resource) {
+// Removes every resource matching filter in one pass, along with the
+// versioninfo and icon groups parsed from them. Returns how many went.
+size_t resource_table_filter(resource_table_t *resource_table, const resource_filter_t *filter) {
+	ppelib_reset_error();
+
+	if (!resource_table->size) {
+		return 0;
+	}
+
+	resource_t **removed = malloc(sizeof(resource_t *) * resource_table->size);
+	if (!removed) {
+		ppelib_set_error("Failed to allocate resource list");
+		return 0;
+	}
+
+	// Kept resources slide down in order, the rest are set aside
+	size_t numb_kept = 0;
+	size_t numb_removed = 0;
 	for (size_t i = 0; i < resource_table->size; ++i) {
-		if (resource_table->resources[i] == resource) {
-			resource_free(resource);
+		resource_t *resource = resource_table->resources[i];
 
-			--resource_table->size;
-			memmove(&resource_table->resources[i], &resource_table->resources[i + 1], (resource_table->size - i) * sizeof(void *));
-			resource_table->resources = realloc(resource_table->resources, resource_table->size * sizeof(void *));
-			return;
+		if (resource_matches(resource, filter)) {
+			removed[numb_removed++] = resource;
+		} else {
+			resource_table->resources[numb_kept++] = resource;
 		}
 	}
+
+	if (!numb_removed) {
+		free(removed);
+		return 0;
+	}
+
+	resource_table->size = numb_kept;
+	qsort(removed, numb_removed, sizeof(resource_t *), &pointer_cmp);
+	drop_dependents(resource_table, removed, numb_removed);
+
+	for (size_t i = 0; i < numb_removed; ++i) {
+		resource_free(removed[i]);
+	}
+	free(removed);
+
+	resource_table_reindex(resource_table);
+	resource_table_mark_modified(resource_table);
+
+	return numb_removed;
+}
+
+void resource_delete(resource_table_t *resource_table, resource_t *resource) {
+	ppelib_reset_error();
+
+	size_t idx = 0;
+	while (idx < resource_table->size && resource_table->resources[idx] != resource) {
+		++idx;
+	}
+
+	if (idx == resource_table->size) {
+		ppelib_set_error("Resource not in table");
+		return;
+	}
+
+	--resource_table->size;
+	memmove(&resource_table->resources[idx], &resource_table->resources[idx + 1],
+			(resource_table->size - idx) * sizeof(resource_t *));
+
+	resource_index_remove(&resource_table->index, resource);
+	drop_dependents(resource_table, &resource, 1);
+	resource_free(resource);
+
+	resource_table_mark_modified(resource_table);
+}
+
+EXPORT_SYM void ppelib_resources_share_data(ppelib_file_t *pe, uint8_t share) {
+	ppelib_reset_error();
+
+	if (pe->resource_table.share_data != !!share) {
+		pe->resource_table.share_data = !!share;
+		resource_table_mark_modified(&pe->resource_table);
+	}
+}
+
+// What went wrong decoding one entry, kept for whoever asks for it
+static char *take_decode_error() {
+	if (!ppelib_error_peek()) {
+		return NULL;
+	}
+
+	char *error = strdup(ppelib_error());
+	ppelib_reset_error();
+
+	return error;
+}
+
+// Versioninfo and icon groups are only decoded once somebody asks for them.
+// Like the rest of the table they're kept until the handle goes. An entry
+// that couldn't be decoded keeps its error, the others aren't held up by it.
+static void decode_versioninfo(resource_table_t *resource_table) {
+	resource_table->versioninfo_decoded = 1;
+
+	size_t nmb = resource_count_by_type_id(resource_table, RT_VERSION);
+	if (!nmb) {
+		return;
+	}
+
+	resource_table->versioninfo = calloc(sizeof(version_info_t) * nmb, 1);
+	if (!resource_table->versioninfo) {
+		ppelib_set_error("Failed to allocate versioninfo");
+		return;
+	}
+	resource_table->numb_versioninfo = nmb;
+
+	for (size_t i = 0; i < nmb; ++i) {
+		resource_t *res = resource_get_by_type_id(resource_table, RT_VERSION, i);
+		versioninfo_deserialize(res, &resource_table->versioninfo[i]);
+		resource_table->versioninfo[i].error = take_decode_error();
+	}
+}
+
+static void decode_icon_groups(resource_table_t *resource_table) {
+	resource_table->icon_groups_decoded = 1;
+
+	size_t nmb = resource_count_by_type_id(resource_table, RT_GROUP_ICON);
+	if (!nmb) {
+		return;
+	}
+
+	resource_table->icongroups = calloc(sizeof(icon_group_t) * nmb, 1);
+	if (!resource_table->icongroups) {
+		ppelib_set_error("Failed to allocate icon groups");
+		return;
+	}
+	resource_table->numb_icon_group = nmb;
+
+	for (size_t i = 0; i < nmb; ++i) {
+		resource_t *res = resource_get_by_type_id(resource_table, RT_GROUP_ICON, i);
+		icon_group_deserialize(resource_table, res, &resource_table->icongroups[i]);
+		resource_table->icongroups[i].error = take_decode_error();
+	}
 }
 
-size_t resource_get_numb_icon_group(const resource_table_t *resource_table) {
+size_t resource_get_numb_icon_group(resource_table_t *resource_table) {
 	ppelib_reset_error();
 
+	if (!resource_table->icon_groups_decoded) {
+		decode_icon_groups(resource_table);
+	}
+
 	return resource_table->numb_icon_group;
 }
 
-icon_group_t *resource_get_icon_group(const resource_table_t *resource_table, size_t idx) {
+// A group that couldn't be fully decoded comes with the error it ran into
+icon_group_t *resource_get_icon_group(resource_table_t *resource_table, size_t idx) {
 	ppelib_reset_error();
 
+	if (!resource_table->icon_groups_decoded) {
+		decode_icon_groups(resource_table);
+		if (ppelib_error_peek()) {
+			return NULL;
+		}
+	}
+
 	if (idx >= resource_table->numb_icon_group) {
 		ppelib_set_error("Index out of range");
 		return NULL;
 	}
 
-	return &resource_table->icongroups[idx];
+	icon_group_t *icon_group = &resource_table->icongroups[idx];
+	if (icon_group->error) {
+		ppelib_restore_error(icon_group->error);
+	}
+
+	return icon_group;
 }
 
-size_t resource_get_numb_versioninfo(const resource_table_t *resource_table) {
+size_t resource_get_numb_versioninfo(resource_table_t *resource_table) {
 	ppelib_reset_error();
 
+	if (!resource_table->versioninfo_decoded) {
+		decode_versioninfo(resource_table);
+	}
+
 	return resource_table->numb_versioninfo;
 }
 
-version_info_t *resource_get_versioninfo(const resource_table_t *resource_table, size_t idx) {
+// Like resource_get_icon_group(), a partly decoded one comes with its error
+version_info_t *resource_get_versioninfo(resource_table_t *resource_table, size_t idx) {
 	ppelib_reset_error();
 
+	if (!resource_table->versioninfo_decoded) {
+		decode_versioninfo(resource_table);
+		if (ppelib_error_peek()) {
+			return NULL;
+		}
+	}
+
 	if (idx >= resource_table->numb_versioninfo) {
 		ppelib_set_error("Index out of range");
 		return NULL;
 	}
 
-	return &resource_table->versioninfo[idx];
+	version_info_t *versioninfo = &resource_table->versioninfo[idx];
+	if (versioninfo->error) {
+		ppelib_restore_error(versioninfo->error);
+	}
+
+	return versioninfo;
 }
@@ -25,25 +25,52 @@
 #include "ppe_error.h"
 #include "resources/resource.h"
 
-thread_local static size_t rscs_base;
-
-thread_local static uint32_t type_characteristics;
-thread_local static uint32_t type_date_time_stamp;
-thread_local static uint16_t type_major_version;
-thread_local static uint16_t type_minor_version;
-
-thread_local static uint32_t name_characteristics;
-thread_local static uint32_t name_date_time_stamp;
-thread_local static uint16_t name_major_version;
-thread_local static uint16_t name_minor_version;
-
-thread_local static uint32_t type;
-thread_local static uint32_t name;
-thread_local static uint32_t language;
-
-static size_t parse_resource_table(const uint8_t *buffer, const size_t size, const size_t offset, resource_table_t *resource_table, uint32_t level);
-
-static char *get_len_string(const uint8_t *buffer, const size_t size, const size_t offset) {
+typedef struct parse_name {
+	uint32_t offset;
+	char *string;
+} parse_name_t;
+
+// Where we are while walking the directory tree. The type and name tables
+// above a resource hand their headers down to it.
+typedef struct parse_context {
+	const uint8_t *buffer;
+	size_t size;
+	size_t rscs_base;
+	uint8_t borrow_data;
+	// Only the tree is wanted, payloads stay NULL
+	uint8_t skip_data;
+	resource_table_t *resource_table;
+
+	uint32_t type_characteristics;
+	uint32_t type_date_time_stamp;
+	uint16_t type_major_version;
+	uint16_t type_minor_version;
+
+	uint32_t name_characteristics;
+	uint32_t name_date_time_stamp;
+	uint16_t name_major_version;
+	uint16_t name_minor_version;
+
+	uint32_t type;
+	uint32_t name;
+	uint32_t language;
+
+	size_t capacity;
+
+	// Decoded directory names by section offset, open addressed
+	size_t numb_names;
+	size_t names_capacity;
+	parse_name_t *names;
+} parse_context_t;
+
+typedef struct parse_count {
+	size_t resources;
+	size_t bytes;
+} parse_count_t;
+
+static size_t parse_resource_table(parse_context_t *ctx, const size_t offset, uint32_t level);
+
+static char *get_len_string(arena_t *arena, const uint8_t *buffer, const size_t size, const size_t offset) {
 	if (offset > size) {
 		ppelib_set_error("Can't read past end of buffer");
 		return NULL;
@@ -63,10 +90,73 @@ static char *get_len_string(const uint8_t *buffer, const size_t size, const size
 	}
 
 	//printf("get_len_string: size: %i\n", string_size);
-	return get_utf16_string(buffer, size, offset + 2, string_size);
+	char *string = arena_alloc(arena, utf16_string_capacity(string_size));
+	if (!string || !get_utf16_string_into(buffer, size, offset + 2, string_size, string)) {
+		return NULL;
+	}
+
+	return string;
+}
+
+static uint8_t grow_names(parse_context_t *ctx) {
+	size_t capacity = ctx->names_capacity ? ctx->names_capacity * 2 : 64;
+	parse_name_t *names = calloc(capacity, sizeof(parse_name_t));
+	if (!names) {
+		ppelib_set_error("Failed to allocate name cache");
+		return 0;
+	}
+
+	for (size_t i = 0; i < ctx->names_capacity; ++i) {
+		parse_name_t *name = &ctx->names[i];
+		if (!name->string) {
+			continue;
+		}
+
+		size_t slot = (name->offset * 2654435761u) & (capacity - 1);
+		while (names[slot].string) {
+			slot = (slot + 1) & (capacity - 1);
+		}
+		names[slot] = *name;
+	}
+
+	free(ctx->names);
+	ctx->names = names;
+	ctx->names_capacity = capacity;
+	return 1;
+}
+
+// Every resource under a named type or name shares one decoded copy of it
+static char *get_name(parse_context_t *ctx, uint32_t offset) {
+	if (ctx->numb_names * 2 >= ctx->names_capacity && !grow_names(ctx)) {
+		return NULL;
+	}
+
+	size_t slot = (offset * 2654435761u) & (ctx->names_capacity - 1);
+	while (ctx->names[slot].string) {
+		if (ctx->names[slot].offset == offset) {
+			return ctx->names[slot].string;
+		}
+		slot = (slot + 1) & (ctx->names_capacity - 1);
+	}
+
+	char *string = get_len_string(&ctx->resource_table->arena, ctx->buffer, ctx->size, offset);
+	if (!string) {
+		return NULL;
+	}
+
+	ctx->names[slot].offset = offset;
+	ctx->names[slot].string = string;
+	ctx->numb_names++;
+
+	return string;
 }
 
-static size_t parse_resource(const uint8_t *buffer, const size_t size, const size_t offset, resource_table_t *resource_table) {
+static size_t parse_resource(parse_context_t *ctx, const size_t offset) {
+	const uint8_t *buffer = ctx->buffer;
+	const size_t size = ctx->size;
+	resource_table_t *resource_table = ctx->resource_table;
+	arena_t *arena = &resource_table->arena;
+
 	if (offset > size || size - offset < 16) {
 		ppelib_set_error("Not enough space for resource data entry");
 		return 0;
@@ -81,106 +171,173 @@ static size_t parse_resource(const uint8_t *buffer, const size_t size, const siz
 	char *name_s = NULL;
 	char *language_s = NULL;
 
-	size_t data_offset = data_rva - rscs_base;
+	size_t data_offset = data_rva - ctx->rscs_base;
 	if (data_offset > size || data_offset + data_size > size) {
 		ppelib_set_error("Not enough space for resource data");
 		return 0;
 	}
 
-	if (CHECK_BIT(type, HIGH_BIT32)) {
-		type_s = get_len_string(buffer, size, type ^ HIGH_BIT32);
+	if (CHECK_BIT(ctx->type, HIGH_BIT32)) {
+		type_s = get_name(ctx, ctx->type ^ HIGH_BIT32);
 		if (ppelib_error_peek()) {
-			goto out;
+			return 0;
 		}
 	}
 
-	if (CHECK_BIT(name, HIGH_BIT32)) {
-		name_s = get_len_string(buffer, size, name ^ HIGH_BIT32);
+	if (CHECK_BIT(ctx->name, HIGH_BIT32)) {
+		name_s = get_name(ctx, ctx->name ^ HIGH_BIT32);
 		if (ppelib_error_peek()) {
-			goto out;
+			return 0;
 		}
 	}
 
-	if (CHECK_BIT(language, HIGH_BIT32)) {
-		language_s = get_len_string(buffer, size, language ^ HIGH_BIT32);
+	if (CHECK_BIT(ctx->language, HIGH_BIT32)) {
+		language_s = get_name(ctx, ctx->language ^ HIGH_BIT32);
 		if (ppelib_error_peek()) {
-			goto out;
+			return 0;
+		}
+	}
+
+	if (resource_table->size == ctx->capacity) {
+		size_t capacity = ctx->capacity ? ctx->capacity * 2 : 16;
+		resource_t **resources = realloc(resource_table->resources, sizeof(resource_t *) * capacity);
+		if (!resources) {
+			ppelib_set_error("Failed to allocate resource");
+			return 0;
 		}
+
+		resource_table->resources = resources;
+		ctx->capacity = capacity;
 	}
 
-	++resource_table->size;
-	resource_table->resources = realloc(resource_table->resources, sizeof(resource_t *) * resource_table->size);
-	if (!resource_table->resources) {
-		ppelib_set_error("Failed to allocate resource");
-		goto out;
+	resource_t *resource = arena_calloc(arena, sizeof(resource_t));
+	if (!resource) {
+		return 0;
 	}
 
-	resource_table->resources[resource_table->size - 1] = calloc(sizeof(resource_t), 1);
-	resource_t *resource = resource_table->resources[resource_table->size - 1];
+	resource->in_arena = 1;
+	resource_table->resources[resource_table->size++] = resource;
 
-	resource->type_characteristics = type_characteristics;
-	resource->type_date_time_stamp = type_date_time_stamp;
-	resource->type_major_version = type_major_version;
-	resource->type_minor_version = type_minor_version;
+	resource->type_characteristics = ctx->type_characteristics;
+	resource->type_date_time_stamp = ctx->type_date_time_stamp;
+	resource->type_major_version = ctx->type_major_version;
+	resource->type_minor_version = ctx->type_minor_version;
 
-	resource->name_characteristics = name_characteristics;
-	resource->name_date_time_stamp = name_date_time_stamp;
-	resource->name_major_version = name_major_version;
-	resource->name_minor_version = name_minor_version;
+	resource->name_characteristics = ctx->name_characteristics;
+	resource->name_date_time_stamp = ctx->name_date_time_stamp;
+	resource->name_major_version = ctx->name_major_version;
+	resource->name_minor_version = ctx->name_minor_version;
 
 	if (type_s) {
 		resource->type = type_s;
 	} else {
-		resource->type_id = type;
+		resource->type_id = ctx->type;
 	}
 	if (name_s) {
 		resource->name = name_s;
 	} else {
-		resource->name_id = name;
+		resource->name_id = ctx->name;
 	}
 	if (language_s) {
 		resource->language = language_s;
 	} else {
-		resource->language_id = language;
+		resource->language_id = ctx->language;
 	}
 
 	resource->codepage = codepage;
 	resource->reserved = reserved;
+	resource->entry_offset = (uint32_t)offset;
+	resource->data_offset = (uint32_t)data_offset;
+
+	resource_index_add(&resource_table->index, resource);
+	if (ppelib_error_peek()) {
+		return 0;
+	}
 
 	resource->size = data_size;
-	resource->data = malloc(data_size);
-	memcpy(resource->data, buffer + data_offset, data_size);
+	resource->data_borrowed = 1;
+	if (ctx->skip_data) {
+		resource->data = NULL;
+	} else if (ctx->borrow_data) {
+		resource->data = (uint8_t *)buffer + data_offset;
+	} else {
+		resource->data = arena_alloc(arena, data_size);
+		if (!resource->data) {
+			return 0;
+		}
+		memcpy(resource->data, buffer + data_offset, data_size);
+	}
 
 	return 0;
+}
 
-out:
-	free(type_s);
-	free(name_s);
-	free(language_s);
-	type_s = NULL;
-	name_s = NULL;
-	language_s = NULL;
-	return 0;
+// Walks the directory tree the way parse_resource_table() does, adding up
+// what the parse will allocate so the arena can be sized in one go. Anything
+// malformed just ends the count, the parse itself reports it.
+static void count_resource_table(const parse_context_t *ctx, size_t offset, uint32_t level, parse_count_t *count) {
+	const uint8_t *buffer = ctx->buffer;
+	const size_t size = ctx->size;
+
+	if (level > 2 || offset > size || size - offset < 16) {
+		return;
+	}
+
+	uint16_t number_of_entries = read_uint16_t(buffer + offset + 12) + read_uint16_t(buffer + offset + 14);
+	size_t entry_offset = offset + 16;
+
+	for (uint16_t i = 0; i < number_of_entries; ++i, entry_offset += 8) {
+		// Tables can share subtables, don't let a hostile one run away with us
+		if (entry_offset > size || size - entry_offset < 8 || count->bytes > size * 8) {
+			return;
+		}
+
+		uint32_t id = read_uint32_t(buffer + entry_offset + 0);
+		uint32_t next_offset = read_uint32_t(buffer + entry_offset + 4);
+
+		// Names are decoded once and shared by everything below them
+		if (CHECK_BIT(id, HIGH_BIT32)) {
+			size_t string_offset = id ^ HIGH_BIT32;
+			if (string_offset > size || size - string_offset < 2) {
+				return;
+			}
+			count->bytes += ARENA_SIZE(utf16_string_capacity((size_t)read_uint16_t(buffer + string_offset) * 2));
+		}
+
+		if (CHECK_BIT(next_offset, HIGH_BIT32)) {
+			count_resource_table(ctx, next_offset ^ HIGH_BIT32, level + 1, count);
+			continue;
+		}
+
+		if (next_offset > size || size - next_offset < 16) {
+			return;
+		}
+
+		count->resources++;
+		count->bytes += ARENA_SIZE(sizeof(resource_t));
+		if (!ctx->borrow_data && !ctx->skip_data) {
+			count->bytes += ARENA_SIZE(MIN(read_uint32_t(buffer + next_offset + 4), size));
+		}
+	}
 }
 
-static size_t parse_resource_entry(const uint8_t *buffer, const size_t size, const size_t offset, resource_table_t *resource_table, uint32_t level) {
-	if (offset > size || size - offset < 8) {
+static size_t parse_resource_entry(parse_context_t *ctx, const size_t offset, uint32_t level) {
+	if (offset > ctx->size || ctx->size - offset < 8) {
 		ppelib_set_error("Not enough space for resource directory entry");
 		return 0;
 	}
 
-	uint32_t id = read_uint32_t(buffer + offset + 0);
-	uint32_t next_offset = read_uint32_t(buffer + offset + 4);
+	uint32_t id = read_uint32_t(ctx->buffer + offset + 0);
+	uint32_t next_offset = read_uint32_t(ctx->buffer + offset + 4);
 
 	switch (level) {
 	case 0:
-		type = id;
+		ctx->type = id;
 		break;
 	case 1:
-		name = id;
+		ctx->name = id;
 		break;
 	case 2:
-		language = id;
+		ctx->language = id;
 		break;
 	default:
 		ppelib_set_error("Unexpected directory depth");
@@ -188,16 +345,19 @@ static size_t parse_resource_entry(const uint8_t *buffer, const size_t size, con
 	}
 
 	if (CHECK_BIT(next_offset, HIGH_BIT32)) {
-		parse_resource_table(buffer, size, next_offset ^ HIGH_BIT32, resource_table, level + 1);
+		parse_resource_table(ctx, next_offset ^ HIGH_BIT32, level + 1);
 	} else {
-		parse_resource(buffer, size, next_offset, resource_table);
+		parse_resource(ctx, next_offset);
 	}
 
 	return 0;
 }
 
-static size_t parse_resource_table(const uint8_t *buffer, const size_t size, const size_t offset, resource_table_t *resource_table, uint32_t level) {
-	if (offset > size || size - offset < 16) {
+static size_t parse_resource_table(parse_context_t *ctx, const size_t offset, uint32_t level) {
+	const uint8_t *buffer = ctx->buffer;
+	resource_table_t *resource_table = ctx->resource_table;
+
+	if (offset > ctx->size || ctx->size - offset < 16) {
 		ppelib_set_error("Not enough space for resource directory table");
 		return 0;
 	}
@@ -218,16 +378,16 @@ static size_t parse_resource_table(const uint8_t *buffer, const size_t size, con
 		resource_table->minor_version = minor_version;
 		break;
 	case 1:
-		type_characteristics = characteristics;
-		type_date_time_stamp = date_time_stamp;
-		type_major_version = major_version;
-		type_minor_version = minor_version;
+		ctx->type_characteristics = characteristics;
+		ctx->type_date_time_stamp = date_time_stamp;
+		ctx->type_major_version = major_version;
+		ctx->type_minor_version = minor_version;
 		break;
 	case 2:
-		name_characteristics = characteristics;
-		name_date_time_stamp = date_time_stamp;
-		name_major_version = major_version;
-		name_minor_version = minor_version;
+		ctx->name_characteristics = characteristics;
+		ctx->name_date_time_stamp = date_time_stamp;
+		ctx->name_major_version = major_version;
+		ctx->name_minor_version = minor_version;
 		break;
 	default:
 		ppelib_set_error("Unexpected directory depth");
@@ -237,7 +397,7 @@ static size_t parse_resource_table(const uint8_t *buffer, const size_t size, con
 	size_t entry_offset = offset + 16;
 
 	for (uint16_t i = 0; i < number_of_name_entries + number_of_id_entries; ++i) {
-		parse_resource_entry(buffer, size, entry_offset, resource_table, level);
+		parse_resource_entry(ctx, entry_offset, level);
 		if (ppelib_error_peek()) {
 			return 0;
 		}
@@ -251,19 +411,45 @@ static size_t parse_resource_table(const uint8_t *buffer, const size_t size, con
 size_t resource_table_deserialize(const section_t *section, const size_t offset, resource_table_t *resource_table) {
 	ppelib_reset_error();
 
-	size_t size = section->contents_size;
-	uint8_t *buffer = section->contents;
-	rscs_base = section->virtual_address;
+	parse_context_t ctx = {0};
+	ctx.buffer = section->contents;
+	ctx.size = section->contents_size;
+	ctx.rscs_base = section->virtual_address;
+	ctx.resource_table = resource_table;
 
-	if (size - offset < 16) {
+	// Borrowed section contents point into the caller's buffer, which outlives
+	// both the section contents and the resources.
+	ctx.borrow_data = section->contents_borrowed;
+	ctx.skip_data = resource_table->data_skipped;
+
+	if (ctx.size - offset < 16) {
 		ppelib_set_error("Not enough space for resource directory table");
 		return 0;
 	}
 
-	parse_resource_table(buffer, size, offset, resource_table, 0);
-	if (ppelib_error_peek()) {
-		return 0;
+	// Everything a resource holds goes into the arena, sized up front so a
+	// table is usually a single allocation
+	ctx.capacity = resource_table->size;
+	parse_count_t count = {0};
+	count_resource_table(&ctx, offset, 0, &count);
+
+	if (count.resources) {
+		arena_reserve(&resource_table->arena, count.bytes);
+		if (ppelib_error_peek()) {
+			return 0;
+		}
+
+		ctx.capacity = resource_table->size + MIN(count.resources, ctx.size / 8);
+		resource_t **resources = realloc(resource_table->resources, sizeof(resource_t *) * ctx.capacity);
+		if (!resources) {
+			ppelib_set_error("Failed to allocate resource");
+			return 0;
+		}
+		resource_table->resources = resources;
 	}
 
+	parse_resource_table(&ctx, offset, 0);
+	free(ctx.names);
+
 	return 0;
 }
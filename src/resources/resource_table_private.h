@@ -19,6 +19,9 @@
 #define SRC_RESOURCES_RESOURCE_TABLE_PRIVATE_H_
 
 #include <inttypes.h>
+#include <stddef.h>
+
+#include "resources/string_table.h"
 
 typedef struct resource_directory_table resource_directory_table_t;
 
@@ -48,6 +51,31 @@ typedef struct resource_directory_table {
 
 	size_t number_of_entries;
 	resource_directory_entry_t *entries;
+
+	// Bytes this table and all of its subtables take up
+	size_t size;
 } resource_directory_table_t;
 
+// One data entry and where its payload goes
+typedef struct resource_layout_entry {
+	const resource_data_entry_t *data_entry;
+	size_t data_offset;
+	// Points at an earlier identical payload instead of its own copy
+	uint8_t shared;
+} resource_layout_entry_t;
+
+// Where every part of a resource table goes. Built once and reused for
+// sizing and writing until the table changes.
+typedef struct resource_layout {
+	resource_directory_table_t *root;
+	string_table_t string_table;
+	size_t data_entries_offset;
+
+	// In the order the directory tree reaches them
+	size_t numb_entries;
+	resource_layout_entry_t *entries;
+
+	size_t size;
+} resource_layout_t;
+
 #endif /* SRC_RESOURCES_RESOURCE_TABLE_PRIVATE_H_ */
@@ -27,11 +27,47 @@
 #include "resources/resource_table_private.h"
 #include "resources/string_table.h"
 
-thread_local static size_t rscs_base;
-thread_local static size_t data_entries_offset;
-thread_local static size_t data_offset;
-thread_local static string_table_t string_table;
-thread_local static size_t total_size;
+// A payload already written, by content
+typedef struct payload {
+	const uint8_t *data;
+	uint32_t size;
+	uint32_t hash;
+	// 0 marks an empty slot, payloads never start at the table's start
+	size_t offset;
+} payload_t;
+
+// Open addressed, by content
+typedef struct payload_table {
+	size_t numb_payloads;
+	payload_t *payloads;
+} payload_table_t;
+
+// FNV-1a
+static uint32_t payload_hash(const uint8_t *data, size_t size) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+// The slot holding a payload with the same bytes as d, or the empty slot it goes in
+static payload_t *payload_find(payload_table_t *table, const resource_data_entry_t *d, uint32_t hash) {
+	size_t mask = table->numb_payloads - 1;
+	size_t slot = hash & mask;
+
+	while (table->payloads[slot].offset) {
+		payload_t *p = &table->payloads[slot];
+		if (p->hash == hash && p->size == d->data_size && (p->data == d->data || memcmp(p->data, d->data, d->data_size) == 0)) {
+			break;
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	return &table->payloads[slot];
+}
 
 static int typecmp(const void *a, const void *b) {
 	resource_t *ra = *(resource_t **)a;
@@ -108,293 +144,677 @@ static int langcmp(const void *a, const void *b) {
 	}
 }
 
-static size_t resource_table_data_entries_number(const resource_directory_table_t *resource_table, size_t in_size) {
-	size_t subdirs_size = 0;
-	size_t data_entries_number = 0;
+// Writes a directory table and its subtables at offset. Data entries are
+// numbered in the order they are reached, starting at *entry.
+static void resource_directory_write(resource_layout_t *layout, const resource_directory_table_t *resource_table, uint8_t *buffer, size_t offset, size_t *entry) {
+	uint16_t number_of_name_entries = 0;
+	uint16_t number_of_id_entries = 0;
 
-	for (uint32_t i = 0; i < resource_table->number_of_entries; ++i) {
-		if (resource_table->entries[i].directory_table) {
-			subdirs_size += resource_table_data_entries_number(resource_table->entries[i].directory_table, in_size);
+	for (size_t i = 0; i < resource_table->number_of_entries; ++i) {
+		if (resource_table->entries[i].name) {
+			number_of_name_entries++;
 		} else {
-			++data_entries_number;
+			number_of_id_entries++;
 		}
 	}
 
-	return in_size + subdirs_size + data_entries_number;
-}
+	uint8_t *table = buffer + offset;
 
-static size_t resource_table_directory_size(const resource_directory_table_t *resource_table, size_t in_size) {
-	size_t subdirs_size = 0;
-	if (!resource_table) {
-		return 0;
-	}
+	write_uint32_t(table + 0, resource_table->characteristics);
+	write_uint32_t(table + 4, resource_table->time_date_stamp);
+	write_uint16_t(table + 8, resource_table->major_version);
+	write_uint16_t(table + 10, resource_table->minor_version);
+	write_uint16_t(table + 12, number_of_name_entries);
+	write_uint16_t(table + 14, number_of_id_entries);
 
-	for (uint32_t i = 0; i < resource_table->number_of_entries; ++i) {
-		subdirs_size += resource_table_directory_size(resource_table->entries[i].directory_table, in_size);
-	}
+	size_t next_table = offset + 16 + (resource_table->number_of_entries * 8);
 
-	size_t entries_size = resource_table->number_of_entries * 8u;
+	for (size_t i = 0; i < resource_table->number_of_entries; ++i) {
+		const resource_directory_entry_t *e = &resource_table->entries[i];
+		const resource_directory_table_t *t = e->directory_table;
+		uint8_t *entry_buffer = table + 16 + (i * 8);
 
-	return in_size + subdirs_size + 16 + entries_size;
-}
+		uint32_t name_offset_or_id = e->name_id;
+		if (e->name) {
+			string_table_string_t *string = string_table_find(&layout->string_table, e->name);
+			name_offset_or_id = (layout->string_table.base_offset + string->offset) ^ HIGH_BIT32;
+		}
+
+		write_uint32_t(entry_buffer + 0, name_offset_or_id);
 
-static size_t resource_table_write(const resource_directory_table_t *resource_table, uint8_t *buffer, size_t offset) {
-	size_t furthest = offset;
-	size_t next_entry = 0;
+		if (t) {
+			write_uint32_t(entry_buffer + 4, (uint32_t)next_table ^ HIGH_BIT32);
+			resource_directory_write(layout, t, buffer, next_table, entry);
+			next_table += t->size;
+		} else {
+			write_uint32_t(entry_buffer + 4, (uint32_t)(layout->data_entries_offset + (*entry * 16)));
+			++*entry;
+		}
+	}
+}
 
+// Checks the entry counts and collects the data entries in write order
+static void resource_directory_place(resource_layout_t *layout, const resource_directory_table_t *resource_table) {
 	size_t number_of_name_entries = 0;
-	size_t number_of_id_entries = 0;
 
 	for (size_t i = 0; i < resource_table->number_of_entries; ++i) {
 		if (resource_table->entries[i].name) {
 			number_of_name_entries++;
-		} else {
-			number_of_id_entries++;
 		}
 	}
 
 	if (number_of_name_entries > UINT16_MAX) {
 		ppelib_set_error("Too many name entries");
-		return 0;
+		return;
 	}
 
-	if (number_of_id_entries > UINT16_MAX) {
+	if (resource_table->number_of_entries - number_of_name_entries > UINT16_MAX) {
 		ppelib_set_error("Too many id entries");
+		return;
+	}
+
+	for (size_t i = 0; i < resource_table->number_of_entries; ++i) {
+		const resource_directory_entry_t *e = &resource_table->entries[i];
+
+		if (e->directory_table) {
+			resource_directory_place(layout, e->directory_table);
+			if (ppelib_error_peek()) {
+				return;
+			}
+		} else {
+			layout->entries[layout->numb_entries++].data_entry = e->data_entry;
+		}
+	}
+}
+
+void resource_directory_free(resource_directory_table_t *base) {
+	if (!base) {
+		return;
+	}
+
+	for (size_t i = 0; i < base->number_of_entries; ++i) {
+		resource_directory_free(base->entries[i].directory_table);
+		free(base->entries[i].data_entry);
+	}
+
+	free(base->entries);
+	free(base);
+}
+
+typedef struct sort_entry {
+	// Type, name and language. Strings sort before ids, so a string is its
+	// rank among all strings and an id has bit 32 set.
+	uint64_t key[3];
+	resource_t *resource;
+} sort_entry_t;
+
+typedef struct sort_string {
+	const char *string;
+	uint64_t *key;
+} sort_string_t;
+
+#define SORT_ID_BIT ((uint64_t)1 << 32)
+#define SORT_KEY_BITS 33
+#define SORT_RADIX_BITS 11
+
+static int sort_string_cmp(const void *a, const void *b) {
+	const sort_string_t *sa = a;
+	const sort_string_t *sb = b;
+
+	return sa->string == sb->string ? 0 : strcmp(sa->string, sb->string);
+}
+
+// One stable counting sort pass on a digit of key[level]. Returns 0 when
+// every entry has the same digit and nothing moved.
+static uint8_t radix_pass(sort_entry_t *from, sort_entry_t *to, size_t n, uint32_t level, uint32_t shift) {
+	size_t counts[1 << SORT_RADIX_BITS] = {0};
+	const uint64_t mask = (1 << SORT_RADIX_BITS) - 1;
+
+	for (size_t i = 0; i < n; ++i) {
+		counts[(from[i].key[level] >> shift) & mask]++;
+	}
+
+	if (counts[(from[0].key[level] >> shift) & mask] == n) {
 		return 0;
 	}
 
-	if (buffer) {
-		uint8_t *table = buffer + offset;
+	size_t total = 0;
+	for (size_t d = 0; d <= mask; ++d) {
+		size_t count = counts[d];
+		counts[d] = total;
+		total += count;
+	}
 
-		write_uint32_t(table + 0, resource_table->characteristics);
-		write_uint32_t(table + 4, resource_table->time_date_stamp);
-		write_uint16_t(table + 8, resource_table->major_version);
-		write_uint16_t(table + 10, resource_table->minor_version);
-		write_uint16_t(table + 12, (uint16_t)number_of_name_entries);
-		write_uint16_t(table + 14, (uint16_t)number_of_id_entries);
+	for (size_t i = 0; i < n; ++i) {
+		to[counts[(from[i].key[level] >> shift) & mask]++] = from[i];
 	}
-	offset += 16;
 
-	furthest = MAX(furthest, offset);
-	next_entry = offset + ((number_of_name_entries + number_of_id_entries) * 8);
+	return 1;
+}
+
+// Orders resources by type, name and language the way the directory wants
+// them. Stable, so duplicates keep the order they were in.
+static void resource_sort(resource_table_t *resource_table) {
+	size_t n = resource_table->size;
+	sort_entry_t *entries = malloc(sizeof(sort_entry_t) * n * 2);
+	sort_string_t *strings = malloc(sizeof(sort_string_t) * n * 3);
+	if (!entries || !strings) {
+		ppelib_set_error("Failed to allocate sort keys");
+		goto out;
+	}
 
-	for (size_t i = 0; i < resource_table->number_of_entries; ++i) {
-		const resource_directory_entry_t *e = &resource_table->entries[i];
-		const resource_data_entry_t *d = resource_table->entries[i].data_entry;
-		const resource_directory_table_t *t = resource_table->entries[i].directory_table;
+	size_t numb_strings = 0;
+	for (size_t i = 0; i < n; ++i) {
+		resource_t *resource = resource_table->resources[i];
+		const char *names[3] = { resource->type, resource->name, resource->language };
+		const uint32_t ids[3] = { resource->type_id, resource->name_id, resource->language_id };
+
+		entries[i].resource = resource;
+		for (uint32_t l = 0; l < 3; ++l) {
+			if (names[l]) {
+				strings[numb_strings].string = names[l];
+				strings[numb_strings].key = &entries[i].key[l];
+				numb_strings++;
+			} else {
+				entries[i].key[l] = SORT_ID_BIT | ids[l];
+			}
+		}
+	}
 
-		uint32_t name_offset_or_id = 0;
+	qsort(strings, numb_strings, sizeof(sort_string_t), &sort_string_cmp);
 
-		if (e->name) {
-			string_table_string_t *string = string_table_find(&string_table, e->name);
-			name_offset_or_id = (string_table.base_offset + string->offset) ^ HIGH_BIT32;
-		} else {
-			name_offset_or_id = e->name_id;
+	uint64_t rank = 0;
+	for (size_t i = 0; i < numb_strings; ++i) {
+		if (i && sort_string_cmp(&strings[i - 1], &strings[i])) {
+			++rank;
 		}
+		*strings[i].key = rank;
+	}
 
-		if (t) {
-			if (next_entry > UINT32_MAX) {
-				ppelib_set_error("Sub-directory offset out of range");
-				return 0;
+	// Least significant first: language, then name, then type
+	sort_entry_t *from = entries;
+	sort_entry_t *to = entries + n;
+	for (uint32_t l = 3; l-- > 0;) {
+		for (uint32_t shift = 0; shift < SORT_KEY_BITS; shift += SORT_RADIX_BITS) {
+			if (radix_pass(from, to, n, l, shift)) {
+				sort_entry_t *tmp = from;
+				from = to;
+				to = tmp;
 			}
+		}
+	}
 
-			uint32_t entry_offset = (uint32_t)next_entry;
-			next_entry += resource_table_directory_size(t, 0);
+	for (size_t i = 0; i < n; ++i) {
+		resource_table->resources[i] = from[i].resource;
+	}
+
+out:
+	free(strings);
+	free(entries);
+}
+
+typedef int (*resource_cmp_func)(const void *a, const void *b);
+
+static const resource_cmp_func level_cmp[] = { &typecmp, &namecmp, &langcmp };
+
+// Builds the table for level of resources[start..end). Resources are sorted
+// by type, name and language, so each entry is one run of equal keys.
+static resource_directory_table_t *resource_directory_build(resource_t **resources, size_t start, size_t end, uint32_t level) {
+	resource_cmp_func cmp = level_cmp[level];
+
+	// Every resource gets its own language entry, duplicates included
+	size_t number_of_entries = 0;
+	for (size_t i = start; i < end; ++i) {
+		if (level == 2 || i == start || cmp(&resources[i - 1], &resources[i])) {
+			++number_of_entries;
+		}
+	}
 
-			if (buffer) {
-				uint8_t *entry = buffer + offset;
+	resource_directory_table_t *table = calloc(sizeof(resource_directory_table_t), 1);
+	if (!table) {
+		ppelib_set_error("Failed to allocate resource directory");
+		return NULL;
+	}
 
-				write_uint32_t(entry + 0, name_offset_or_id);
-				write_uint32_t(entry + 4, entry_offset ^ HIGH_BIT32);
+	table->entries = calloc(sizeof(resource_directory_entry_t), number_of_entries);
+	if (!table->entries && number_of_entries) {
+		ppelib_set_error("Failed to allocate resource directory");
+		free(table);
+		return NULL;
+	}
+	table->number_of_entries = number_of_entries;
+	table->size = 16 + number_of_entries * 8;
+
+	size_t run_start = start;
+	for (size_t e = 0; e < number_of_entries; ++e) {
+		size_t run_end = run_start + 1;
+		while (run_end < end && !cmp(&resources[run_start], &resources[run_end])) {
+			++run_end;
+		}
+
+		resource_directory_entry_t *entry = &table->entries[e];
+		resource_t *resource = resources[run_start];
+
+		switch (level) {
+		case 0:
+			entry->name = resource->type;
+			entry->name_id = resource->type_id;
+			break;
+		case 1:
+			entry->name = resource->name;
+			entry->name_id = resource->name_id;
+			break;
+		default:
+			entry->name = resource->language;
+			entry->name_id = resource->language_id;
+			break;
+		}
+
+		if (level < 2) {
+			resource_directory_table_t *subtable = resource_directory_build(resources, run_start, run_end, level + 1);
+			if (!subtable) {
+				resource_directory_free(table);
+				return NULL;
 			}
 
-			size_t t_furthest = resource_table_write(t, buffer, entry_offset);
-			offset += 8;
-			furthest = MAX(furthest, t_furthest);
-			furthest = MAX(furthest, offset);
+			// The table headers come from the last resource in the run
+			resource_t *last = resources[run_end - 1];
+			if (level == 0) {
+				subtable->characteristics = last->type_characteristics;
+				subtable->time_date_stamp = last->type_date_time_stamp;
+				subtable->major_version = last->type_major_version;
+				subtable->minor_version = last->type_minor_version;
+			} else {
+				subtable->characteristics = last->name_characteristics;
+				subtable->time_date_stamp = last->name_date_time_stamp;
+				subtable->major_version = last->name_major_version;
+				subtable->minor_version = last->name_minor_version;
+			}
 
+			entry->directory_table = subtable;
+			table->size += subtable->size;
 		} else {
-			if (data_entries_offset > UINT32_MAX) {
-				ppelib_set_error("Data entry offset out of range");
-				return 0;
+			run_end = run_start + 1;
+
+			entry->data_entry = calloc(sizeof(resource_data_entry_t), 1);
+			if (!entry->data_entry) {
+				ppelib_set_error("Failed to allocate resource data entry");
+				resource_directory_free(table);
+				return NULL;
 			}
 
-			uint32_t entry_offset = (uint32_t)data_entries_offset;
+			entry->data_entry->codepage = resource->codepage;
+			entry->data_entry->data_size = (uint32_t)resource->size;
+			entry->data_entry->data = resource->data;
+		}
 
-			if (buffer) {
-				uint8_t *entry = buffer + offset;
+		run_start = run_end;
+	}
 
-				write_uint32_t(entry + 0, name_offset_or_id);
-				write_uint32_t(entry + 4, entry_offset);
+	return table;
+}
 
-				write_uint32_t(buffer + entry_offset + 0, (uint32_t)rscs_base + (uint32_t)data_offset);
-				write_uint32_t(buffer + entry_offset + 4, d->data_size);
-				write_uint32_t(buffer + entry_offset + 8, d->codepage);
-				write_uint32_t(buffer + entry_offset + 12, d->reserved);
+static void resource_layout_free(resource_layout_t *layout) {
+	if (!layout) {
+		return;
+	}
 
-				memcpy(buffer + data_offset, d->data, d->data_size);
-			}
+	free(layout->entries);
+	string_table_free(&layout->string_table);
+	resource_directory_free(layout->root);
+	free(layout);
+}
 
-			data_entries_offset = entry_offset + 16;
-			data_offset = TO_NEAREST(data_offset + d->data_size, 8);
+void resource_table_invalidate_layout(resource_table_t *resource_table) {
+	resource_layout_free(resource_table->layout);
+	resource_table->layout = NULL;
+}
+
+// Sorts the table, builds the directory tree and places the strings, data
+// entries and payloads behind it
+static resource_layout_t *resource_layout_build(resource_table_t *resource_table) {
+	payload_table_t payloads = {0};
 
-			offset += 8;
+	resource_layout_t *layout = calloc(sizeof(resource_layout_t), 1);
+	if (!layout) {
+		ppelib_set_error("Failed to allocate resource layout");
+		return NULL;
+	}
 
-			furthest = MAX(furthest, data_offset);
-			furthest = MAX(furthest, offset);
+	resource_sort(resource_table);
+	if (ppelib_error_peek()) {
+		goto out;
+	}
+	resource_table_reindex(resource_table);
+
+	layout->root = resource_directory_build(resource_table->resources, 0, resource_table->size, 0);
+	if (!layout->root) {
+		goto out;
+	}
+
+	layout->entries = calloc(sizeof(resource_layout_entry_t), resource_table->size);
+	if (!layout->entries) {
+		ppelib_set_error("Failed to allocate resource layout");
+		goto out;
+	}
+
+	resource_directory_place(layout, layout->root);
+	if (ppelib_error_peek()) {
+		goto out;
+	}
+
+	for (size_t i = 0; i < resource_table->size; ++i) {
+		resource_t *resource = resource_table->resources[i];
+
+		if (resource->type) {
+			string_table_put(&layout->string_table, resource->type);
+		}
+
+		if (resource->name) {
+			string_table_put(&layout->string_table, resource->name);
+		}
+
+		if (resource->language) {
+			string_table_put(&layout->string_table, resource->language);
 		}
 	}
 
-	return furthest;
-}
+	if (ppelib_error_peek()) {
+		goto out;
+	}
 
-static resource_directory_table_t *get_or_create_table(resource_directory_table_t *base, const char *name, const uint32_t id) {
-	for (uint32_t i = 0; i < base->number_of_entries; ++i) {
-		if (name && base->entries[i].name) {
-			if (strcmp(base->entries[i].name, name) == 0) {
-				return base->entries[i].directory_table;
-			}
-		} else {
-			if (base->entries[i].name_id == id) {
-				return base->entries[i].directory_table;
+	size_t string_table_offset = layout->root->size;
+
+	layout->string_table.base_offset = (uint32_t)string_table_offset;
+	layout->data_entries_offset = TO_NEAREST(string_table_offset + layout->string_table.bytes, 8);
+
+	if (resource_table->share_data) {
+		payloads.numb_payloads = 16;
+		while (payloads.numb_payloads < layout->numb_entries * 2) {
+			payloads.numb_payloads *= 2;
+		}
+
+		payloads.payloads = calloc(payloads.numb_payloads, sizeof(payload_t));
+		if (!payloads.payloads) {
+			ppelib_set_error("Failed to allocate payload table");
+			goto out;
+		}
+	}
+
+	// Identical payloads all point at the first copy
+	size_t data_offset = layout->data_entries_offset + (layout->numb_entries * 16);
+	for (size_t i = 0; i < layout->numb_entries; ++i) {
+		resource_layout_entry_t *entry = &layout->entries[i];
+		const resource_data_entry_t *d = entry->data_entry;
+
+		if (!d->data && d->data_size) {
+			ppelib_set_error("Resource data wasn't loaded");
+			goto out;
+		}
+
+		entry->data_offset = data_offset;
+		if (payloads.payloads) {
+			uint32_t hash = payload_hash(d->data, d->data_size);
+			payload_t *p = payload_find(&payloads, d, hash);
+			if (p->offset) {
+				entry->data_offset = p->offset;
+				entry->shared = 1;
+				continue;
 			}
+
+			p->data = d->data;
+			p->size = d->data_size;
+			p->hash = hash;
+			p->offset = data_offset;
 		}
+
+		data_offset = TO_NEAREST(data_offset + d->data_size, 8);
+	}
+
+	if (data_offset > UINT32_MAX) {
+		ppelib_set_error("Resource table too large");
+		goto out;
 	}
 
-	resource_directory_entry_t *directory_entry;
-	++base->number_of_entries;
-	base->entries = realloc(base->entries, sizeof(resource_directory_entry_t) * base->number_of_entries);
-	directory_entry = &base->entries[base->number_of_entries - 1];
-	memset(directory_entry, 0, sizeof(resource_directory_entry_t));
+	layout->size = data_offset;
+
+out:
+	free(payloads.payloads);
 
-	directory_entry->name = name;
-	directory_entry->name_id = id;
+	if (ppelib_error_peek()) {
+		resource_layout_free(layout);
+		return NULL;
+	}
 
-	directory_entry->directory_table = calloc(sizeof(resource_directory_table_t), 1);
-	return directory_entry->directory_table;
+	return layout;
 }
 
-static void resource_create(resource_directory_table_t *root, resource_t *resource) {
-	resource_directory_table_t *type_table = NULL;
-	resource_directory_table_t *name_table = NULL;
+// The original table's bytes in the section it was parsed from. Only ever
+// read, changes go into the copy being written.
+static const uint8_t *original_contents(const resource_table_t *resource_table) {
+	return resource_table->original_section->contents + resource_table->original_offset;
+}
 
-	type_table = get_or_create_table(root, resource->type, resource->type_id);
-	type_table->characteristics = resource->type_characteristics;
-	type_table->time_date_stamp = resource->type_date_time_stamp;
-	type_table->major_version = resource->type_major_version;
-	type_table->minor_version = resource->type_minor_version;
+// Whether a changed payload fits over its old one in the original table. Only
+// when no other data entry shares those bytes.
+static uint8_t payload_fits(const resource_table_t *resource_table, const resource_t *resource) {
+	const uint8_t *original = original_contents(resource_table);
+	size_t base = resource_table->original_offset;
+	size_t entries_end = 0;
 
-	name_table = get_or_create_table(type_table, resource->name, resource->name_id);
-	name_table->characteristics = resource->name_characteristics;
-	name_table->time_date_stamp = resource->name_date_time_stamp;
-	name_table->major_version = resource->name_major_version;
-	name_table->minor_version = resource->name_minor_version;
+	size_t data_offset = resource->data_offset - base;
+	size_t data_size = read_uint32_t(original + resource->entry_offset - base + 4);
 
-	resource_directory_entry_t *directory_entry;
-	++name_table->number_of_entries;
-	name_table->entries = realloc(name_table->entries, sizeof(resource_directory_entry_t) * name_table->number_of_entries);
-	directory_entry = &name_table->entries[name_table->number_of_entries - 1];
+	if (resource->size > data_size) {
+		return 0;
+	}
 
-	memset(directory_entry, 0, sizeof(resource_directory_entry_t));
+	for (size_t i = 0; i < resource_table->size; ++i) {
+		const resource_t *other = resource_table->resources[i];
+		entries_end = MAX(entries_end, other->entry_offset - base + 16);
 
-	directory_entry->name = resource->language;
-	directory_entry->name_id = resource->language_id;
+		if (other == resource) {
+			continue;
+		}
 
-	directory_entry->data_entry = calloc(sizeof(resource_data_entry_t), 1);
-	resource_data_entry_t *data_entry = directory_entry->data_entry;
+		size_t other_offset = other->data_offset - base;
+		size_t other_size = read_uint32_t(original + other->entry_offset - base + 4);
+		if (other_size && data_size && other_offset < data_offset + data_size && data_offset < other_offset + other_size) {
+			return 0;
+		}
+	}
 
-	data_entry->codepage = resource->codepage;
-	data_entry->data_size = (uint32_t)resource->size;
-	data_entry->data = resource->data;
+	return data_offset >= entries_end;
 }
 
-void resource_directory_free(resource_directory_table_t *base) {
-	if (!base) {
-		return;
+// Writes a changed payload over its old one in a copy of the original table
+static void patch_payload(const resource_table_t *resource_table, uint8_t *contents, const resource_t *resource) {
+	size_t base = resource_table->original_offset;
+	size_t data_offset = resource->data_offset - base;
+	size_t data_size = read_uint32_t(original_contents(resource_table) + resource->entry_offset - base + 4);
+
+	memcpy(contents + data_offset, resource->data, resource->size);
+	memset(contents + data_offset + resource->size, 0, data_size - resource->size);
+	write_uint32_t(contents + resource->entry_offset - base + 4, (uint32_t)resource->size);
+}
+
+// Whether the original table can still be written with the changed payloads
+// patched in. When it can't the table has to be laid out instead.
+static uint8_t original_usable(const resource_table_t *resource_table) {
+	const section_t *section = resource_table->original_section;
+	if (resource_table->size != resource_table->original_count) {
+		return 0;
 	}
 
-	for (size_t i = 0; i < base->number_of_entries; ++i) {
-		resource_directory_free(base->entries[i].directory_table);
-		free(base->entries[i].data_entry);
+	// Cut short since it was parsed
+	if (resource_table->original_offset + resource_table->original_size > section->contents_size) {
+		return 0;
 	}
 
-	free(base->entries);
-	free(base);
+	for (size_t i = 0; i < resource_table->size; ++i) {
+		const resource_t *resource = resource_table->resources[i];
+		if (resource->dirty && !payload_fits(resource_table, resource)) {
+			return 0;
+		}
+	}
+
+	return 1;
 }
 
-size_t resource_table_serialize(const section_t *section, const size_t offset, resource_table_t *resource_table) {
-	ppelib_reset_error();
+// Points the data entries in a copy of the original at a new table RVA
+static void relocate_original(const resource_table_t *resource_table, uint8_t *contents, size_t rva) {
+	size_t base = resource_table->original_offset;
 
-	if (section) {
-		rscs_base = section->virtual_address;
-	} else {
-		rscs_base = 0;
+	for (size_t i = 0; i < resource_table->size; ++i) {
+		const resource_t *resource = resource_table->resources[i];
+		write_uint32_t(contents + resource->entry_offset - base, (uint32_t)(rva + resource->data_offset - base));
 	}
+}
+
+size_t resource_table_serialize(section_t *section, const size_t offset, resource_table_t *resource_table) {
+	ppelib_reset_error();
 
 	if (!resource_table->size) {
 		return 0;
 	}
 
-	qsort(resource_table->resources, resource_table->size, sizeof(resource_t *), &langcmp);
-	qsort(resource_table->resources, resource_table->size, sizeof(resource_t *), &namecmp);
-	qsort(resource_table->resources, resource_table->size, sizeof(resource_t *), &typecmp);
+	if (resource_table->original_section && !original_usable(resource_table)) {
+		resource_table_mark_modified(resource_table);
+	}
 
-	resource_directory_table_t *root = calloc(sizeof(resource_directory_table_t), 1);
-	memset(&string_table, 0, sizeof(string_table));
-	root->characteristics = resource_table->characteristics;
-	root->time_date_stamp = resource_table->date_time_stamp;
-	root->major_version = resource_table->major_version;
-	root->minor_version = resource_table->minor_version;
+	if (resource_table->original_section) {
+		if (!section) {
+			return resource_table->original_size;
+		}
 
-	for (size_t i = 0; i < resource_table->size; ++i) {
-		resource_t *resource = resource_table->resources[i];
-		resource_create(root, resource);
+		section_own_contents(section);
+		if (ppelib_error_peek()) {
+			return 0;
+		}
 
-		if (resource->type) {
-			string_table_put(&string_table, resource->type);
+		if (offset > section->contents_size || section->contents_size - offset < resource_table->original_size) {
+			ppelib_set_error("Not enough space for resource table");
+			return 0;
 		}
 
-		if (resource->name) {
-			string_table_put(&string_table, resource->name);
+		// Usually the original is written back to where it came from, the
+		// section it borrowed from was only copied just now
+		uint8_t *contents = section->contents + offset;
+		const uint8_t *original = original_contents(resource_table);
+		if (contents != original) {
+			memmove(contents, original, resource_table->original_size);
 		}
 
-		if (resource->language) {
-			string_table_put(&string_table, resource->language);
+		// Changed payloads stay marked, a copy written elsewhere leaves the
+		// original without them
+		for (size_t i = 0; i < resource_table->size; ++i) {
+			const resource_t *resource = resource_table->resources[i];
+			if (resource->dirty) {
+				patch_payload(resource_table, contents, resource);
+			}
+		}
+
+		size_t rva = section->virtual_address + offset;
+		if (rva != resource_table->original_rva) {
+			relocate_original(resource_table, contents, rva);
+			if (contents == original) {
+				resource_table->original_rva = rva;
+			}
+		}
+
+		// Like the layout's, the root header may change on its own
+		write_uint32_t(contents + 0, resource_table->characteristics);
+		write_uint32_t(contents + 4, resource_table->date_time_stamp);
+		write_uint16_t(contents + 8, resource_table->major_version);
+		write_uint16_t(contents + 10, resource_table->minor_version);
+
+		return resource_table->original_size;
+	}
+
+	// The layout holds on to payloads, any that changed make it stale
+	for (size_t i = 0; i < resource_table->size; ++i) {
+		resource_t *resource = resource_table->resources[i];
+		if (resource->dirty) {
+			resource_table_invalidate_layout(resource_table);
+			resource->dirty = 0;
 		}
 	}
 
-	size_t string_table_offset = resource_table_directory_size(root, 0);
+	if (!resource_table->layout) {
+		resource_table->layout = resource_layout_build(resource_table);
+		if (!resource_table->layout) {
+			return 0;
+		}
+	}
 
-	string_table.base_offset = (uint32_t)string_table_offset;
+	resource_layout_t *layout = resource_table->layout;
+	if (!section) {
+		return layout->size;
+	}
 
-	size_t data_entries = resource_table_data_entries_number(root, 0);
-	data_entries_offset = TO_NEAREST(string_table_offset + string_table.bytes, 8);
-	data_offset = data_entries_offset + (data_entries * 16);
+	section_own_contents(section);
+	if (ppelib_error_peek()) {
+		return 0;
+	}
 
-	if (section) {
-		memset(section->contents, 0, section->contents_size);
-		total_size = resource_table_write(root, section->contents, offset);
-		string_table_serialize(&string_table, section->contents + offset);
-	} else {
-		total_size = resource_table_write(root, NULL, offset);
+	if (offset > section->contents_size || section->contents_size - offset < layout->size) {
+		ppelib_set_error("Not enough space for resource table");
+		return 0;
 	}
 
-	string_table_free(&string_table);
-	resource_directory_free(root);
+	// The root header isn't part of the layout, it may change without
+	// touching any resource
+	layout->root->characteristics = resource_table->characteristics;
+	layout->root->time_date_stamp = resource_table->date_time_stamp;
+	layout->root->major_version = resource_table->major_version;
+	layout->root->minor_version = resource_table->minor_version;
 
-	return total_size;
+	uint8_t *buffer = section->contents + offset;
+	size_t rscs_base = section->virtual_address + offset;
+
+	memset(section->contents, 0, section->contents_size);
+
+	size_t entry = 0;
+	resource_directory_write(layout, layout->root, buffer, 0, &entry);
+	string_table_serialize(&layout->string_table, buffer);
+
+	for (size_t i = 0; i < layout->numb_entries; ++i) {
+		const resource_layout_entry_t *e = &layout->entries[i];
+		const resource_data_entry_t *d = e->data_entry;
+		uint8_t *data_entry = buffer + layout->data_entries_offset + (i * 16);
+
+		write_uint32_t(data_entry + 0, (uint32_t)(rscs_base + e->data_offset));
+		write_uint32_t(data_entry + 4, d->data_size);
+		write_uint32_t(data_entry + 8, d->codepage);
+		write_uint32_t(data_entry + 12, d->reserved);
+
+		if (!e->shared) {
+			memcpy(buffer + e->data_offset, d->data, d->data_size);
+		}
+	}
+
+	return layout->size;
 }
 
-void update_resource_table(ppelib_file_t *pe) {
+void update_versioninfo(ppelib_file_t *pe) {
 	for (size_t i = 0; i < pe->resource_table.numb_versioninfo; ++i) {
+		version_info_t *versioninfo = &pe->resource_table.versioninfo[i];
+		if (!versioninfo_changed(versioninfo)) {
+			continue;
+		}
+
 		for (size_t l = 0; l < pe->resource_table.size; ++l) {
-			if (&pe->resource_table.resources[l] == &pe->resource_table.versioninfo[i].resource) {
-				versioninfo_serialize(&pe->resource_table.versioninfo[i]);
+			if (pe->resource_table.resources[l] == versioninfo->resource) {
+				versioninfo_serialize(versioninfo);
 				break;
 			}
 		}
+		versioninfo->dirty = 0;
 	}
+}
 
+void update_resource_table(ppelib_file_t *pe) {
+	update_versioninfo(pe);
 	ppelib_recalculate(pe);
 
 	section_t *section = NULL;
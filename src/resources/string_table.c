@@ -33,6 +33,10 @@ void string_table_serialize(string_table_t *table, uint8_t *buffer) {
 		const char *string = table->strings[i].utf16_string;
 		size_t size = table->strings[i].bytes;
 
+		if (!string) {
+			continue;
+		}
+
 		if (size / 2 > UINT16_MAX) {
 			ppelib_set_error("String too long");
 			return;
@@ -44,20 +48,106 @@ void string_table_serialize(string_table_t *table, uint8_t *buffer) {
 	}
 }
 
-string_table_string_t *string_table_find(string_table_t *table, const char *string) {
-	//	printf("string_table_find: '%s'\n", string);
+// FNV-1a
+static uint32_t hash_bytes(const uint8_t *data, size_t size) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static size_t *bucket_find(const string_table_t *table, size_t *buckets, uint32_t hash, const char *string,
+		const char *utf16_string, size_t bytes) {
+	size_t mask = table->numb_buckets - 1;
+	size_t slot = hash & mask;
+
+	while (buckets[slot]) {
+		const string_table_string_t *s = &table->strings[buckets[slot] - 1];
+		if (string) {
+			if (s->hash == hash && (s->string == string || strcmp(s->string, string) == 0)) {
+				break;
+			}
+		} else if (s->utf16_hash == hash && s->utf16_string && s->bytes == bytes &&
+				memcmp(s->utf16_string, utf16_string, bytes) == 0) {
+			break;
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	return &buckets[slot];
+}
+
+static uint8_t grow_buckets(string_table_t *table) {
+	size_t numb_buckets = table->numb_buckets ? table->numb_buckets * 2 : 64;
+	size_t *by_string = calloc(numb_buckets, sizeof(size_t));
+	size_t *by_utf16 = calloc(numb_buckets, sizeof(size_t));
+	if (!by_string || !by_utf16) {
+		free(by_string);
+		free(by_utf16);
+		ppelib_set_error("Failed to allocate string table");
+		return 0;
+	}
+
+	free(table->by_string);
+	free(table->by_utf16);
+	table->by_string = by_string;
+	table->by_utf16 = by_utf16;
+	table->numb_buckets = numb_buckets;
+
+	size_t mask = numb_buckets - 1;
 	for (size_t i = 0; i < table->size; ++i) {
-		if (strcmp(string, table->strings[i].string) == 0) {
-			return &table->strings[i];
+		size_t slot = table->strings[i].hash & mask;
+		while (by_string[slot]) {
+			slot = (slot + 1) & mask;
+		}
+		by_string[slot] = i + 1;
+
+		if (table->strings[i].utf16_string) {
+			slot = table->strings[i].utf16_hash & mask;
+			while (by_utf16[slot]) {
+				slot = (slot + 1) & mask;
+			}
+			by_utf16[slot] = i + 1;
 		}
 	}
 
-	return NULL;
+	return 1;
+}
+
+string_table_string_t *string_table_find(string_table_t *table, const char *string) {
+	//	printf("string_table_find: '%s'\n", string);
+	if (!table->numb_buckets) {
+		return NULL;
+	}
+
+	uint32_t hash = hash_bytes((const uint8_t *)string, strlen(string));
+	size_t *bucket = bucket_find(table, table->by_string, hash, string, NULL, 0);
+	if (!*bucket) {
+		return NULL;
+	}
+
+	return &table->strings[*bucket - 1];
 }
 
 void string_table_put(string_table_t *table, const char *string) {
+	if ((table->size + 1) * 2 > table->numb_buckets && !grow_buckets(table)) {
+		return;
+	}
+
+	uint32_t hash = hash_bytes((const uint8_t *)string, strlen(string));
+	size_t *bucket = bucket_find(table, table->by_string, hash, string, NULL, 0);
+	if (*bucket) {
+		return;
+	}
+
 	char *string_utf16;
 	size_t s_size = convert_utf8_string(string, &string_utf16);
+	if (ppelib_error_peek()) {
+		return;
+	}
 
 	//	printf("Utf16-pointer: %p\n", string_utf16);
 	//	printf("String_table_put: %zi, '%s'\n", s_size, string);
@@ -67,26 +157,39 @@ void string_table_put(string_table_t *table, const char *string) {
 		return;
 	}
 
-	if (string_table_find(table, string)) {
-		free(string_utf16);
-		return;
+	if (table->size == table->capacity) {
+		size_t capacity = table->capacity ? table->capacity * 2 : 16;
+		string_table_string_t *strings = realloc(table->strings, sizeof(string_table_string_t) * capacity);
+		if (!strings) {
+			ppelib_set_error("Failed to allocate string table");
+			free(string_utf16);
+			return;
+		}
+		table->strings = strings;
+		table->capacity = capacity;
 	}
 
-	table->size++;
-	table->bytes += s_size + 2;
-
-	table->strings = realloc(table->strings, sizeof(string_table_string_t) * table->size);
-	table->strings[table->size - 1].string = string;
-	table->strings[table->size - 1].utf16_string = string_utf16;
-	table->strings[table->size - 1].bytes = (uint16_t)s_size;
-
-	if (table->size > 1) {
-		uint32_t prev_offset = table->strings[table->size - 2].offset;
-		uint32_t prev_length = table->strings[table->size - 2].bytes;
-		table->strings[table->size - 1].offset = prev_offset + prev_length + 2;
+	string_table_string_t *entry = &table->strings[table->size];
+	entry->string = string;
+	entry->hash = hash;
+	entry->bytes = (uint16_t)s_size;
+	entry->utf16_hash = hash_bytes((const uint8_t *)string_utf16, s_size);
+
+	// Different UTF-8 that encodes to the same UTF-16 shares its bytes
+	size_t *utf16_bucket = bucket_find(table, table->by_utf16, entry->utf16_hash, NULL, string_utf16, s_size);
+	if (*utf16_bucket) {
+		entry->offset = table->strings[*utf16_bucket - 1].offset;
+		entry->utf16_string = NULL;
+		free(string_utf16);
 	} else {
-		table->strings[table->size - 1].offset = 0;
+		entry->offset = (uint32_t)table->bytes;
+		entry->utf16_string = string_utf16;
+		table->bytes += s_size + 2;
+		*utf16_bucket = table->size + 1;
 	}
+
+	*bucket = table->size + 1;
+	table->size++;
 }
 
 void string_table_free(string_table_t *table) {
@@ -95,4 +198,6 @@ void string_table_free(string_table_t *table) {
 	}
 
 	free(table->strings);
+	free(table->by_string);
+	free(table->by_utf16);
 }
@@ -25,17 +25,27 @@ typedef struct string_table_string {
 	uint32_t offset;
 	uint16_t bytes;
 
+	uint32_t hash;
+	uint32_t utf16_hash;
+
 	const char *string;
+	// NULL when another string encodes to the same UTF-16 and owns the bytes
 	char *utf16_string;
 } string_table_string_t;
 
 typedef struct string_table {
 	size_t size;
+	size_t capacity;
 	size_t bytes;
 
 	uint32_t base_offset;
 
 	string_table_string_t *strings;
+
+	// Open addressed indices into strings plus one, 0 is an empty slot
+	size_t numb_buckets;
+	size_t *by_string;
+	size_t *by_utf16;
 } string_table_t;
 
 void string_table_free(string_table_t *table);
@@ -46,6 +46,7 @@ void versioninfo_free(version_info_t *versioninfo) {
 
 	free(versioninfo->languages);
 	free(versioninfo->fileinfo);
+	free(versioninfo->error);
 }
 
 dictionary_t *create_fileinfo(version_info_t *versioninfo, const uint16_t language, const uint16_t codepage) {
@@ -91,6 +92,7 @@ void versioninfo_set_value(version_info_t *versioninfo, const uint16_t language,
 
 	//	printf("versioninfo_set_value: %s = %s\n", key, value);
 	dictionary_t *fileinfo = find_or_create_fileinfo(versioninfo, language, codepage);
+	versioninfo->dirty = 1;
 
 	char *strip_key = strip_string(key);
 	char *strip_value = strip_string(value);
@@ -113,6 +115,38 @@ void versioninfo_set_value(version_info_t *versioninfo, const uint16_t language,
 	fileinfo->entries[idx]->value = strip_value;
 }
 
+void versioninfo_set_file_version(version_info_t *versioninfo, const uint16_t major, const uint16_t minor, const uint16_t patch, const uint16_t build) {
+	ppelib_reset_error();
+
+	versioninfo->file_version.major_version = major;
+	versioninfo->file_version.minor_version = minor;
+	versioninfo->file_version.patch_version = patch;
+	versioninfo->file_version.build_version = build;
+	versioninfo->dirty = 1;
+}
+
+void versioninfo_set_product_version(version_info_t *versioninfo, const uint16_t major, const uint16_t minor, const uint16_t patch, const uint16_t build) {
+	ppelib_reset_error();
+
+	versioninfo->product_version.major_version = major;
+	versioninfo->product_version.minor_version = minor;
+	versioninfo->product_version.patch_version = patch;
+	versioninfo->product_version.build_version = build;
+	versioninfo->dirty = 1;
+}
+
+// Marked through the setters, or a fixed field that was assigned directly
+uint8_t versioninfo_changed(const version_info_t *versioninfo) {
+	if (versioninfo->dirty) {
+		return 1;
+	}
+
+	uint8_t fixed[VERSIONINFO_FIXED_SIZE];
+	versioninfo_fixed_serialize(versioninfo, fixed);
+
+	return memcmp(fixed, versioninfo->fixed, VERSIONINFO_FIXED_SIZE) != 0;
+}
+
 void versioninfo_print(const version_info_t *versioninfo) {
 	printf("File Version: %i.%i.%i.%i\n",
 			versioninfo->file_version.major_version,
@@ -23,6 +23,8 @@
 
 typedef struct resource resource_t;
 
+#define VERSIONINFO_FIXED_SIZE 52
+
 typedef struct dictionary_entry {
 	char *key;
 	char *value;
@@ -66,6 +68,12 @@ typedef struct version_info {
 	language_t *languages;
 
 	resource_t *resource;
+	// What went wrong decoding it, NULL when nothing did
+	char *error;
+	// Changed since it was parsed or last serialized into the resource
+	uint8_t dirty;
+	// VS_FIXEDFILEINFO as of then, so the fields above can be changed directly
+	uint8_t fixed[VERSIONINFO_FIXED_SIZE];
 } version_info_t;
 
 void versioninfo_set_value(version_info_t *versioninfo, const uint16_t language, const uint16_t codepage, const char *key, const char *value);
@@ -74,8 +82,11 @@ void versioninfo_set_product_version(version_info_t *versioninfo, const uint16_t
 
 const char *versioninfo_get_value(version_info_t *versioninfo, const uint16_t language, const uint16_t codepage, const char *key);
 
+uint8_t versioninfo_changed(const version_info_t *versioninfo);
+
 void versioninfo_deserialize(resource_t *resource, version_info_t *versioninfo);
 void versioninfo_serialize(version_info_t *versioninfo);
+void versioninfo_fixed_serialize(const version_info_t *versioninfo, uint8_t *buffer);
 
 void versioninfo_free(version_info_t *versioninfo);
 void versioninfo_print(const version_info_t *versioninfo);
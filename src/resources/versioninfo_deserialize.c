@@ -466,5 +466,8 @@ void versioninfo_deserialize(resource_t *resource, version_info_t *versioninfo)
 	}
 
 out:
+	// Filling it in isn't a change
+	versioninfo->dirty = 0;
+	versioninfo_fixed_serialize(versioninfo, versioninfo->fixed);
 	free(key);
 }
@@ -32,19 +32,22 @@
 #include "resources/versioninfo.h"
 #include "utils.h"
 
-thread_local static uint8_t *buffer[1];
-thread_local static size_t buffer_size;
-
-static void resize_buffer(size_t size) {
-	if (buffer_size < size) {
-		size_t old_size = buffer_size;
-		buffer_size = size;
-		*buffer = realloc(*buffer, buffer_size);
-		memset(*buffer + old_size, 0, size - old_size);
+// Growable output for one VS_VERSIONINFO blob
+typedef struct serialize_buffer {
+	uint8_t *data;
+	size_t size;
+} serialize_buffer_t;
+
+static void resize_buffer(serialize_buffer_t *buffer, size_t size) {
+	if (buffer->size < size) {
+		size_t old_size = buffer->size;
+		buffer->size = size;
+		buffer->data = realloc(buffer->data, buffer->size);
+		memset(buffer->data + old_size, 0, size - old_size);
 	}
 }
 
-static uint16_t string_serialize(size_t offset, dictionary_entry_t *entry) {
+static uint16_t string_serialize(serialize_buffer_t *buffer, size_t offset, dictionary_entry_t *entry) {
 	uint16_t length = 0;
 	uint16_t type = 1;
 
@@ -59,8 +62,8 @@ static uint16_t string_serialize(size_t offset, dictionary_entry_t *entry) {
 	size_t key_offset = 6;
 	size_t value_offset = TO_NEAREST(key_offset + key_len + 2, 4);
 
-	resize_buffer(offset + value_offset + value_len);
-	uint8_t *buf = *buffer + offset;
+	resize_buffer(buffer, offset + value_offset + value_len);
+	uint8_t *buf = buffer->data + offset;
 
 	memcpy(buf + key_offset, key, key_len);
 	memcpy(buf + value_offset, value, value_len);
@@ -76,13 +79,13 @@ static uint16_t string_serialize(size_t offset, dictionary_entry_t *entry) {
 	return length;
 }
 
-static uint16_t stringtable_serialize(size_t offset, dictionary_t *fileinfo) {
+static uint16_t stringtable_serialize(serialize_buffer_t *buffer, size_t offset, dictionary_t *fileinfo) {
 	uint16_t length = 24;
 	uint16_t value_length = 0;
 	uint16_t type = 1;
 
-	resize_buffer(offset + length);
-	uint8_t *buf = *buffer + offset;
+	resize_buffer(buffer, offset + length);
+	uint8_t *buf = buffer->data + offset;
 
 	char langcode[9];
 	snprintf(langcode, 9, "%04x%04x", fileinfo->language.language, fileinfo->language.codepage);
@@ -93,12 +96,12 @@ static uint16_t stringtable_serialize(size_t offset, dictionary_t *fileinfo) {
 
 	for (size_t i = 0; i < fileinfo->size; ++i) {
 		size_t child_offset = TO_NEAREST(offset + length, 4);
-		size_t child_length = string_serialize(child_offset, fileinfo->entries[i]);
+		size_t child_length = string_serialize(buffer, child_offset, fileinfo->entries[i]);
 		child_length = TO_NEAREST(child_length, 4);
 		length += (uint16_t)child_length;
 	}
 
-	buf = *buffer + offset;
+	buf = buffer->data + offset;
 	write_uint16_t(buf, length);
 	write_uint16_t(buf + 2, value_length);
 	write_uint16_t(buf + 4, type);
@@ -106,7 +109,7 @@ static uint16_t stringtable_serialize(size_t offset, dictionary_t *fileinfo) {
 	return length;
 }
 
-static uint16_t varfileinfo_serialize(size_t offset, version_info_t *versioninfo) {
+static uint16_t varfileinfo_serialize(serialize_buffer_t *buffer, size_t offset, version_info_t *versioninfo) {
 	const uint8_t key[] = "VarFileInfo";
 	const uint8_t translation[] = "Translation";
 
@@ -123,8 +126,8 @@ static uint16_t varfileinfo_serialize(size_t offset, version_info_t *versioninfo
 	length = (uint16_t)(codepages_offset + codepages_size);
 	uint16_t translation_size = length - (uint16_t)translation_offset;
 
-	resize_buffer(offset + length);
-	uint8_t *buf = *buffer + offset;
+	resize_buffer(buffer, offset + length);
+	uint8_t *buf = buffer->data + offset;
 
 	for (size_t i = 0; i < sizeof(key); ++i) {
 		write_uint16_t(buf + 6 + (i * 2), key[i]);
@@ -150,24 +153,24 @@ static uint16_t varfileinfo_serialize(size_t offset, version_info_t *versioninfo
 	return length;
 }
 
-static uint16_t stringfileinfo_serialize(size_t offset, dictionary_t *fileinfo) {
+static uint16_t stringfileinfo_serialize(serialize_buffer_t *buffer, size_t offset, dictionary_t *fileinfo) {
 	uint16_t length = 36;
 	uint16_t value_length = 0;
 	uint16_t type = 1;
 
 	size_t next_offset = TO_NEAREST(length, 4);
 
-	resize_buffer(offset + next_offset);
-	uint8_t *buf = *buffer + offset;
+	resize_buffer(buffer, offset + next_offset);
+	uint8_t *buf = buffer->data + offset;
 
 	const uint8_t key[] = "StringFileInfo";
 	for (size_t i = 0; i < sizeof(key); ++i) {
 		write_uint16_t(buf + 6 + (i * 2), key[i]);
 	}
 
-	length += stringtable_serialize(offset + next_offset, fileinfo);
+	length += stringtable_serialize(buffer, offset + next_offset, fileinfo);
 
-	buf = *buffer + offset;
+	buf = buffer->data + offset;
 	write_uint16_t(buf, length);
 	write_uint16_t(buf + 2, value_length);
 	write_uint16_t(buf + 4, type);
@@ -175,71 +178,72 @@ static uint16_t stringfileinfo_serialize(size_t offset, dictionary_t *fileinfo)
 	return length;
 }
 
-static uint16_t fixedfileinfo_serialize(size_t offset, version_info_t *versioninfo) {
-	resize_buffer(offset + 52);
+void versioninfo_fixed_serialize(const version_info_t *versioninfo, uint8_t *buffer) {
+	write_uint32_t(buffer, 0xFEEF04BD);
 
-	write_uint32_t(*buffer + offset, 0xFEEF04BD);
+	write_uint32_t(buffer + 4, versioninfo->version);
 
-	write_uint32_t(*buffer + offset + 4, versioninfo->version);
+	write_uint16_t(buffer + 8, versioninfo->file_version.minor_version);
+	write_uint16_t(buffer + 10, versioninfo->file_version.major_version);
+	write_uint16_t(buffer + 12, versioninfo->file_version.build_version);
+	write_uint16_t(buffer + 14, versioninfo->file_version.patch_version);
 
-	write_uint16_t(*buffer + offset + 8, versioninfo->file_version.minor_version);
-	write_uint16_t(*buffer + offset + 10, versioninfo->file_version.major_version);
-	write_uint16_t(*buffer + offset + 12, versioninfo->file_version.build_version);
-	write_uint16_t(*buffer + offset + 14, versioninfo->file_version.patch_version);
+	write_uint16_t(buffer + 16, versioninfo->product_version.minor_version);
+	write_uint16_t(buffer + 18, versioninfo->product_version.major_version);
+	write_uint16_t(buffer + 20, versioninfo->product_version.build_version);
+	write_uint16_t(buffer + 22, versioninfo->product_version.patch_version);
 
-	write_uint16_t(*buffer + offset + 16, versioninfo->product_version.minor_version);
-	write_uint16_t(*buffer + offset + 18, versioninfo->product_version.major_version);
-	write_uint16_t(*buffer + offset + 20, versioninfo->product_version.build_version);
-	write_uint16_t(*buffer + offset + 22, versioninfo->product_version.patch_version);
+	write_uint32_t(buffer + 24, versioninfo->flags_mask);
+	write_uint32_t(buffer + 28, versioninfo->flags);
+	write_uint32_t(buffer + 32, versioninfo->os);
+	write_uint32_t(buffer + 36, versioninfo->type);
+	write_uint32_t(buffer + 40, versioninfo->subtype);
+	write_uint64_t(buffer + 44, versioninfo->date);
+}
 
-	write_uint32_t(*buffer + offset + 24, versioninfo->flags_mask);
-	write_uint32_t(*buffer + offset + 28, versioninfo->flags);
-	write_uint32_t(*buffer + offset + 32, versioninfo->os);
-	write_uint32_t(*buffer + offset + 36, versioninfo->type);
-	write_uint32_t(*buffer + offset + 40, versioninfo->subtype);
-	write_uint64_t(*buffer + offset + 44, versioninfo->date);
+static uint16_t fixedfileinfo_serialize(serialize_buffer_t *buffer, size_t offset, version_info_t *versioninfo) {
+	resize_buffer(buffer, offset + VERSIONINFO_FIXED_SIZE);
+	versioninfo_fixed_serialize(versioninfo, buffer->data + offset);
 
-	return 52;
+	return VERSIONINFO_FIXED_SIZE;
 }
 
 void versioninfo_serialize(version_info_t *versioninfo) {
 	resource_t *resource = versioninfo->resource;
-	*buffer = NULL;
-	buffer_size = 0;
+	serialize_buffer_t buffer = {0};
 
-	resize_buffer(90);
+	resize_buffer(&buffer, 90);
 
 	uint16_t length = 38;
 	uint16_t value_length = 52;
 	uint16_t type = 0;
 
-	write_uint16_t(*buffer + 2, value_length);
-	write_uint16_t(*buffer + 4, type);
+	write_uint16_t(buffer.data + 2, value_length);
+	write_uint16_t(buffer.data + 4, type);
 
 	const uint8_t vsi_key[] = "VS_VERSION_INFO";
 	for (size_t i = 0; i < sizeof(vsi_key); ++i) {
-		write_uint16_t(*buffer + 6 + (i * 2), vsi_key[i]);
+		write_uint16_t(buffer.data + 6 + (i * 2), vsi_key[i]);
 	}
 
 	size_t offset = TO_NEAREST(38, 4);
-	uint16_t item_length = fixedfileinfo_serialize(offset, versioninfo);
+	uint16_t item_length = fixedfileinfo_serialize(&buffer, offset, versioninfo);
 	length += item_length;
 
 	for (size_t i = 0; i < versioninfo->numb_fileinfo; ++i) {
 		//for (size_t i = 0; i < 1; ++i) {
 		offset = TO_NEAREST(offset + item_length, 4);
-		item_length = stringfileinfo_serialize(offset, versioninfo->fileinfo[i]);
+		item_length = stringfileinfo_serialize(&buffer, offset, versioninfo->fileinfo[i]);
 		length += item_length;
 	}
 	offset = TO_NEAREST(offset + item_length, 4);
 
-	length += varfileinfo_serialize(offset, versioninfo);
-	//resize_buffer(TO_NEAREST(buffer_size, 4));
+	length += varfileinfo_serialize(&buffer, offset, versioninfo);
+	//resize_buffer(&buffer, TO_NEAREST(buffer.size, 4));
 
 	length = (uint16_t)TO_NEAREST(length, 4);
-	write_uint16_t(*buffer, length);
+	write_uint16_t(buffer.data, length);
 
-	free(resource->data);
-	resource->data = *buffer;
-	resource->size = buffer_size;
+	resource_set_data(resource, buffer.data, buffer.size);
+	versioninfo_fixed_serialize(versioninfo, versioninfo->fixed);
 }
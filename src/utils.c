@@ -22,6 +22,10 @@
 
 #include <iconv.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #ifdef LIBICONV_INTERNAL
 #define iconv_t ppelib_iconv_t
 #define iconv ppelib_iconv
@@ -132,57 +136,233 @@ const char *map_lookup(uint32_t value, const ppelib_map_entry_t *map) {
 	return NULL;
 }
 
-char *get_utf16_string(const uint8_t *buffer, size_t size, size_t offset, size_t string_size) {
+// UTF-16LE to UTF-8, out must hold in_size * 2 bytes. Returns the bytes
+// written, or NOT_CONVERTED for odd sizes and unpaired surrogates.
+size_t utf16le_to_utf8(const uint8_t *in, size_t in_size, uint8_t *out) {
+	if (in_size % 2) {
+		return NOT_CONVERTED;
+	}
+
+	size_t i = 0;
+	size_t o = 0;
+	while (i < in_size) {
+#ifdef __SSE2__
+		// Eight ASCII code units at a time
+		if (in_size - i >= 16) {
+			__m128i units = _mm_loadu_si128((const __m128i *)(in + i));
+			__m128i high = _mm_and_si128(units, _mm_set1_epi16((short)0xFF80));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())) == 0xFFFF) {
+				_mm_storel_epi64((__m128i *)(out + o), _mm_packus_epi16(units, units));
+				i += 16;
+				o += 8;
+				continue;
+			}
+		}
+#endif
+		uint32_t c = read_uint16_t(in + i);
+		i += 2;
+
+		if (c >= 0xD800 && c <= 0xDFFF) {
+			if (c > 0xDBFF || in_size - i < 2) {
+				return NOT_CONVERTED;
+			}
+
+			uint32_t low = read_uint16_t(in + i);
+			if (low < 0xDC00 || low > 0xDFFF) {
+				return NOT_CONVERTED;
+			}
+			i += 2;
+
+			c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+		}
+
+		if (c < 0x80) {
+			out[o++] = (uint8_t)c;
+		} else if (c < 0x800) {
+			out[o++] = (uint8_t)(0xC0 | (c >> 6));
+			out[o++] = (uint8_t)(0x80 | (c & 0x3F));
+		} else if (c < 0x10000) {
+			out[o++] = (uint8_t)(0xE0 | (c >> 12));
+			out[o++] = (uint8_t)(0x80 | ((c >> 6) & 0x3F));
+			out[o++] = (uint8_t)(0x80 | (c & 0x3F));
+		} else {
+			out[o++] = (uint8_t)(0xF0 | (c >> 18));
+			out[o++] = (uint8_t)(0x80 | ((c >> 12) & 0x3F));
+			out[o++] = (uint8_t)(0x80 | ((c >> 6) & 0x3F));
+			out[o++] = (uint8_t)(0x80 | (c & 0x3F));
+		}
+	}
+
+	return o;
+}
+
+// UTF-8 to UTF-16LE, out must hold in_size * 2 bytes. Returns the bytes
+// written, or NOT_CONVERTED for anything that isn't strictly valid UTF-8.
+size_t utf8_to_utf16le(const uint8_t *in, size_t in_size, uint8_t *out) {
+	size_t i = 0;
+	size_t o = 0;
+	while (i < in_size) {
+#ifdef __SSE2__
+		// Sixteen ASCII bytes at a time
+		if (in_size - i >= 16) {
+			__m128i bytes = _mm_loadu_si128((const __m128i *)(in + i));
+			if (!_mm_movemask_epi8(bytes)) {
+				__m128i zero = _mm_setzero_si128();
+				_mm_storeu_si128((__m128i *)(out + o), _mm_unpacklo_epi8(bytes, zero));
+				_mm_storeu_si128((__m128i *)(out + o + 16), _mm_unpackhi_epi8(bytes, zero));
+				i += 16;
+				o += 32;
+				continue;
+			}
+		}
+#endif
+		uint32_t c = in[i];
+		size_t length;
+		uint32_t min;
+
+		if (c < 0x80) {
+			length = 1;
+			min = 0;
+		} else if ((c & 0xE0) == 0xC0) {
+			length = 2;
+			min = 0x80;
+			c &= 0x1F;
+		} else if ((c & 0xF0) == 0xE0) {
+			length = 3;
+			min = 0x800;
+			c &= 0x0F;
+		} else if ((c & 0xF8) == 0xF0) {
+			length = 4;
+			min = 0x10000;
+			c &= 0x07;
+		} else {
+			return NOT_CONVERTED;
+		}
+
+		if (in_size - i < length) {
+			return NOT_CONVERTED;
+		}
+
+		for (size_t k = 1; k < length; ++k) {
+			if ((in[i + k] & 0xC0) != 0x80) {
+				return NOT_CONVERTED;
+			}
+			c = (c << 6) | (in[i + k] & 0x3F);
+		}
+		i += length;
+
+		// Overlong, out of range or a surrogate
+		if (c < min || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF)) {
+			return NOT_CONVERTED;
+		}
+
+		if (c < 0x10000) {
+			write_uint16_t(out + o, (uint16_t)c);
+			o += 2;
+		} else {
+			c -= 0x10000;
+			write_uint16_t(out + o, (uint16_t)(0xD800 | (c >> 10)));
+			write_uint16_t(out + o + 2, (uint16_t)(0xDC00 | (c & 0x3FF)));
+			o += 4;
+		}
+	}
+
+	return o;
+}
+
+typedef enum {
+	CONVERT_TO_UTF8,
+	CONVERT_TO_UTF16,
+	NUMB_CONVERTERS,
+} converter_t;
+
+// iconv converters for what the transcoder turns down, opened on first use
+// and kept per thread until close_string_converters()
+static thread_local iconv_t converters[NUMB_CONVERTERS];
+static thread_local uint8_t converter_open[NUMB_CONVERTERS];
+
+static iconv_t get_converter(converter_t converter) {
+	if (converter_open[converter]) {
+		// Start from the initial state, a failed conversion may have left one behind
+		iconv(converters[converter], NULL, NULL, NULL, NULL);
+		return converters[converter];
+	}
+
+	iconv_t cd;
+	if (converter == CONVERT_TO_UTF8) {
+		cd = iconv_open("UTF-8", "UTF-16LE");
+	} else {
+		cd = iconv_open("UTF-16LE", "UTF-8");
+	}
+
+	if (cd != (iconv_t)-1) {
+		converters[converter] = cd;
+		converter_open[converter] = 1;
+	}
+
+	return cd;
+}
+
+void close_string_converters() {
+	for (size_t i = 0; i < NUMB_CONVERTERS; ++i) {
+		if (converter_open[i]) {
+			iconv_close(converters[i]);
+			converter_open[i] = 0;
+		}
+	}
+}
+
+size_t utf16_string_capacity(size_t string_size) {
+	return string_size ? string_size * 2 : 2;
+}
+
+// Converts string_size bytes of UTF-16LE to a NUL terminated UTF-8 string in
+// string, which must hold utf16_string_capacity(string_size) bytes.
+uint8_t get_utf16_string_into(const uint8_t *buffer, size_t size, size_t offset, size_t string_size, char *string) {
 	if (offset + string_size > size) {
 		ppelib_set_error("Not enough space for string");
-		return NULL;
+		return 0;
 	}
 
-	size_t outstring_size = string_size * 2;
-	if (!outstring_size) {
-		outstring_size = 2;
-	}
-	char *string = calloc(outstring_size, 1);
-	if (!string) {
-		ppelib_set_error("Failed to allocate string");
-		return NULL;
+	size_t written = utf16le_to_utf8(buffer + offset, string_size, (uint8_t *)string);
+	if (written != NOT_CONVERTED) {
+		string[written] = 0;
+		return 1;
 	}
 
+	size_t outstring_size = utf16_string_capacity(string_size);
 	size_t insize = string_size;
 	size_t outsize = outstring_size;
 	char *instring = (char *)buffer + offset;
 	char *outstring = string;
 
-	iconv_t cd = iconv_open("UTF-8", "UTF-16LE");
+	iconv_t cd = get_converter(CONVERT_TO_UTF8);
 	if (cd == (iconv_t)-1) {
 		ppelib_set_error("iconv_open failed");
-		free(string);
-		return NULL;
+		return 0;
 	}
 	size_t ret = iconv(cd, &instring, &insize, &outstring, &outsize);
-	if (ret == (size_t)-1) {
+	if (ret == (size_t)-1 || !outsize) {
 		ppelib_set_error("string conversion failed");
+		return 0;
+	}
+
+	*outstring = 0;
+	return 1;
+}
+
+char *get_utf16_string(const uint8_t *buffer, size_t size, size_t offset, size_t string_size) {
+	char *string = malloc(utf16_string_capacity(string_size));
+	if (!string) {
+		ppelib_set_error("Failed to allocate string");
+		return NULL;
+	}
+
+	if (!get_utf16_string_into(buffer, size, offset, string_size, string)) {
 		free(string);
-		iconv_close(cd);
 		return NULL;
 	}
 
-	iconv_close(cd);
-	//
-	//	printf("get_utf16_string: outsize: %zi, LENGTH: %zi, DEBUG: '%s'\n", outstring_size, outstring_size - outsize, string);
-	//
-	//	outstring = string;
-	//	printf("outstring: ");
-	//	for (size_t i = 0; i < outstring_size - outsize; ++i) {
-	//		printf("0x%02X ", string[i]);
-	//	}
-	//	printf("\n");
-	//	printf("instring: ");
-	//	for (size_t i = 0; i < string_size; ++i) {
-	//		printf("0x%02X ", *((char *)buffer + offset + i));
-	//	}
-	//	printf("\n");
-	//printf("get_utf16_string: '%s', %zi\n", string, string_size);
 	return string;
 }
 
@@ -191,13 +371,22 @@ size_t convert_utf8_string(const char *string, char **outstring) {
 	size_t outstring_size = (string_size + 1) * 2;
 
 	*outstring = calloc(outstring_size, 1);
+	if (!*outstring) {
+		ppelib_set_error("Failed to allocate string");
+		return 0;
+	}
+
+	size_t written = utf8_to_utf16le((const uint8_t *)string, string_size, (uint8_t *)*outstring);
+	if (written != NOT_CONVERTED) {
+		return written;
+	}
 
 	size_t insize = string_size;
 	size_t outsize = outstring_size;
 	char *instring = (char *)string;
 	char *outstring_ptr = *outstring;
 
-	iconv_t cd = iconv_open("UTF-16LE", "UTF-8");
+	iconv_t cd = get_converter(CONVERT_TO_UTF16);
 	if (cd == (iconv_t)-1) {
 		ppelib_set_error("iconv_open failed");
 		free(*outstring);
@@ -207,12 +396,9 @@ size_t convert_utf8_string(const char *string, char **outstring) {
 	if (ret == (size_t)-1) {
 		ppelib_set_error("string conversion failed");
 		free(*outstring);
-		iconv_close(cd);
 		return 0;
 	}
 
-	iconv_close(cd);
-
 	//	printf("Instring: %s\n", string);
 	//	printf("convert_utf8_string: LENGTH: %zi, DEBUG: %s\n", outstring_size - outsize, string);
 	//
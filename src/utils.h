@@ -45,7 +45,16 @@ uint32_t get_machine_page_size(enum ppelib_machine_type machine);
 
 const char *map_lookup(uint32_t value, const ppelib_map_entry_t *map);
 
+// Built-in conversions for well formed input. Whatever they turn down goes to
+// iconv, which decides what counts as an error.
+#define NOT_CONVERTED SIZE_MAX
+size_t utf16le_to_utf8(const uint8_t *in, size_t in_size, uint8_t *out);
+size_t utf8_to_utf16le(const uint8_t *in, size_t in_size, uint8_t *out);
+
+size_t utf16_string_capacity(size_t string_size);
+uint8_t get_utf16_string_into(const uint8_t *buffer, size_t size, size_t offset, size_t string_size, char *string);
 char *get_utf16_string(const uint8_t *buffer, size_t size, size_t offset, size_t string_size);
 size_t convert_utf8_string(const char *string, char **outstring);
+void close_string_converters();
 
 #endif /* PPELIB_UTILS_H */
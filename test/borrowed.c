@@ -0,0 +1,78 @@
+/* Copyright 2021 Hein-Pieter van Braam-Stewart
+ *
+ * This file is part of ppelib (Portable Portable Executable LIBrary)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "ppe_error.h"
+#include "test_common.h"
+
+static uint8_t points_into(const uint8_t *data, const uint8_t *buffer, size_t size) {
+	return data >= buffer && data < buffer + size;
+}
+
+static void test_payloads_borrowed(const uint8_t *buffer, size_t size) {
+	ppelib_file_t *pe = ppelib_create_from_buffer_borrowed(buffer, size);
+	CHECK(!ppelib_error_peek());
+	CHECK(pe->resource_table.size == TEST_NUMB_RESOURCES);
+
+	for (size_t i = 0; i < pe->resource_table.size; ++i) {
+		resource_t *resource = pe->resource_table.resources[i];
+		CHECK(resource->data_borrowed);
+		CHECK(points_into(resource->data, buffer, size));
+		CHECK(points_into(resource->data + resource->size - 1, buffer, size));
+	}
+
+	ppelib_destroy(pe);
+}
+
+// The same image copied still has to come out the same
+static void test_payloads_copied(const uint8_t *buffer, size_t size) {
+	ppelib_file_t *pe = ppelib_create_from_buffer(buffer, size);
+	CHECK(!ppelib_error_peek());
+
+	for (size_t i = 0; i < pe->resource_table.size; ++i) {
+		CHECK(!points_into(pe->resource_table.resources[i]->data, buffer, size));
+	}
+
+	uint8_t *out = malloc(size);
+	CHECK(out);
+	CHECK(ppelib_write_to_buffer(pe, out, size) == size);
+	CHECK(!memcmp(out, buffer, size));
+
+	free(out);
+	ppelib_destroy(pe);
+}
+
+static void test_truncated(const uint8_t *buffer) {
+	ppelib_file_t *pe = ppelib_create_from_buffer_borrowed(buffer, 0x40);
+	CHECK(ppelib_error_peek());
+	ppelib_destroy(pe);
+}
+
+int main() {
+	size_t size;
+	uint8_t *buffer = test_image_create(&size);
+
+	test_payloads_borrowed(buffer, size);
+	test_payloads_copied(buffer, size);
+	test_truncated(buffer);
+
+	free(buffer);
+	return 0;
+}
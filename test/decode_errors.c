@@ -0,0 +1,110 @@
+/* Copyright 2021 Hein-Pieter van Braam-Stewart
+ *
+ * This file is part of ppelib (Portable Portable Executable LIBrary)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "ppe_error.h"
+#include "test_common.h"
+
+// Where the payload of a resource starts in the image
+static size_t payload_offset(const uint8_t *buffer, size_t size, uint32_t type_id) {
+	ppelib_file_t *pe = ppelib_create_from_buffer_borrowed(buffer, size);
+	CHECK(!ppelib_error_peek());
+
+	resource_t *resource = resource_get_by_type_id(&pe->resource_table, type_id, 0);
+	CHECK(resource && resource->data_borrowed);
+	size_t offset = (size_t)(resource->data - buffer);
+
+	ppelib_destroy(pe);
+	return offset;
+}
+
+static void test_intact(const uint8_t *buffer, size_t size) {
+	ppelib_file_t *pe = ppelib_create_from_buffer(buffer, size);
+	CHECK(!ppelib_error_peek());
+
+	CHECK(resource_get_versioninfo(&pe->resource_table, 0));
+	CHECK(!ppelib_error_peek());
+	CHECK(resource_get_icon_group(&pe->resource_table, 0));
+	CHECK(!ppelib_error_peek());
+
+	ppelib_destroy(pe);
+}
+
+// The entry is still there, but asking for it says what went wrong, every time
+static void test_broken(uint8_t *buffer, size_t size) {
+	size_t versioninfo = payload_offset(buffer, size, RT_VERSION);
+	size_t icon_group = payload_offset(buffer, size, RT_GROUP_ICON);
+
+	// The VS_FIXEDFILEINFO signature, and the first icon's id
+	write_uint32_t(buffer + versioninfo + 40, 0);
+	write_uint16_t(buffer + icon_group + 6 + 12, 999);
+
+	ppelib_file_t *pe = ppelib_create_from_buffer(buffer, size);
+	CHECK(!ppelib_error_peek());
+	resource_table_t *table = &pe->resource_table;
+
+	CHECK(resource_get_numb_versioninfo(table) == 1);
+	CHECK(!ppelib_error_peek());
+	for (size_t i = 0; i < 2; ++i) {
+		CHECK(resource_get_versioninfo(table, 0));
+		CHECK(ppelib_error_peek());
+		CHECK(strstr(ppelib_error(), "VS_FIXEDFILEINFO signature not found"));
+	}
+
+	CHECK(resource_get_numb_icon_group(table) == 1);
+	CHECK(!ppelib_error_peek());
+	for (size_t i = 0; i < 2; ++i) {
+		CHECK(resource_get_icon_group(table, 0));
+		CHECK(ppelib_error_peek());
+		CHECK(strstr(ppelib_error(), "Icon not in resource table"));
+	}
+
+	CHECK(!resource_get_versioninfo(table, 1));
+	CHECK(strstr(ppelib_error(), "Index out of range"));
+	CHECK(!resource_get_icon_group(table, 1));
+	CHECK(strstr(ppelib_error(), "Index out of range"));
+
+	ppelib_destroy(pe);
+}
+
+// Decoded by the getter instead of the count
+static void test_getter_first(const uint8_t *buffer, size_t size) {
+	ppelib_file_t *pe = ppelib_create_from_buffer(buffer, size);
+	CHECK(!ppelib_error_peek());
+
+	CHECK(resource_get_versioninfo(&pe->resource_table, 0));
+	CHECK(ppelib_error_peek());
+	CHECK(resource_get_icon_group(&pe->resource_table, 0));
+	CHECK(ppelib_error_peek());
+
+	ppelib_destroy(pe);
+}
+
+int main() {
+	size_t size;
+	uint8_t *buffer = test_image_create(&size);
+
+	test_intact(buffer, size);
+	test_broken(buffer, size);
+	test_getter_first(buffer, size);
+
+	free(buffer);
+	return 0;
+}
@@ -0,0 +1,207 @@
+/* Copyright 2021 Hein-Pieter van Braam-Stewart
+ *
+ * This file is part of ppelib (Portable Portable Executable LIBrary)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "ppe_error.h"
+#include "test_common.h"
+
+static ppelib_file_t *load(const uint8_t *buffer, size_t size) {
+	ppelib_file_t *pe = ppelib_create_from_buffer(buffer, size);
+	CHECK(!ppelib_error_peek());
+	CHECK(pe->resource_table.size == TEST_NUMB_RESOURCES);
+	return pe;
+}
+
+// What's left has to survive being written and parsed again
+static void check_roundtrip(ppelib_file_t *pe) {
+	update_resource_table(pe);
+	CHECK(!ppelib_error_peek());
+
+	size_t size = ppelib_write_to_buffer(pe, NULL, 0);
+	CHECK(size);
+	uint8_t *out = malloc(size);
+	CHECK(out);
+	CHECK(ppelib_write_to_buffer(pe, out, size) == size);
+
+	ppelib_file_t *copy = ppelib_create_from_buffer(out, size);
+	CHECK(!ppelib_error_peek());
+	CHECK(copy->resource_table.size == pe->resource_table.size);
+	for (size_t i = 0; i < pe->resource_table.size; ++i) {
+		const resource_t *resource = pe->resource_table.resources[i];
+		CHECK(test_find_resource(&copy->resource_table, resource->type_id, resource->name, resource->name_id, resource->language_id));
+	}
+
+	ppelib_destroy(copy);
+	free(out);
+}
+
+static void test_criteria(const uint8_t *buffer, size_t size) {
+	ppelib_file_t *pe = load(buffer, size);
+	resource_table_t *table = &pe->resource_table;
+
+	resource_filter_t filter = {0};
+	filter.match = RESOURCE_MATCH_TYPE | RESOURCE_MATCH_LANGUAGE;
+	filter.type_id = RT_RCDATA;
+	filter.language_id = TEST_OTHER_LANGUAGE;
+	CHECK(resource_table_filter(table, &filter) == 1);
+	CHECK(!ppelib_error_peek());
+	CHECK(table->size == TEST_NUMB_RESOURCES - 1);
+	CHECK(!test_find_resource(table, RT_RCDATA, TEST_RCDATA_NAME, 0, TEST_OTHER_LANGUAGE));
+	CHECK(test_find_resource(table, RT_RCDATA, TEST_RCDATA_NAME, 0, TEST_LANGUAGE));
+	CHECK(resource_count_by_type_id(table, RT_RCDATA) == 3);
+
+	// Nothing left to match
+	CHECK(!resource_table_filter(table, &filter));
+	CHECK(!ppelib_error_peek());
+
+	// A string never matches an id and the other way around
+	memset(&filter, 0, sizeof(filter));
+	filter.match = RESOURCE_MATCH_NAME;
+	filter.name_id = 1;
+	filter.match |= RESOURCE_MATCH_TYPE;
+	filter.type = "RCDATA";
+	CHECK(!resource_table_filter(table, &filter));
+
+	memset(&filter, 0, sizeof(filter));
+	filter.match = RESOURCE_MATCH_NAME;
+	filter.name = TEST_RCDATA_NAME;
+	CHECK(resource_table_filter(table, &filter) == 1);
+	CHECK(!test_find_resource(table, RT_RCDATA, TEST_RCDATA_NAME, 0, TEST_LANGUAGE));
+
+	// RT_RCDATA 1 and 2 are the only ones this size
+	memset(&filter, 0, sizeof(filter));
+	filter.match = RESOURCE_MATCH_SIZE;
+	filter.min_size = TEST_RCDATA_SIZE;
+	filter.max_size = TEST_RCDATA_SIZE;
+	CHECK(resource_table_filter(table, &filter) == 2);
+	CHECK(!resource_count_by_type_id(table, RT_RCDATA));
+	CHECK(!resource_get_by_type_id(table, RT_RCDATA, 0));
+	CHECK(table->size == TEST_NUMB_RESOURCES - 4);
+
+	check_roundtrip(pe);
+	ppelib_destroy(pe);
+}
+
+static uint8_t is_icon(const resource_t *resource, void *userdata) {
+	size_t *calls = userdata;
+	++*calls;
+
+	return resource->type_id == RT_ICON && resource->name_id == TEST_PNG_ICON_ID;
+}
+
+// The group stays, the icon that went loses its image
+static void test_icons(const uint8_t *buffer, size_t size) {
+	ppelib_file_t *pe = load(buffer, size);
+	resource_table_t *table = &pe->resource_table;
+
+	CHECK(resource_get_numb_icon_group(table) == 1);
+	icon_group_t *icon_group = resource_get_icon_group(table, 0);
+	CHECK(icon_group && icon_group->numb_icons == 2);
+
+	size_t png = icon_group->icons[0].resource->name_id == TEST_PNG_ICON_ID ? 0 : 1;
+	size_t dib = 1 - png;
+	CHECK(icon_group->icons[png].resource->name_id == TEST_PNG_ICON_ID);
+
+	uint32_t width, height;
+	CHECK(icon_decode_rgba(&icon_group->icons[png], &width, &height));
+
+	size_t calls = 0;
+	resource_filter_t filter = {0};
+	filter.match = RESOURCE_MATCH_CALLBACK;
+	filter.callback = &is_icon;
+	filter.userdata = &calls;
+	CHECK(resource_table_filter(table, &filter) == 1);
+	CHECK(calls == TEST_NUMB_RESOURCES);
+
+	icon_group = resource_get_icon_group(table, 0);
+	CHECK(icon_group && icon_group->numb_icons == 2);
+	CHECK(!icon_group->icons[png].resource);
+	CHECK(!icon_decode_rgba(&icon_group->icons[png], &width, &height));
+	CHECK(ppelib_error_peek());
+
+	size_t png_size;
+	CHECK(!icon_export_png(&icon_group->icons[png], &png_size));
+	CHECK(ppelib_error_peek());
+
+	CHECK(icon_decode_rgba(&icon_group->icons[dib], &width, &height));
+	CHECK(width == TEST_ICON_SIZE && height == TEST_ICON_SIZE);
+
+	// Without the group itself nothing is left
+	memset(&filter, 0, sizeof(filter));
+	filter.match = RESOURCE_MATCH_TYPE;
+	filter.type_id = RT_GROUP_ICON;
+	CHECK(resource_table_filter(table, &filter) == 1);
+	CHECK(!resource_get_numb_icon_group(table));
+
+	ppelib_destroy(pe);
+}
+
+static void test_delete(const uint8_t *buffer, size_t size) {
+	ppelib_file_t *pe = load(buffer, size);
+	resource_table_t *table = &pe->resource_table;
+
+	CHECK(resource_get_numb_versioninfo(table) == 1);
+	resource_t *versioninfo = test_find_resource(table, RT_VERSION, NULL, 1, TEST_LANGUAGE);
+	CHECK(versioninfo);
+
+	resource_delete(table, versioninfo);
+	CHECK(!ppelib_error_peek());
+	CHECK(table->size == TEST_NUMB_RESOURCES - 1);
+	CHECK(!resource_get_numb_versioninfo(table));
+	CHECK(!resource_count_by_type_id(table, RT_VERSION));
+
+	resource_t *rcdata[4];
+	CHECK(resource_count_by_type_id(table, RT_RCDATA) == 4);
+	for (size_t i = 0; i < 4; ++i) {
+		rcdata[i] = resource_get_by_type_id(table, RT_RCDATA, i);
+	}
+
+	// The others keep their order
+	resource_delete(table, rcdata[1]);
+	CHECK(!ppelib_error_peek());
+	CHECK(resource_count_by_type_id(table, RT_RCDATA) == 3);
+	CHECK(resource_get_by_type_id(table, RT_RCDATA, 0) == rcdata[0]);
+	CHECK(resource_get_by_type_id(table, RT_RCDATA, 1) == rcdata[2]);
+	CHECK(resource_get_by_type_id(table, RT_RCDATA, 2) == rcdata[3]);
+	for (size_t i = 0; i < table->size; ++i) {
+		CHECK(table->resources[i] != rcdata[1]);
+	}
+
+	// Already gone
+	resource_t stranger = {0};
+	resource_delete(table, &stranger);
+	CHECK(ppelib_error_peek());
+	CHECK(table->size == TEST_NUMB_RESOURCES - 2);
+
+	check_roundtrip(pe);
+	ppelib_destroy(pe);
+}
+
+int main() {
+	size_t size;
+	uint8_t *buffer = test_image_create(&size);
+
+	test_criteria(buffer, size);
+	test_icons(buffer, size);
+	test_delete(buffer, size);
+
+	free(buffer);
+	return 0;
+}
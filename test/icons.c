@@ -0,0 +1,355 @@
+/* Copyright 2021 Hein-Pieter van Braam-Stewart
+ *
+ * This file is part of ppelib (Portable Portable Executable LIBrary)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lodepng.h"
+
+#include "main.h"
+#include "ppe_error.h"
+#include "test_common.h"
+
+static icon_t *find_icon(icon_group_t *icon_group, uint32_t id) {
+	for (size_t i = 0; i < icon_group->numb_icons; ++i) {
+		if (icon_group->icons[i].resource && icon_group->icons[i].resource->name_id == id) {
+			return &icon_group->icons[i];
+		}
+	}
+
+	CHECK(0);
+	return NULL;
+}
+
+static icon_group_t *get_icon_group(ppelib_file_t *pe) {
+	CHECK(resource_get_numb_icon_group(&pe->resource_table) == 1);
+	icon_group_t *icon_group = resource_get_icon_group(&pe->resource_table, 0);
+	CHECK(!ppelib_error_peek());
+	CHECK(icon_group && icon_group->numb_icons == 2);
+	return icon_group;
+}
+
+// The DIB's mask leaves the first column empty
+static void check_pixels(const uint8_t *image, uint8_t masked) {
+	for (uint32_t y = 0; y < TEST_ICON_SIZE; ++y) {
+		for (uint32_t x = 0; x < TEST_ICON_SIZE; ++x) {
+			uint8_t expected[4] = {0};
+			if (!masked || x) {
+				test_icon_pixel(x, y, expected);
+			}
+
+			CHECK(!memcmp(image + (y * TEST_ICON_SIZE + x) * 4, expected, 4));
+		}
+	}
+}
+
+static void test_decode(ppelib_file_t *pe) {
+	icon_group_t *icon_group = get_icon_group(pe);
+	uint32_t width, height;
+
+	icon_t *png = find_icon(icon_group, TEST_PNG_ICON_ID);
+	CHECK(png->type == ICON_TYPE_PNG);
+	const uint8_t *image = icon_decode_rgba(png, &width, &height);
+	CHECK(!ppelib_error_peek());
+	CHECK(image && width == TEST_ICON_SIZE && height == TEST_ICON_SIZE);
+	check_pixels(image, 0);
+
+	// Decoded once
+	CHECK(icon_decode_rgba(png, &width, &height) == image);
+
+	icon_t *dib = find_icon(icon_group, TEST_DIB_ICON_ID);
+	CHECK(dib->type == ICON_TYPE_DIB);
+	image = icon_decode_rgba(dib, &width, &height);
+	CHECK(!ppelib_error_peek());
+	CHECK(image && width == TEST_ICON_SIZE && height == TEST_ICON_SIZE);
+	check_pixels(image, 1);
+}
+
+static void test_export(ppelib_file_t *pe) {
+	icon_group_t *icon_group = get_icon_group(pe);
+	size_t size;
+
+	// A PNG is handed out as it is
+	icon_t *png = find_icon(icon_group, TEST_PNG_ICON_ID);
+	const uint8_t *file = icon_export_png(png, &size);
+	CHECK(!ppelib_error_peek());
+	CHECK(file == png->resource->data && size == png->resource->size);
+
+	icon_t *dib = find_icon(icon_group, TEST_DIB_ICON_ID);
+	file = icon_export_png(dib, &size);
+	CHECK(!ppelib_error_peek());
+	CHECK(file && size);
+	CHECK(icon_export_png(dib, &size) == file);
+
+	uint8_t *image = NULL;
+	unsigned width, height;
+	CHECK(!lodepng_decode32(&image, &width, &height, file, size));
+	CHECK(width == TEST_ICON_SIZE && height == TEST_ICON_SIZE);
+	check_pixels(image, 1);
+	free(image);
+}
+
+// New data for the resource means decoding again
+static void test_changed(ppelib_file_t *pe) {
+	icon_group_t *icon_group = get_icon_group(pe);
+	icon_t *dib = find_icon(icon_group, TEST_DIB_ICON_ID);
+	uint32_t width, height;
+
+	CHECK(icon_decode_rgba(dib, &width, &height));
+
+	uint8_t *data = malloc(dib->resource->size);
+	CHECK(data);
+	memcpy(data, dib->resource->data, dib->resource->size);
+	// Lift the mask
+	memset(data + dib->resource->size - TEST_ICON_SIZE * 4, 0, TEST_ICON_SIZE * 4);
+	resource_set_data(dib->resource, data, dib->resource->size);
+
+	const uint8_t *image = icon_decode_rgba(dib, &width, &height);
+	CHECK(!ppelib_error_peek());
+	CHECK(image);
+	check_pixels(image, 0);
+}
+
+static void set_icon_data(icon_t *icon, const uint8_t *data, size_t size) {
+	uint8_t *copy = malloc(size);
+	CHECK(copy);
+	memcpy(copy, data, size);
+	resource_set_data(icon->resource, copy, size);
+}
+
+static void check_broken(icon_t *icon, const char *error) {
+	uint32_t width, height;
+	size_t size;
+
+	CHECK(!icon_decode_rgba(icon, &width, &height));
+	CHECK(ppelib_error_peek());
+	CHECK(strstr(ppelib_error(), error));
+
+	CHECK(!icon_export_png(icon, &size));
+	CHECK(ppelib_error_peek());
+	CHECK(strstr(ppelib_error(), error));
+}
+
+static void test_broken(ppelib_file_t *pe) {
+	icon_group_t *icon_group = get_icon_group(pe);
+	icon_t *png = find_icon(icon_group, TEST_PNG_ICON_ID);
+	icon_t *dib = find_icon(icon_group, TEST_DIB_ICON_ID);
+	uint32_t width, height;
+
+	// A good decode first, so the cache has to go
+	CHECK(icon_decode_rgba(dib, &width, &height));
+
+	uint8_t header[40];
+	memcpy(header, dib->resource->data, sizeof(header));
+	set_icon_data(dib, header, 20);
+	check_broken(dib, "DIB file too small for header");
+
+	set_icon_data(dib, header, sizeof(header));
+	check_broken(dib, "Not enough space for DIB image data");
+
+	write_uint16_t(header + 14, 7);
+	set_icon_data(dib, header, sizeof(header));
+	check_broken(dib, "Unknown BPP");
+
+	write_uint32_t(header + 8, 1);
+	set_icon_data(dib, header, sizeof(header));
+	check_broken(dib, "Invalid DIB dimensions");
+
+	// Still starts like one, but nothing else
+	uint8_t broken_png[64];
+	memcpy(broken_png, png->resource->data, 8);
+	memset(broken_png + 8, 0xFF, sizeof(broken_png) - 8);
+	set_icon_data(png, broken_png, sizeof(broken_png));
+
+	CHECK(!icon_decode_rgba(png, &width, &height));
+	CHECK(strstr(ppelib_error(), "Failed to decode png"));
+}
+
+// A DIB icon whose mask hides the last pixel of the top row. Palette entry i
+// is (3i, 2i, i), pixels count up from the top left.
+static uint32_t dib_index(uint32_t x, uint32_t y, uint16_t bpp) {
+	return (x * 7 + y * 3 + 1) % (1u << (bpp < 8 ? bpp : 8));
+}
+
+static void dib_pixel(uint32_t x, uint32_t y, uint16_t bpp, uint8_t rgba[4]) {
+	if (bpp <= 8) {
+		uint32_t idx = dib_index(x, y, bpp);
+		rgba[0] = (uint8_t)(idx * 3);
+		rgba[1] = (uint8_t)(idx * 2);
+		rgba[2] = (uint8_t)idx;
+		rgba[3] = 0xFF;
+	} else {
+		rgba[0] = (uint8_t)(x * 7);
+		rgba[1] = (uint8_t)(y * 16);
+		rgba[2] = 0x40;
+		rgba[3] = bpp == 32 ? 0x80 : 0xFF;
+	}
+}
+
+static uint8_t *create_dib(uint32_t width, uint32_t height, uint16_t bpp, size_t *size) {
+	size_t palette_colors = bpp <= 8 ? (size_t)1 << bpp : 0;
+	size_t line = ((width * bpp + 31) / 32) * 4;
+	size_t mask_line = ((width + 31) / 32) * 4;
+	size_t pixels = 40 + palette_colors * 4;
+	size_t mask = pixels + height * line;
+	*size = mask + height * mask_line;
+
+	uint8_t *dib = calloc(*size, 1);
+	CHECK(dib);
+	write_uint32_t(dib, 40);
+	write_uint32_t(dib + 4, width);
+	write_uint32_t(dib + 8, height * 2);
+	write_uint16_t(dib + 12, 1);
+	write_uint16_t(dib + 14, bpp);
+
+	for (size_t i = 0; i < palette_colors; ++i) {
+		dib[40 + i * 4 + 0] = (uint8_t)i;
+		dib[40 + i * 4 + 1] = (uint8_t)(i * 2);
+		dib[40 + i * 4 + 2] = (uint8_t)(i * 3);
+	}
+
+	for (uint32_t y = 0; y < height; ++y) {
+		uint8_t *row = dib + pixels + (height - y - 1) * line;
+
+		for (uint32_t x = 0; x < width; ++x) {
+			size_t bit = (size_t)x * bpp;
+			if (bpp <= 8) {
+				row[bit / 8] |= (uint8_t)(dib_index(x, y, bpp) << (8 - bpp - bit % 8));
+				continue;
+			}
+
+			uint8_t rgba[4];
+			dib_pixel(x, y, bpp, rgba);
+			row[bit / 8 + 0] = rgba[2];
+			row[bit / 8 + 1] = rgba[1];
+			row[bit / 8 + 2] = rgba[0];
+			if (bpp == 32) {
+				row[bit / 8 + 3] = rgba[3];
+			}
+		}
+	}
+
+	// Mask rows are bottom up too
+	dib[mask + (height - 1) * mask_line + (width - 1) / 8] = (uint8_t)(0x80 >> ((width - 1) % 8));
+
+	return dib;
+}
+
+// Decodes size bytes of dib on their own, NULL when that fails
+static uint8_t *decode_dib(const uint8_t *dib, size_t size, uint32_t *width, uint32_t *height) {
+	resource_t resource = {0};
+	resource.data = (uint8_t *)dib;
+	resource.size = size;
+	resource.data_borrowed = 1;
+
+	icon_group_t icon_group = {0};
+	icon_group.numb_icons = 1;
+	icon_group.icons = calloc(1, sizeof(icon_t));
+	CHECK(icon_group.icons);
+	icon_group.icons[0].type = ICON_TYPE_DIB;
+	icon_group.icons[0].resource = &resource;
+
+	uint8_t *copy = NULL;
+	const uint8_t *image = icon_decode_rgba(&icon_group.icons[0], width, height);
+	if (image) {
+		copy = malloc((size_t)*width * *height * 4);
+		CHECK(copy);
+		memcpy(copy, image, (size_t)*width * *height * 4);
+	}
+
+	icon_group_free(&icon_group);
+	return copy;
+}
+
+static void check_dib(uint32_t width, uint32_t height, uint16_t bpp) {
+	size_t size;
+	uint8_t *dib = create_dib(width, height, bpp, &size);
+
+	uint32_t out_width, out_height;
+	uint8_t *image = decode_dib(dib, size, &out_width, &out_height);
+	CHECK(!ppelib_error_peek());
+	CHECK(image && out_width == width && out_height == height);
+
+	for (uint32_t y = 0; y < height; ++y) {
+		for (uint32_t x = 0; x < width; ++x) {
+			uint8_t expected[4] = {0};
+			if (y || x != width - 1) {
+				dib_pixel(x, y, bpp, expected);
+			}
+
+			CHECK(!memcmp(image + ((size_t)y * width + x) * 4, expected, 4));
+		}
+	}
+	free(image);
+
+	// Every row of the mask is needed, even a row's worth of padding short
+	CHECK(!decode_dib(dib, size - 1, &out_width, &out_height));
+	CHECK(strstr(ppelib_error(), "Not enough space for DIB image data"));
+
+	free(dib);
+}
+
+// Widths that aren't a multiple of 8 pixels, or of a pixel byte
+static void test_dib_widths() {
+	check_dib(4, 4, 32);
+	check_dib(36, 2, 32);
+	check_dib(3, 3, 24);
+	check_dib(12, 2, 1);
+	check_dib(3, 2, 4);
+	check_dib(5, 3, 8);
+
+	// Narrower than a byte of mask, and none of it there
+	size_t size;
+	uint8_t *dib = create_dib(4, 4, 32, &size);
+	uint32_t width, height;
+	CHECK(!decode_dib(dib, 40 + 4 * 4 * 4, &width, &height));
+	CHECK(strstr(ppelib_error(), "Not enough space for DIB image data"));
+	free(dib);
+}
+
+// Without payloads there's nothing to decode
+static void test_skipped(const uint8_t *buffer, size_t size) {
+	ppelib_file_t *pe = ppelib_create_from_buffer_ex(buffer, size, PPELIB_PARSE_SKIP_RESOURCE_DATA);
+	CHECK(!ppelib_error_peek());
+
+	icon_t icon = {0};
+	icon.resource = test_find_resource(&pe->resource_table, RT_ICON, NULL, TEST_DIB_ICON_ID, TEST_LANGUAGE);
+	CHECK(icon.resource && !icon.resource->data);
+	check_broken(&icon, "Icon data isn't available");
+
+	ppelib_destroy(pe);
+}
+
+int main() {
+	size_t size;
+	uint8_t *buffer = test_image_create(&size);
+
+	ppelib_file_t *pe = ppelib_create_from_buffer(buffer, size);
+	CHECK(!ppelib_error_peek());
+
+	test_decode(pe);
+	test_export(pe);
+	test_changed(pe);
+	test_broken(pe);
+	ppelib_destroy(pe);
+
+	test_skipped(buffer, size);
+	test_dib_widths();
+
+	free(buffer);
+	return 0;
+}
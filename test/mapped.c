@@ -0,0 +1,93 @@
+/* Copyright 2021 Hein-Pieter van Braam-Stewart
+ *
+ * This file is part of ppelib (Portable Portable Executable LIBrary)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "ppe_error.h"
+#include "test_common.h"
+
+#define IMAGE_FILE "mapped.exe"
+#define OUT_FILE "mapped.out.exe"
+#define EMPTY_FILE "mapped.empty.exe"
+
+static void test_mapped(const uint8_t *buffer, size_t size) {
+	ppelib_file_t *pe = ppelib_create_from_file_mapped(IMAGE_FILE);
+	CHECK(!ppelib_error_peek());
+	CHECK(pe->mapping.data);
+	CHECK(pe->mapping.size == size);
+	CHECK(pe->overlay_size == TEST_OVERLAY_SIZE);
+	CHECK(pe->resource_table.size == TEST_NUMB_RESOURCES);
+
+	// Nothing is copied out of the mapping
+	const uint8_t *start = pe->mapping.data;
+	for (uint16_t i = 0; i < pe->header.number_of_sections; ++i) {
+		section_t *section = pe->sections[i];
+		CHECK(section->contents_borrowed);
+		CHECK(section->contents == start + section->pointer_to_raw_data);
+	}
+
+	for (size_t i = 0; i < pe->resource_table.size; ++i) {
+		resource_t *resource = pe->resource_table.resources[i];
+		CHECK(resource->data >= start && resource->data + resource->size <= start + size);
+	}
+
+	uint8_t *out = malloc(size);
+	CHECK(out);
+	CHECK(ppelib_write_to_buffer(pe, out, size) == size);
+	CHECK(!memcmp(out, buffer, size));
+	free(out);
+
+	CHECK(ppelib_write_to_file(pe, OUT_FILE) == size);
+	CHECK(!ppelib_error_peek());
+
+	size_t out_size;
+	out = test_read_file(OUT_FILE, &out_size);
+	CHECK(out_size == size);
+	CHECK(!memcmp(out, buffer, size));
+	free(out);
+
+	ppelib_destroy(pe);
+}
+
+static void test_errors() {
+	ppelib_file_t *pe = ppelib_create_from_file_mapped("mapped.missing.exe");
+	CHECK(!pe);
+	CHECK(ppelib_error_peek());
+
+	test_write_file(EMPTY_FILE, NULL, 0);
+	pe = ppelib_create_from_file_mapped(EMPTY_FILE);
+	CHECK(!pe);
+	CHECK(ppelib_error_peek());
+}
+
+int main() {
+	size_t size;
+	uint8_t *buffer = test_image_create(&size);
+	test_write_file(IMAGE_FILE, buffer, size);
+
+	test_mapped(buffer, size);
+	test_errors();
+
+	remove(IMAGE_FILE);
+	remove(OUT_FILE);
+	remove(EMPTY_FILE);
+	free(buffer);
+	return 0;
+}
@@ -0,0 +1,136 @@
+/* Copyright 2021 Hein-Pieter van Braam-Stewart
+ *
+ * This file is part of ppelib (Portable Portable Executable LIBrary)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "ppe_error.h"
+#include "test_common.h"
+
+#define TYPE_NAME "SETTINGS"
+// More than the name cache starts out with
+#define NUMB_NAMES 200
+
+static uint8_t *payload() {
+	uint8_t *data = malloc(4);
+	CHECK(data);
+	memcpy(data, "data", 4);
+	return data;
+}
+
+// A named type with NUMB_NAMES names in two languages each
+static section_t *create_section() {
+	resource_table_t table = {0};
+
+	for (size_t i = 0; i < NUMB_NAMES; ++i) {
+		char name[16];
+		snprintf(name, sizeof(name), "NAME%zu", i);
+
+		test_add_resource(&table, 0, name, 0, TEST_LANGUAGE, payload(), 4);
+		test_add_resource(&table, 0, name, 0, TEST_OTHER_LANGUAGE, payload(), 4);
+	}
+
+	for (size_t i = 0; i < table.size; ++i) {
+		table.resources[i]->type = strdup(TYPE_NAME);
+	}
+
+	section_t *section = calloc(sizeof(section_t), 1);
+	CHECK(section);
+	section->virtual_address = 0x1000;
+	section->contents_size = resource_table_serialize(NULL, 0, &table);
+	CHECK(section->contents_size);
+	section->contents = calloc(section->contents_size, 1);
+	CHECK(section->contents);
+	CHECK(resource_table_serialize(section, 0, &table) == section->contents_size);
+
+	resource_table_free(&table);
+	return section;
+}
+
+static void test_shared(const section_t *section) {
+	resource_table_t table = {0};
+	resource_table_deserialize(section, 0, &table);
+	CHECK(!ppelib_error_peek());
+	CHECK(table.size == NUMB_NAMES * 2);
+
+	const char *type = table.resources[0]->type;
+	CHECK(type && !strcmp(type, TYPE_NAME));
+
+	for (size_t i = 0; i < NUMB_NAMES; ++i) {
+		char name[16];
+		snprintf(name, sizeof(name), "NAME%zu", i);
+
+		resource_t *resource = test_find_resource(&table, 0, name, 0, TEST_LANGUAGE);
+		resource_t *other = test_find_resource(&table, 0, name, 0, TEST_OTHER_LANGUAGE);
+		CHECK(resource && other);
+
+		// One decoded copy for everything under the same directory entry
+		CHECK(resource->name == other->name);
+		CHECK(resource->type == type && other->type == type);
+	}
+
+	resource_table_free(&table);
+}
+
+// The same name in two languages in the test image
+static void test_image() {
+	size_t size;
+	uint8_t *buffer = test_image_create(&size);
+
+	ppelib_file_t *pe = ppelib_create_from_buffer(buffer, size);
+	CHECK(!ppelib_error_peek());
+
+	resource_table_t *table = &pe->resource_table;
+	resource_t *resource = test_find_resource(table, RT_RCDATA, TEST_RCDATA_NAME, 0, TEST_LANGUAGE);
+	resource_t *other = test_find_resource(table, RT_RCDATA, TEST_RCDATA_NAME, 0, TEST_OTHER_LANGUAGE);
+	CHECK(resource && other);
+	CHECK(resource->name == other->name);
+
+	ppelib_destroy(pe);
+	free(buffer);
+}
+
+// A name that runs off the end of the section
+static void test_bad_name(section_t *section) {
+	uint32_t type_entry = read_uint32_t(section->contents + 16);
+	CHECK(type_entry & 0x80000000);
+
+	write_uint32_t(section->contents + 16, 0x80000000 | (uint32_t)(section->contents_size - 1));
+
+	resource_table_t table = {0};
+	resource_table_deserialize(section, 0, &table);
+	CHECK(ppelib_error_peek());
+	resource_table_free(&table);
+
+	write_uint32_t(section->contents + 16, type_entry);
+}
+
+int main() {
+	test_image();
+
+	section_t *section = create_section();
+
+	test_shared(section);
+	test_bad_name(section);
+	test_shared(section);
+
+	free(section->contents);
+	free(section);
+	return 0;
+}
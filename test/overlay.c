@@ -0,0 +1,112 @@
+/* Copyright 2021 Hein-Pieter van Braam-Stewart
+ *
+ * This file is part of ppelib (Portable Portable Executable LIBrary)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "ppe_error.h"
+#include "test_common.h"
+
+#define IMAGE_FILE "overlay.exe"
+#define OUT_FILE "overlay.out.exe"
+
+// Big enough to go through several copy chunks
+#define LARGE_OVERLAY_SIZE (3 * 1024 * 1024 + 123)
+
+static size_t read_buffer(void *userdata, uint8_t *buffer, size_t offset, size_t size) {
+	const uint8_t *image = userdata;
+	memcpy(buffer, image + offset, size);
+	return size;
+}
+
+static void check_file(const char *filename, const uint8_t *buffer, size_t size) {
+	size_t file_size;
+	uint8_t *contents = test_read_file(filename, &file_size);
+	CHECK(file_size == size);
+	CHECK(!memcmp(contents, buffer, size));
+	free(contents);
+}
+
+// Neither loader reads the overlay, it's copied over when writing
+static void test_mapped(const uint8_t *buffer, size_t size) {
+	ppelib_file_t *pe = ppelib_create_from_file_mapped(IMAGE_FILE);
+	CHECK(!ppelib_error_peek());
+	CHECK(pe->overlay_size == size - pe->end_of_section_data);
+	CHECK(pe->overlay_source);
+	CHECK(!pe->overlay);
+
+	CHECK(ppelib_write_to_file(pe, OUT_FILE) == size);
+	CHECK(!ppelib_error_peek());
+	check_file(OUT_FILE, buffer, size);
+
+	ppelib_destroy(pe);
+}
+
+static void test_reader(uint8_t *buffer, size_t size) {
+	ppelib_file_t *pe = ppelib_create_from_reader(read_buffer, buffer, size);
+	CHECK(!ppelib_error_peek());
+	CHECK(pe->overlay_source);
+	CHECK(!pe->overlay);
+
+	CHECK(ppelib_write_to_file(pe, OUT_FILE) == size);
+	CHECK(!ppelib_error_peek());
+	check_file(OUT_FILE, buffer, size);
+
+	ppelib_destroy(pe);
+}
+
+// Writing over the file the overlay still lives in
+static void test_same_file(const uint8_t *buffer, size_t size) {
+	test_write_file(OUT_FILE, buffer, size);
+
+	ppelib_file_t *pe = ppelib_create_from_file_mapped(OUT_FILE);
+	CHECK(!ppelib_error_peek());
+
+	CHECK(ppelib_write_to_file(pe, OUT_FILE) == size);
+	CHECK(!ppelib_error_peek());
+	check_file(OUT_FILE, buffer, size);
+
+	ppelib_destroy(pe);
+}
+
+int main() {
+	size_t image_size;
+	uint8_t *image = test_image_create(&image_size);
+
+	size_t size = image_size + LARGE_OVERLAY_SIZE;
+	uint8_t *buffer = malloc(size);
+	CHECK(buffer);
+
+	memcpy(buffer, image, image_size);
+	for (size_t i = image_size; i < size; ++i) {
+		buffer[i] = (uint8_t)(i * 31 + (i >> 12));
+	}
+	free(image);
+
+	test_write_file(IMAGE_FILE, buffer, size);
+
+	test_mapped(buffer, size);
+	test_reader(buffer, size);
+	test_same_file(buffer, size);
+
+	remove(IMAGE_FILE);
+	remove(OUT_FILE);
+	free(buffer);
+	return 0;
+}
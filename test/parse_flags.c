@@ -0,0 +1,155 @@
+/* Copyright 2021 Hein-Pieter van Braam-Stewart
+ *
+ * This file is part of ppelib (Portable Portable Executable LIBrary)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "ppe_error.h"
+#include "test_common.h"
+
+static uint8_t *write_image(ppelib_file_t *pe, size_t *size) {
+	update_resource_table(pe);
+	CHECK(!ppelib_error_peek());
+
+	*size = ppelib_write_to_buffer(pe, NULL, 0);
+	CHECK(*size);
+
+	uint8_t *out = malloc(*size);
+	CHECK(out);
+	CHECK(ppelib_write_to_buffer(pe, out, *size) == *size);
+
+	return out;
+}
+
+static void test_skip_overlay(const uint8_t *buffer, size_t size) {
+	ppelib_file_t *pe = ppelib_create_from_buffer_ex(buffer, size, PPELIB_PARSE_SKIP_OVERLAY);
+	CHECK(!ppelib_error_peek());
+	CHECK(!pe->overlay_size);
+	CHECK(pe->resource_table.size == TEST_NUMB_RESOURCES);
+
+	size_t out_size;
+	uint8_t *out = write_image(pe, &out_size);
+	CHECK(out_size == size - TEST_OVERLAY_SIZE);
+	CHECK(!memcmp(out, buffer, out_size));
+
+	free(out);
+	ppelib_destroy(pe);
+}
+
+// The resource section is written back as it was
+static void test_skip_resources(const uint8_t *buffer, size_t size) {
+	ppelib_file_t *pe = ppelib_create_from_buffer_ex(buffer, size, PPELIB_PARSE_SKIP_RESOURCES);
+	CHECK(!ppelib_error_peek());
+	CHECK(!pe->resource_table.size);
+	CHECK(!resource_get_numb_versioninfo(&pe->resource_table));
+
+	size_t out_size;
+	uint8_t *out = write_image(pe, &out_size);
+	CHECK(out_size == size);
+	CHECK(!memcmp(out, buffer, size));
+
+	free(out);
+	ppelib_destroy(pe);
+}
+
+static void test_skip_resource_data(const uint8_t *buffer, size_t size) {
+	ppelib_file_t *pe = ppelib_create_from_buffer_ex(buffer, size, PPELIB_PARSE_SKIP_RESOURCE_DATA);
+	CHECK(!ppelib_error_peek());
+	CHECK(pe->resource_table.size == TEST_NUMB_RESOURCES);
+	CHECK(pe->overlay_size == TEST_OVERLAY_SIZE);
+
+	for (size_t i = 0; i < pe->resource_table.size; ++i) {
+		CHECK(!pe->resource_table.resources[i]->data);
+		CHECK(pe->resource_table.resources[i]->size);
+	}
+
+	CHECK(!resource_get_numb_versioninfo(&pe->resource_table));
+	CHECK(!resource_get_numb_icon_group(&pe->resource_table));
+
+	size_t out_size;
+	uint8_t *out = write_image(pe, &out_size);
+	CHECK(out_size == size);
+	CHECK(!memcmp(out, buffer, size));
+	free(out);
+
+	// Without the payloads a changed table can't be laid out again
+	resource_delete(&pe->resource_table, pe->resource_table.resources[0]);
+	update_resource_table(pe);
+	CHECK(ppelib_error_peek());
+
+	ppelib_destroy(pe);
+}
+
+static void test_skip_decoding(const uint8_t *buffer, size_t size) {
+	ppelib_file_t *pe = ppelib_create_from_buffer_ex(buffer, size, PPELIB_PARSE_SKIP_VERSIONINFO);
+	CHECK(!ppelib_error_peek());
+	CHECK(!resource_get_numb_versioninfo(&pe->resource_table));
+	CHECK(resource_get_numb_icon_group(&pe->resource_table) == 1);
+	ppelib_destroy(pe);
+
+	pe = ppelib_create_from_buffer_ex(buffer, size, PPELIB_PARSE_SKIP_ICONS);
+	CHECK(!ppelib_error_peek());
+	CHECK(resource_get_numb_versioninfo(&pe->resource_table) == 1);
+	CHECK(!resource_get_numb_icon_group(&pe->resource_table));
+	ppelib_destroy(pe);
+}
+
+static void test_validate_only(uint8_t *buffer, size_t size) {
+	ppelib_file_t *pe = ppelib_create_from_buffer_ex(buffer, size, PPELIB_PARSE_VALIDATE_ONLY);
+	CHECK(!ppelib_error_peek());
+	CHECK(!pe->overlay_size);
+	CHECK(pe->resource_table.size == TEST_NUMB_RESOURCES);
+	CHECK(!pe->resource_table.resources[0]->data);
+
+	for (uint16_t i = 0; i < pe->header.number_of_sections; ++i) {
+		section_t *section = pe->sections[i];
+		CHECK(section->contents == buffer + section->pointer_to_raw_data);
+	}
+	ppelib_destroy(pe);
+
+	// Broken resource directories are still found
+	section_t rsrc;
+	size_t section_offset = read_uint32_t(buffer + 0x3C) + 4 + COFF_HEADER_SIZE + read_uint16_t(buffer + read_uint32_t(buffer + 0x3C) + 4 + 16);
+	section_deserialize(buffer, size, section_offset + SECTION_SIZE, &rsrc);
+	CHECK(!strcmp(rsrc.name, ".rsrc"));
+
+	uint8_t saved = buffer[rsrc.pointer_to_raw_data + 14];
+	buffer[rsrc.pointer_to_raw_data + 14] = 0xff;
+	pe = ppelib_create_from_buffer_ex(buffer, size, PPELIB_PARSE_VALIDATE_ONLY);
+	CHECK(!pe);
+	CHECK(ppelib_error_peek());
+	buffer[rsrc.pointer_to_raw_data + 14] = saved;
+
+	pe = ppelib_create_from_buffer_ex(buffer, 0x40, PPELIB_PARSE_VALIDATE_ONLY);
+	CHECK(!pe);
+	CHECK(ppelib_error_peek());
+}
+
+int main() {
+	size_t size;
+	uint8_t *buffer = test_image_create(&size);
+
+	test_skip_overlay(buffer, size);
+	test_skip_resources(buffer, size);
+	test_skip_resource_data(buffer, size);
+	test_skip_decoding(buffer, size);
+	test_validate_only(buffer, size);
+
+	free(buffer);
+	return 0;
+}
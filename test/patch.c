@@ -0,0 +1,312 @@
+/* Copyright 2021 Hein-Pieter van Braam-Stewart
+ *
+ * This file is part of ppelib (Portable Portable Executable LIBrary)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "ppe_error.h"
+#include "test_common.h"
+
+#define IMAGE_FILE "patch.exe"
+#define NEW_FILE "patch.new.exe"
+#define SCRATCH_FILE "patch.scratch"
+
+// Past the end of the resource section's page, into the next section
+#define OVERFLOW_SIZE (TEST_RCDATA_SIZE + 5000)
+
+static uint8_t *new_payload(size_t size, uint8_t seed) {
+	uint8_t *data = malloc(size);
+	CHECK(data);
+
+	for (size_t i = 0; i < size; ++i) {
+		data[i] = (uint8_t)(i ^ seed);
+	}
+
+	return data;
+}
+
+static void set_rcdata(ppelib_file_t *pe, uint32_t name_id, size_t size, uint8_t seed) {
+	resource_t *resource = test_find_resource(&pe->resource_table, RT_RCDATA, NULL, name_id, TEST_LANGUAGE);
+	CHECK(resource);
+	resource_set_data(resource, new_payload(size, seed), size);
+}
+
+static void check_rcdata(const ppelib_file_t *pe, uint32_t name_id, size_t size, uint8_t seed) {
+	resource_t *resource = test_find_resource(&pe->resource_table, RT_RCDATA, NULL, name_id, TEST_LANGUAGE);
+	CHECK(resource);
+	CHECK(resource->size == size);
+
+	uint8_t *expected = new_payload(size, seed);
+	CHECK(!memcmp(resource->data, expected, size));
+	free(expected);
+}
+
+static void check_rcdata_original(const ppelib_file_t *pe, uint32_t name_id) {
+	resource_t *resource = test_find_resource(&pe->resource_table, RT_RCDATA, NULL, name_id, TEST_LANGUAGE);
+	CHECK(resource);
+	CHECK(resource->size == TEST_RCDATA_SIZE);
+
+	for (size_t i = 0; i < TEST_RCDATA_SIZE; ++i) {
+		CHECK(resource->data[i] == test_rcdata_byte(i));
+	}
+}
+
+static void check_untouched(const ppelib_file_t *pe) {
+	resource_t *resource = test_find_resource(&pe->resource_table, RT_RCDATA, TEST_RCDATA_NAME, 0, TEST_LANGUAGE);
+	CHECK(resource);
+	CHECK(resource->size == TEST_RCDATA_SIZE);
+
+	for (size_t i = 0; i < TEST_RCDATA_SIZE; ++i) {
+		CHECK(resource->data[i] == test_rcdata_byte(i));
+	}
+
+	CHECK(pe->overlay_size == TEST_OVERLAY_SIZE);
+}
+
+// The file has to hold what the handle would write
+static uint8_t *check_written(const ppelib_file_t *pe, const char *filename, size_t *size) {
+	uint8_t *contents = test_read_file(filename, size);
+
+	size_t expected_size = ppelib_write_to_buffer(pe, NULL, 0);
+	CHECK(expected_size == *size);
+
+	uint8_t *expected = malloc(expected_size);
+	CHECK(expected);
+	CHECK(ppelib_write_to_buffer(pe, expected, expected_size) == expected_size);
+	CHECK(!memcmp(contents, expected, *size));
+	free(expected);
+
+	return contents;
+}
+
+// Patching keeps the checksum right, full writes leave it as it was
+static void check_patched(const ppelib_file_t *pe, const char *filename, size_t *size) {
+	uint8_t *contents = check_written(pe, filename, size);
+	CHECK(read_uint32_t(contents + test_image_checksum_offset(contents)) == test_image_checksum(contents, *size));
+	free(contents);
+}
+
+// Only the table and the header fields that describe it are written
+static void test_in_place(const uint8_t *buffer, size_t size) {
+	test_write_file(IMAGE_FILE, buffer, size);
+
+	ppelib_file_t *pe = ppelib_create_from_file(IMAGE_FILE);
+	CHECK(!ppelib_error_peek());
+
+	set_rcdata(pe, 1, TEST_RCDATA_SIZE, 0x5A);
+	size_t written = ppelib_patch_file(pe, IMAGE_FILE);
+	CHECK(!ppelib_error_peek());
+	CHECK(written && written < size);
+
+	size_t file_size;
+	check_patched(pe, IMAGE_FILE, &file_size);
+	CHECK(file_size == size);
+	ppelib_destroy(pe);
+
+	// Smaller payloads fit too
+	pe = ppelib_create_from_file(IMAGE_FILE);
+	CHECK(!ppelib_error_peek());
+	check_rcdata(pe, 1, TEST_RCDATA_SIZE, 0x5A);
+
+	set_rcdata(pe, 2, TEST_RCDATA_SIZE / 2, 0x33);
+	written = ppelib_patch_file(pe, IMAGE_FILE);
+	CHECK(!ppelib_error_peek());
+	CHECK(written && written < size);
+	check_patched(pe, IMAGE_FILE, &file_size);
+	ppelib_destroy(pe);
+
+	pe = ppelib_create_from_file(IMAGE_FILE);
+	CHECK(!ppelib_error_peek());
+	check_rcdata(pe, 1, TEST_RCDATA_SIZE, 0x5A);
+	check_rcdata(pe, 2, TEST_RCDATA_SIZE / 2, 0x33);
+	check_untouched(pe);
+	ppelib_destroy(pe);
+}
+
+// The handle keeps working on the file it's patching
+static void test_mapped(const uint8_t *buffer, size_t size) {
+	test_write_file(IMAGE_FILE, buffer, size);
+
+	ppelib_file_t *pe = ppelib_create_from_file_mapped(IMAGE_FILE);
+	CHECK(!ppelib_error_peek());
+
+	set_rcdata(pe, 1, TEST_RCDATA_SIZE, 0x77);
+	size_t written = ppelib_patch_file(pe, IMAGE_FILE);
+	CHECK(!ppelib_error_peek());
+	CHECK(written && written < size);
+
+	check_rcdata(pe, 1, TEST_RCDATA_SIZE, 0x77);
+	check_untouched(pe);
+
+	size_t file_size;
+	check_patched(pe, IMAGE_FILE, &file_size);
+	ppelib_destroy(pe);
+}
+
+// Files that don't match the handle are written out whole
+static void test_rewrite(const uint8_t *buffer, size_t size) {
+	ppelib_file_t *pe = ppelib_create_from_buffer(buffer, size);
+	CHECK(!ppelib_error_peek());
+
+	remove(NEW_FILE);
+	set_rcdata(pe, 1, TEST_RCDATA_SIZE, 0x11);
+	CHECK(ppelib_patch_file(pe, NEW_FILE) == size);
+	CHECK(!ppelib_error_peek());
+
+	size_t file_size;
+	free(check_written(pe, NEW_FILE, &file_size));
+
+	test_write_file(NEW_FILE, buffer, 0x100);
+	CHECK(ppelib_patch_file(pe, NEW_FILE) == size);
+	CHECK(!ppelib_error_peek());
+	free(check_written(pe, NEW_FILE, &file_size));
+
+	CHECK(!ppelib_patch_file(pe, "patch.missing/patch.exe"));
+	CHECK(ppelib_error_peek());
+
+	ppelib_destroy(pe);
+}
+
+// Only some filesystems can insert blocks in the middle of a file
+static uint8_t insert_range_supported() {
+	uint8_t block[4096] = {0};
+	test_write_file(SCRATCH_FILE, block, sizeof(block));
+
+	int fd = file_open_rw(SCRATCH_FILE);
+	CHECK(fd >= 0);
+
+	size_t block_size = file_block_size(fd);
+	uint8_t supported = block_size && block_size <= sizeof(block) && !(sizeof(block) % block_size) && file_insert_range(fd, 0, block_size);
+
+	file_close(fd);
+	remove(SCRATCH_FILE);
+
+	return supported;
+}
+
+// A payload that pushes the resource section past its raw size, but not out
+// of its page
+static size_t grow_size(const ppelib_file_t *pe) {
+	const section_t *rsrc = pe->data_directories[DIR_RESOURCE_TABLE].section;
+	size_t size = TEST_RCDATA_SIZE + rsrc->size_of_raw_data - rsrc->virtual_size + 64;
+
+	CHECK(rsrc->virtual_size + size - TEST_RCDATA_SIZE + 64 <= TO_NEAREST(rsrc->virtual_size, pe->header.section_alignment));
+	return size;
+}
+
+static size_t section_offset(const ppelib_file_t *pe, const char *name) {
+	for (uint16_t i = 0; i < pe->header.number_of_sections; ++i) {
+		if (!strcmp(pe->sections[i]->name, name)) {
+			return pe->sections[i]->pointer_to_raw_data;
+		}
+	}
+
+	CHECK(0);
+	return 0;
+}
+
+// Only the headers and the resource section are written, the rest of the file
+// moves by whole blocks
+static void test_resize(const uint8_t *buffer, size_t size) {
+	test_write_file(IMAGE_FILE, buffer, size);
+
+	ppelib_file_t *pe = ppelib_create_from_file(IMAGE_FILE);
+	CHECK(!ppelib_error_peek());
+	size_t reloc_offset = section_offset(pe, ".reloc");
+	size_t grown = grow_size(pe);
+
+	set_rcdata(pe, 1, grown, 0x42);
+	size_t written = ppelib_patch_file(pe, IMAGE_FILE);
+	CHECK(!ppelib_error_peek());
+
+	size_t grown_size;
+	check_patched(pe, IMAGE_FILE, &grown_size);
+	CHECK(grown_size > size);
+	CHECK(written && written < grown_size);
+	CHECK(section_offset(pe, ".reloc") - reloc_offset == grown_size - size);
+	ppelib_destroy(pe);
+
+	pe = ppelib_create_from_file(IMAGE_FILE);
+	CHECK(!ppelib_error_peek());
+	check_rcdata(pe, 1, grown, 0x42);
+	check_untouched(pe);
+	ppelib_destroy(pe);
+
+	// Past its page the resource section has to move behind .reloc, that
+	// takes a full write
+	pe = ppelib_create_from_file_mapped(IMAGE_FILE);
+	CHECK(!ppelib_error_peek());
+
+	set_rcdata(pe, 1, OVERFLOW_SIZE, 0x43);
+	written = ppelib_patch_file(pe, IMAGE_FILE);
+	CHECK(!ppelib_error_peek());
+
+	size_t overflow_size;
+	free(check_written(pe, IMAGE_FILE, &overflow_size));
+	CHECK(written == overflow_size);
+	CHECK(section_offset(pe, ".rsrc") > section_offset(pe, ".reloc"));
+	check_rcdata(pe, 1, OVERFLOW_SIZE, 0x43);
+	check_untouched(pe);
+	ppelib_destroy(pe);
+
+	// Dropping the payload shrinks it by whole pages again, that drops blocks
+	// from the file. From a mapped handle that has to follow the file around.
+	pe = ppelib_create_from_file_mapped(IMAGE_FILE);
+	CHECK(!ppelib_error_peek());
+
+	resource_delete(&pe->resource_table, test_find_resource(&pe->resource_table, RT_RCDATA, NULL, 1, TEST_LANGUAGE));
+	written = ppelib_patch_file(pe, IMAGE_FILE);
+	CHECK(!ppelib_error_peek());
+
+	// The full write left the checksum stale, patching keeps it that way
+	size_t shrunk_size;
+	free(check_written(pe, IMAGE_FILE, &shrunk_size));
+	CHECK(shrunk_size < overflow_size);
+	CHECK(written && written < shrunk_size);
+	check_untouched(pe);
+	ppelib_destroy(pe);
+
+	pe = ppelib_create_from_file(IMAGE_FILE);
+	CHECK(!ppelib_error_peek());
+	CHECK(!test_find_resource(&pe->resource_table, RT_RCDATA, NULL, 1, TEST_LANGUAGE));
+	check_rcdata_original(pe, 2);
+	check_untouched(pe);
+	ppelib_destroy(pe);
+}
+
+int main() {
+	size_t size;
+	uint8_t *buffer = test_image_create(&size);
+
+	test_in_place(buffer, size);
+	test_mapped(buffer, size);
+	test_rewrite(buffer, size);
+
+	int retval = 0;
+	if (insert_range_supported()) {
+		test_resize(buffer, size);
+	} else {
+		retval = TEST_SKIP;
+	}
+
+	remove(IMAGE_FILE);
+	remove(NEW_FILE);
+	free(buffer);
+	return retval;
+}
@@ -54,20 +54,22 @@ int main(int argc, char *argv[]) {
 	printf("\n");
 
 	//	printf("%s\n", argv[1]);
-	if (pe->resource_table.numb_versioninfo) {
+	size_t numb_versioninfo = resource_get_numb_versioninfo(&pe->resource_table);
+	if (numb_versioninfo) {
 		printf("\nVersion info\n");
 	}
 
-	for (size_t i = 0; i < pe->resource_table.numb_versioninfo; ++i) {
-		versioninfo_print(&pe->resource_table.versioninfo[i]);
+	for (size_t i = 0; i < numb_versioninfo; ++i) {
+		versioninfo_print(resource_get_versioninfo(&pe->resource_table, i));
 	}
 
-	if (pe->resource_table.numb_icon_group) {
+	size_t numb_icon_group = resource_get_numb_icon_group(&pe->resource_table);
+	if (numb_icon_group) {
 		printf("\nIcon groups:\n");
 	}
 
-	for (size_t i = 0; i < pe->resource_table.numb_icon_group; ++i) {
-		icon_group_print(&pe->resource_table.icongroups[i]);
+	for (size_t i = 0; i < numb_icon_group; ++i) {
+		icon_group_print(resource_get_icon_group(&pe->resource_table, i));
 	}
 
 	resource_t *res = resource_get_by_type_id(&pe->resource_table, RT_VERSION, 0);
@@ -0,0 +1,123 @@
+/* Copyright 2021 Hein-Pieter van Braam-Stewart
+ *
+ * This file is part of ppelib (Portable Portable Executable LIBrary)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "ppe_error.h"
+#include "test_common.h"
+
+static size_t section_table_offset(const uint8_t *buffer) {
+	size_t header_offset = read_uint32_t(buffer + 0x3C) + 4;
+	return header_offset + COFF_HEADER_SIZE + read_uint16_t(buffer + header_offset + 16);
+}
+
+static void test_probe(const uint8_t *buffer, size_t size) {
+	ppelib_probe_info probe;
+	size_t header_end = ppelib_probe(buffer, size, &probe);
+	CHECK(!ppelib_error_peek());
+	CHECK(header_end == section_table_offset(buffer) + 3 * SECTION_SIZE);
+
+	// Only the headers are needed
+	CHECK(ppelib_probe(buffer, header_end, &probe) == header_end);
+
+	CHECK(probe.pe_header_offset == read_uint32_t(buffer + 0x3C));
+	CHECK(probe.machine == 0x14c);
+	CHECK(probe.magic == PE32_MAGIC);
+	CHECK(probe.file_alignment == 0x200);
+	CHECK(probe.section_alignment == 0x1000);
+	CHECK(probe.checksum == test_image_checksum(buffer, size));
+	CHECK(probe.number_of_sections == 3);
+	CHECK(probe.numb_sections == 3);
+	CHECK(probe.number_of_rva_and_sizes == 16);
+	CHECK(probe.numb_data_directories == 16);
+
+	const ppelib_probe_section *rsrc = &probe.sections[1];
+	CHECK(!strcmp(rsrc->name, ".rsrc"));
+	CHECK(probe.data_directories[DIR_RESOURCE_TABLE].virtual_address == rsrc->virtual_address);
+	CHECK(probe.data_directories[DIR_RESOURCE_TABLE].size == rsrc->virtual_size);
+	CHECK(rsrc->characteristics == (IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_MEM_READ));
+
+	ppelib_file_t *pe = ppelib_create_from_buffer(buffer, size);
+	CHECK(!ppelib_error_peek());
+	for (uint16_t i = 0; i < probe.numb_sections; ++i) {
+		CHECK(!strcmp(probe.sections[i].name, pe->sections[i]->name));
+		CHECK(probe.sections[i].pointer_to_raw_data == pe->sections[i]->pointer_to_raw_data);
+		CHECK(probe.sections[i].size_of_raw_data == pe->sections[i]->size_of_raw_data);
+	}
+	ppelib_destroy(pe);
+}
+
+// Sections past PPELIB_PROBE_MAX_SECTIONS are counted but not recorded
+static void test_many_sections(const uint8_t *buffer) {
+	size_t section_offset = section_table_offset(buffer);
+	size_t size = section_offset + 200 * SECTION_SIZE;
+
+	uint8_t *copy = calloc(size, 1);
+	CHECK(copy);
+	memcpy(copy, buffer, section_offset);
+	write_uint16_t(copy + read_uint32_t(buffer + 0x3C) + 4 + 2, 200);
+
+	ppelib_probe_info probe;
+	CHECK(ppelib_probe(copy, size, &probe) == size);
+	CHECK(probe.number_of_sections == 200);
+	CHECK(probe.numb_sections == PPELIB_PROBE_MAX_SECTIONS);
+
+	free(copy);
+}
+
+static void test_errors(const uint8_t *buffer) {
+	ppelib_probe_info probe;
+	size_t section_offset = section_table_offset(buffer);
+
+	CHECK(!ppelib_probe(buffer, 1, &probe));
+	CHECK(ppelib_error_peek());
+
+	CHECK(!ppelib_probe(buffer, 0x3C, &probe));
+	CHECK(ppelib_error_peek());
+
+	CHECK(!ppelib_probe(buffer, read_uint32_t(buffer + 0x3C) + 20, &probe));
+	CHECK(ppelib_error_peek());
+
+	// Cut off in the middle of the section table
+	CHECK(!ppelib_probe(buffer, section_offset + SECTION_SIZE + 10, &probe));
+	CHECK(ppelib_error_peek());
+
+	uint8_t copy[0x400];
+	memcpy(copy, buffer, sizeof(copy));
+	copy[0] = 'X';
+	CHECK(!ppelib_probe(copy, sizeof(copy), &probe));
+	CHECK(ppelib_error_peek());
+
+	copy[0] = 'M';
+	copy[read_uint32_t(buffer + 0x3C)] = 'X';
+	CHECK(!ppelib_probe(copy, sizeof(copy), &probe));
+	CHECK(ppelib_error_peek());
+}
+
+int main() {
+	size_t size;
+	uint8_t *buffer = test_image_create(&size);
+
+	test_probe(buffer, size);
+	test_many_sections(buffer);
+	test_errors(buffer);
+
+	free(buffer);
+	return 0;
+}
@@ -0,0 +1,115 @@
+/* Copyright 2021 Hein-Pieter van Braam-Stewart
+ *
+ * This file is part of ppelib (Portable Portable Executable LIBrary)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "ppe_error.h"
+#include "test_common.h"
+
+typedef struct reader {
+	const uint8_t *buffer;
+	size_t size;
+	// End of the furthest read
+	size_t read_end;
+	// Reads starting here fail, like an I/O error
+	size_t fail_offset;
+} reader_t;
+
+static size_t read_buffer(void *userdata, uint8_t *buffer, size_t offset, size_t size) {
+	reader_t *reader = userdata;
+
+	if (offset >= reader->fail_offset || offset >= reader->size) {
+		return 0;
+	}
+
+	// Short reads have to be retried by the library
+	size = MIN(size, 512);
+	size = MIN(size, reader->size - offset);
+
+	memcpy(buffer, reader->buffer + offset, size);
+	reader->read_end = MAX(reader->read_end, offset + size);
+	return size;
+}
+
+static void test_reader(const uint8_t *buffer, size_t size) {
+	reader_t reader = {buffer, size, 0, SIZE_MAX};
+
+	ppelib_file_t *pe = ppelib_create_from_reader(read_buffer, &reader, size);
+	CHECK(!ppelib_error_peek());
+	CHECK(pe->resource_table.size == TEST_NUMB_RESOURCES);
+	CHECK(pe->overlay_size == TEST_OVERLAY_SIZE);
+
+	// Only the headers and the resource section are read up front, .reloc
+	// and the overlay come after those
+	CHECK(pe->overlay_source);
+	for (uint16_t i = 0; i < pe->header.number_of_sections; ++i) {
+		section_t *section = pe->sections[i];
+		if (!strcmp(section->name, ".rsrc")) {
+			CHECK(!section->source);
+		} else if (!strcmp(section->name, ".reloc")) {
+			CHECK(section->source);
+			CHECK(reader.read_end <= section->pointer_to_raw_data);
+		}
+	}
+
+	uint8_t *out = malloc(size);
+	CHECK(out);
+	CHECK(ppelib_write_to_buffer(pe, out, size) == size);
+	CHECK(!memcmp(out, buffer, size));
+	free(out);
+
+	ppelib_destroy(pe);
+}
+
+static void test_errors(const uint8_t *buffer, size_t size) {
+	// Fails while reading the headers
+	reader_t reader = {buffer, size, 0, 0x100};
+	ppelib_file_t *pe = ppelib_create_from_reader(read_buffer, &reader, size);
+	CHECK(!pe);
+	CHECK(ppelib_error_peek());
+
+	// Fails while writing the deferred sections and overlay
+	reader.fail_offset = size - TEST_OVERLAY_SIZE;
+	pe = ppelib_create_from_reader(read_buffer, &reader, size);
+	CHECK(!ppelib_error_peek());
+
+	uint8_t *out = malloc(size);
+	CHECK(out);
+	CHECK(ppelib_write_to_buffer(pe, out, size) != size);
+	CHECK(ppelib_error_peek());
+	free(out);
+	ppelib_destroy(pe);
+
+	// The reader can't be bigger than it says it is
+	reader.fail_offset = SIZE_MAX;
+	pe = ppelib_create_from_reader(read_buffer, &reader, 0x100);
+	CHECK(!pe);
+	CHECK(ppelib_error_peek());
+}
+
+int main() {
+	size_t size;
+	uint8_t *buffer = test_image_create(&size);
+
+	test_reader(buffer, size);
+	test_errors(buffer, size);
+
+	free(buffer);
+	return 0;
+}
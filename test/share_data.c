@@ -0,0 +1,135 @@
+/* Copyright 2021 Hein-Pieter van Braam-Stewart
+ *
+ * This file is part of ppelib (Portable Portable Executable LIBrary)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "ppe_error.h"
+#include "test_common.h"
+
+static uint8_t *write_image(ppelib_file_t *pe, size_t *size) {
+	update_resource_table(pe);
+	CHECK(!ppelib_error_peek());
+
+	*size = ppelib_write_to_buffer(pe, NULL, 0);
+	CHECK(*size);
+	uint8_t *out = malloc(*size);
+	CHECK(out);
+	CHECK(ppelib_write_to_buffer(pe, out, *size) == *size);
+	return out;
+}
+
+static void check_rcdata(const uint8_t *buffer, size_t size, uint8_t shared) {
+	ppelib_file_t *pe = ppelib_create_from_buffer_borrowed(buffer, size);
+	CHECK(!ppelib_error_peek());
+	CHECK(pe->resource_table.size == TEST_NUMB_RESOURCES);
+
+	resource_t *first = test_find_resource(&pe->resource_table, RT_RCDATA, NULL, 1, TEST_LANGUAGE);
+	resource_t *second = test_find_resource(&pe->resource_table, RT_RCDATA, NULL, 2, TEST_LANGUAGE);
+	CHECK(first && second);
+	CHECK(first->size == TEST_RCDATA_SIZE && second->size == TEST_RCDATA_SIZE);
+	CHECK(!memcmp(first->data, second->data, TEST_RCDATA_SIZE));
+	CHECK((first->data == second->data) == shared);
+
+	resource_t *named = test_find_resource(&pe->resource_table, RT_RCDATA, TEST_RCDATA_NAME, 0, TEST_OTHER_LANGUAGE);
+	CHECK(named && (named->data == first->data) == shared);
+
+	ppelib_destroy(pe);
+}
+
+static void test_share(const uint8_t *buffer, size_t size) {
+	ppelib_file_t *pe = ppelib_create_from_buffer(buffer, size);
+	CHECK(!ppelib_error_peek());
+
+	size_t unshared_size = resource_table_serialize(NULL, 0, &pe->resource_table);
+	CHECK(unshared_size);
+
+	ppelib_resources_share_data(pe, 1);
+	CHECK(!ppelib_error_peek());
+	size_t shared_size = resource_table_serialize(NULL, 0, &pe->resource_table);
+	// All four RT_RCDATA payloads are the same, so three of them go
+	CHECK(shared_size == unshared_size - 3 * TEST_RCDATA_SIZE);
+
+	size_t out_size;
+	uint8_t *out = write_image(pe, &out_size);
+	check_rcdata(out, out_size, 1);
+	free(out);
+
+	// And back again
+	ppelib_resources_share_data(pe, 0);
+	CHECK(resource_table_serialize(NULL, 0, &pe->resource_table) == unshared_size);
+
+	out = write_image(pe, &out_size);
+	check_rcdata(out, out_size, 0);
+	free(out);
+
+	ppelib_destroy(pe);
+}
+
+// Payloads of the same size but different contents stay apart
+static void test_collision() {
+	resource_table_t table = {0};
+	table.share_data = 1;
+
+	uint8_t *data = malloc(TEST_RCDATA_SIZE);
+	CHECK(data);
+	memset(data, 0xAA, TEST_RCDATA_SIZE);
+	test_add_resource(&table, RT_RCDATA, NULL, 1, TEST_LANGUAGE, data, TEST_RCDATA_SIZE);
+
+	data = malloc(TEST_RCDATA_SIZE);
+	CHECK(data);
+	memset(data, 0xAA, TEST_RCDATA_SIZE);
+	data[TEST_RCDATA_SIZE - 1] = 0xAB;
+	test_add_resource(&table, RT_RCDATA, NULL, 2, TEST_LANGUAGE, data, TEST_RCDATA_SIZE);
+
+	size_t size = resource_table_serialize(NULL, 0, &table);
+	CHECK(size);
+	CHECK(!ppelib_error_peek());
+
+	table.share_data = 0;
+	resource_table_mark_modified(&table);
+	CHECK(resource_table_serialize(NULL, 0, &table) == size);
+
+	resource_table_free(&table);
+}
+
+// Payloads that were never loaded can't be compared
+static void test_skipped_data(const uint8_t *buffer, size_t size) {
+	ppelib_file_t *pe = ppelib_create_from_buffer_ex(buffer, size, PPELIB_PARSE_SKIP_RESOURCE_DATA);
+	CHECK(!ppelib_error_peek());
+
+	ppelib_resources_share_data(pe, 1);
+	CHECK(!ppelib_error_peek());
+	update_resource_table(pe);
+	CHECK(ppelib_error_peek());
+
+	ppelib_destroy(pe);
+}
+
+int main() {
+	size_t size;
+	uint8_t *buffer = test_image_create(&size);
+
+	check_rcdata(buffer, size, 0);
+	test_share(buffer, size);
+	test_collision();
+	test_skipped_data(buffer, size);
+
+	free(buffer);
+	return 0;
+}
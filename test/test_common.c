@@ -0,0 +1,382 @@
+/* Copyright 2021 Hein-Pieter van Braam-Stewart
+ *
+ * This file is part of ppelib (Portable Portable Executable LIBrary)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lodepng.h"
+
+#include "main.h"
+#include "ppe_error.h"
+#include "test_common.h"
+
+#define PE_HEADER_OFFSET 0x80
+#define FILE_ALIGNMENT 0x200
+#define SECTION_ALIGNMENT 0x1000
+#define TEXT_VA 0x1000
+#define RSRC_VA 0x2000
+
+void test_fail(const char *file, int line, const char *cond) {
+	printf("%s:%i: %s failed\n", file, line, cond);
+	if (ppelib_error_peek()) {
+		printf("PPELib-Error: %s\n", ppelib_error());
+	}
+
+	exit(1);
+}
+
+void test_write_file(const char *filename, const uint8_t *buffer, size_t size) {
+	FILE *fp = fopen(filename, "wb");
+	CHECK(fp);
+	CHECK(!size || fwrite(buffer, 1, size, fp) == size);
+	fclose(fp);
+}
+
+uint8_t *test_read_file(const char *filename, size_t *size) {
+	FILE *fp = fopen(filename, "rb");
+	CHECK(fp);
+
+	fseek(fp, 0, SEEK_END);
+	long end = ftell(fp);
+	CHECK(end >= 0);
+	fseek(fp, 0, SEEK_SET);
+
+	*size = (size_t)end;
+	uint8_t *buffer = malloc(*size + 1);
+	CHECK(buffer);
+	CHECK(fread(buffer, 1, *size, fp) == *size);
+	fclose(fp);
+
+	return buffer;
+}
+
+uint8_t test_rcdata_byte(size_t idx) {
+	return (uint8_t)(idx * 7 + 3);
+}
+
+resource_t *test_find_resource(const resource_table_t *resource_table, uint32_t type_id, const char *name, uint32_t name_id, uint32_t language_id) {
+	for (size_t i = 0; i < resource_table->size; ++i) {
+		resource_t *resource = resource_table->resources[i];
+
+		if (resource->type_id != type_id || resource->language_id != language_id) {
+			continue;
+		}
+
+		if (name ? resource->name && !strcmp(resource->name, name) : !resource->name && resource->name_id == name_id) {
+			return resource;
+		}
+	}
+
+	return NULL;
+}
+
+void test_icon_pixel(uint32_t x, uint32_t y, uint8_t rgba[4]) {
+	rgba[0] = (uint8_t)(x * 16);
+	rgba[1] = (uint8_t)(y * 16);
+	rgba[2] = 0x40;
+	rgba[3] = 0xff;
+}
+
+size_t test_image_checksum_offset(const uint8_t *buffer) {
+	return read_uint32_t(buffer + 0x3C) + 4 + 84;
+}
+
+uint32_t test_image_checksum(const uint8_t *buffer, size_t size) {
+	size_t checksum_offset = test_image_checksum_offset(buffer);
+	uint64_t sum = 0;
+
+	for (size_t i = 0; i < size; i += 2) {
+		if (i == checksum_offset || i == checksum_offset + 2) {
+			continue;
+		}
+
+		uint32_t word = buffer[i];
+		if (i + 1 < size) {
+			word |= (uint32_t)buffer[i + 1] << 8;
+		}
+
+		sum += word;
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (uint32_t)sum + (uint32_t)size;
+}
+
+void test_add_resource(resource_table_t *table, uint32_t type_id, const char *name, uint32_t name_id, uint32_t language_id, uint8_t *data, size_t size) {
+	resource_t **resources = realloc(table->resources, sizeof(resource_t *) * (table->size + 1));
+	CHECK(resources);
+	table->resources = resources;
+
+	resource_t *resource = calloc(sizeof(resource_t), 1);
+	CHECK(resource);
+	table->resources[table->size++] = resource;
+
+	resource->type_id = type_id;
+	if (name) {
+		resource->name = strdup(name);
+	} else {
+		resource->name_id = name_id;
+	}
+	resource->language_id = language_id;
+	resource->data = data;
+	resource->size = size;
+}
+
+static uint8_t *create_png_icon(size_t *size) {
+	uint8_t image[TEST_ICON_SIZE * TEST_ICON_SIZE * 4];
+	for (uint32_t y = 0; y < TEST_ICON_SIZE; ++y) {
+		for (uint32_t x = 0; x < TEST_ICON_SIZE; ++x) {
+			test_icon_pixel(x, y, image + (y * TEST_ICON_SIZE + x) * 4);
+		}
+	}
+
+	uint8_t *png = NULL;
+	CHECK(!lodepng_encode32(&png, size, image, TEST_ICON_SIZE, TEST_ICON_SIZE));
+	return png;
+}
+
+// Bottom up BGRA rows followed by a mask that hides the first column
+static uint8_t *create_dib_icon(size_t *size) {
+	size_t pixels_size = TEST_ICON_SIZE * TEST_ICON_SIZE * 4;
+	size_t mask_line = 4;
+	*size = 40 + pixels_size + TEST_ICON_SIZE * mask_line;
+
+	uint8_t *dib = calloc(*size, 1);
+	CHECK(dib);
+
+	write_uint32_t(dib + 0, 40);
+	write_uint32_t(dib + 4, TEST_ICON_SIZE);
+	write_uint32_t(dib + 8, TEST_ICON_SIZE * 2);
+	write_uint16_t(dib + 12, 1);
+	write_uint16_t(dib + 14, 32);
+	write_uint32_t(dib + 20, (uint32_t)pixels_size);
+
+	for (uint32_t y = 0; y < TEST_ICON_SIZE; ++y) {
+		uint8_t *line = dib + 40 + (TEST_ICON_SIZE - y - 1) * TEST_ICON_SIZE * 4;
+		uint8_t *mask = dib + 40 + pixels_size + (TEST_ICON_SIZE - y - 1) * mask_line;
+
+		for (uint32_t x = 0; x < TEST_ICON_SIZE; ++x) {
+			uint8_t rgba[4];
+			test_icon_pixel(x, y, rgba);
+
+			line[x * 4 + 0] = rgba[2];
+			line[x * 4 + 1] = rgba[1];
+			line[x * 4 + 2] = rgba[0];
+			line[x * 4 + 3] = rgba[3];
+		}
+
+		mask[0] = 0x80;
+	}
+
+	return dib;
+}
+
+static uint8_t *create_icon_group(size_t png_size, size_t dib_size, size_t *size) {
+	*size = 6 + 2 * 14;
+
+	uint8_t *group = calloc(*size, 1);
+	CHECK(group);
+
+	write_uint16_t(group + 2, 1);
+	write_uint16_t(group + 4, 2);
+
+	const size_t icon_sizes[] = {png_size, dib_size};
+	const uint16_t icon_ids[] = {TEST_PNG_ICON_ID, TEST_DIB_ICON_ID};
+	for (size_t i = 0; i < 2; ++i) {
+		uint8_t *entry = group + 6 + i * 14;
+		write_uint8_t(entry + 0, TEST_ICON_SIZE);
+		write_uint8_t(entry + 1, TEST_ICON_SIZE);
+		write_uint16_t(entry + 4, 1);
+		write_uint16_t(entry + 6, 32);
+		write_uint32_t(entry + 8, (uint32_t)icon_sizes[i]);
+		write_uint16_t(entry + 12, icon_ids[i]);
+	}
+
+	return group;
+}
+
+static uint8_t *create_versioninfo(size_t *size) {
+	version_info_t versioninfo = {0};
+	resource_t resource = {0};
+
+	versioninfo.resource = &resource;
+	versioninfo.file_version.major_version = TEST_FILE_VERSION_MAJOR;
+	versioninfo.file_version.minor_version = TEST_FILE_VERSION_MINOR;
+	versioninfo.file_version.patch_version = TEST_FILE_VERSION_PATCH;
+	versioninfo.file_version.build_version = TEST_FILE_VERSION_BUILD;
+	versioninfo.product_version = versioninfo.file_version;
+	versioninfo.version = 0x10000;
+	versioninfo.flags_mask = 0x3f;
+	versioninfo.os = 0x40004;
+	versioninfo.type = 1;
+
+	versioninfo_set_value(&versioninfo, TEST_LANGUAGE, 1200, "CompanyName", TEST_COMPANY_NAME);
+	versioninfo_set_value(&versioninfo, TEST_LANGUAGE, 1200, "FileVersion", "1.2.3.4");
+
+	versioninfo.languages = malloc(sizeof(language_t));
+	CHECK(versioninfo.languages);
+	versioninfo.numb_languages = 1;
+	versioninfo.languages[0].language = TEST_LANGUAGE;
+	versioninfo.languages[0].codepage = 1200;
+
+	versioninfo_serialize(&versioninfo);
+	versioninfo_free(&versioninfo);
+	CHECK(resource.data);
+
+	*size = resource.size;
+	return resource.data;
+}
+
+static uint8_t *create_rcdata() {
+	uint8_t *data = malloc(TEST_RCDATA_SIZE);
+	CHECK(data);
+
+	for (size_t i = 0; i < TEST_RCDATA_SIZE; ++i) {
+		data[i] = test_rcdata_byte(i);
+	}
+
+	return data;
+}
+
+// The resource section is laid out by the library itself, the rest by hand
+static uint8_t *create_resource_section(size_t *size) {
+	resource_table_t table = {0};
+
+	size_t png_size, dib_size, group_size, versioninfo_size;
+	uint8_t *png = create_png_icon(&png_size);
+	uint8_t *dib = create_dib_icon(&dib_size);
+	uint8_t *group = create_icon_group(png_size, dib_size, &group_size);
+	uint8_t *versioninfo = create_versioninfo(&versioninfo_size);
+
+	test_add_resource(&table, RT_ICON, NULL, TEST_PNG_ICON_ID, TEST_LANGUAGE, png, png_size);
+	test_add_resource(&table, RT_ICON, NULL, TEST_DIB_ICON_ID, TEST_LANGUAGE, dib, dib_size);
+	test_add_resource(&table, RT_GROUP_ICON, NULL, 1, TEST_LANGUAGE, group, group_size);
+	test_add_resource(&table, RT_VERSION, NULL, 1, TEST_LANGUAGE, versioninfo, versioninfo_size);
+	test_add_resource(&table, RT_RCDATA, NULL, 1, TEST_LANGUAGE, create_rcdata(), TEST_RCDATA_SIZE);
+	test_add_resource(&table, RT_RCDATA, NULL, 2, TEST_LANGUAGE, create_rcdata(), TEST_RCDATA_SIZE);
+	test_add_resource(&table, RT_RCDATA, TEST_RCDATA_NAME, 0, TEST_LANGUAGE, create_rcdata(), TEST_RCDATA_SIZE);
+	test_add_resource(&table, RT_RCDATA, TEST_RCDATA_NAME, 0, TEST_OTHER_LANGUAGE, create_rcdata(), TEST_RCDATA_SIZE);
+	CHECK(table.size == TEST_NUMB_RESOURCES);
+
+	*size = resource_table_serialize(NULL, 0, &table);
+	CHECK(*size);
+
+	section_t section = {0};
+	section.virtual_address = RSRC_VA;
+	section.contents_size = *size;
+	section.contents = calloc(*size, 1);
+	CHECK(section.contents);
+
+	CHECK(resource_table_serialize(&section, 0, &table) == *size);
+	resource_table_free(&table);
+
+	return section.contents;
+}
+
+static void write_section(uint8_t *buffer, size_t offset, const char *name, uint32_t virtual_address, uint32_t virtual_size,
+		uint32_t pointer_to_raw_data, uint32_t size_of_raw_data, uint32_t characteristics) {
+	section_t section = {0};
+	strcpy(section.name, name);
+	section.virtual_address = virtual_address;
+	section.virtual_size = virtual_size;
+	section.pointer_to_raw_data = pointer_to_raw_data;
+	section.size_of_raw_data = size_of_raw_data;
+	section.characteristics = characteristics;
+
+	section_serialize(&section, buffer, offset);
+}
+
+uint8_t *test_image_create(size_t *size) {
+	size_t rsrc_size;
+	uint8_t *rsrc = create_resource_section(&rsrc_size);
+
+	uint32_t rsrc_raw_size = (uint32_t)TO_NEAREST(rsrc_size, FILE_ALIGNMENT);
+	uint32_t rsrc_offset = 2 * FILE_ALIGNMENT;
+	uint32_t reloc_va = RSRC_VA + (uint32_t)TO_NEAREST(rsrc_size, SECTION_ALIGNMENT);
+	uint32_t reloc_offset = rsrc_offset + rsrc_raw_size;
+	size_t overlay_offset = reloc_offset + FILE_ALIGNMENT;
+
+	*size = overlay_offset + TEST_OVERLAY_SIZE;
+	uint8_t *buffer = calloc(*size, 1);
+	CHECK(buffer);
+
+	write_uint16_t(buffer, MZ_SIGNATURE);
+	write_uint32_t(buffer + 0x3C, PE_HEADER_OFFSET);
+	write_uint32_t(buffer + PE_HEADER_OFFSET, PE_SIGNATURE);
+
+	header_t header = {0};
+	header.machine = 0x14c;
+	header.number_of_sections = 3;
+	header.time_date_stamp = 0x60000000;
+	header.size_of_optional_header = PE_OPTIONAL_HEADER_SIZE + 16 * DATA_DIRECTORY_SIZE;
+	header.characteristics = 0x0102;
+	header.magic = PE32_MAGIC;
+	header.major_linker_version = 14;
+	header.size_of_code = FILE_ALIGNMENT;
+	header.size_of_initialized_data = rsrc_raw_size + FILE_ALIGNMENT;
+	header.address_of_entry_point = TEXT_VA;
+	header.base_of_code = TEXT_VA;
+	header.base_of_data = RSRC_VA;
+	header.image_base = 0x400000;
+	header.section_alignment = SECTION_ALIGNMENT;
+	header.file_alignment = FILE_ALIGNMENT;
+	header.major_operating_system_version = 6;
+	header.major_subsystem_version = 6;
+	header.size_of_image = reloc_va + SECTION_ALIGNMENT;
+	header.size_of_headers = FILE_ALIGNMENT;
+	header.subsystem = 2;
+	header.size_of_stack_reserve = 0x100000;
+	header.size_of_stack_commit = 0x1000;
+	header.size_of_heap_reserve = 0x100000;
+	header.size_of_heap_commit = 0x1000;
+	header.number_of_rva_and_sizes = 16;
+
+	size_t header_offset = PE_HEADER_OFFSET + 4;
+	size_t header_size = header_serialize(&header, buffer, header_offset);
+
+	uint8_t *directories = buffer + header_offset + header_size;
+	write_uint32_t(directories + DIR_RESOURCE_TABLE * DATA_DIRECTORY_SIZE, RSRC_VA);
+	write_uint32_t(directories + DIR_RESOURCE_TABLE * DATA_DIRECTORY_SIZE + 4, (uint32_t)rsrc_size);
+	write_uint32_t(directories + DIR_BASE_RELOCATION_TABLE * DATA_DIRECTORY_SIZE, reloc_va);
+	write_uint32_t(directories + DIR_BASE_RELOCATION_TABLE * DATA_DIRECTORY_SIZE + 4, 8);
+
+	size_t section_offset = header_offset + COFF_HEADER_SIZE + header.size_of_optional_header;
+	write_section(buffer, section_offset, ".text", TEXT_VA, 1, FILE_ALIGNMENT, FILE_ALIGNMENT,
+			IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_MEM_READ);
+	write_section(buffer, section_offset + SECTION_SIZE, ".rsrc", RSRC_VA, (uint32_t)rsrc_size, rsrc_offset, rsrc_raw_size,
+			IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_MEM_READ);
+	write_section(buffer, section_offset + 2 * SECTION_SIZE, ".reloc", reloc_va, 8, reloc_offset, FILE_ALIGNMENT,
+			IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_MEM_DISCARDABLE | IMAGE_SCN_MEM_READ);
+
+	// ret, and a relocation block without entries
+	buffer[FILE_ALIGNMENT] = 0xC3;
+	write_uint32_t(buffer + reloc_offset, TEXT_VA);
+	write_uint32_t(buffer + reloc_offset + 4, 8);
+
+	memcpy(buffer + rsrc_offset, rsrc, rsrc_size);
+	free(rsrc);
+
+	for (size_t i = 0; i < TEST_OVERLAY_SIZE; ++i) {
+		buffer[overlay_offset + i] = (uint8_t)(i * 13 + 1);
+	}
+
+	write_uint32_t(buffer + test_image_checksum_offset(buffer), test_image_checksum(buffer, *size));
+
+	return buffer;
+}
@@ -0,0 +1,78 @@
+/* Copyright 2021 Hein-Pieter van Braam-Stewart
+ *
+ * This file is part of ppelib (Portable Portable Executable LIBrary)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TEST_TEST_COMMON_H_
+#define TEST_TEST_COMMON_H_
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "resources/resource.h"
+
+// What meson counts as a skipped test
+#define TEST_SKIP 77
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			test_fail(__FILE__, __LINE__, #cond); \
+		} \
+	} while (0)
+
+// The image built by test_image_create(). A PE32 with .text, .rsrc and .reloc
+// at a file alignment of 512 and a section alignment of 4096, followed by an
+// overlay.
+#define TEST_LANGUAGE 1033
+#define TEST_OTHER_LANGUAGE 1043
+#define TEST_OVERLAY_SIZE 1000
+#define TEST_RCDATA_SIZE 256
+#define TEST_RCDATA_NAME "CONFIG"
+#define TEST_ICON_SIZE 16
+#define TEST_PNG_ICON_ID 1
+#define TEST_DIB_ICON_ID 2
+#define TEST_COMPANY_NAME "ppelib tests"
+#define TEST_FILE_VERSION_MAJOR 1
+#define TEST_FILE_VERSION_MINOR 2
+#define TEST_FILE_VERSION_PATCH 3
+#define TEST_FILE_VERSION_BUILD 4
+
+// Resources in the image, all in TEST_LANGUAGE unless noted:
+// - RT_ICON TEST_PNG_ICON_ID, a PNG, and TEST_DIB_ICON_ID, a 32 bit DIB whose
+//   mask hides the first column. Both show test_icon_pixel().
+// - RT_GROUP_ICON 1 with both icons
+// - RT_VERSION 1 with TEST_FILE_VERSION_* and CompanyName TEST_COMPANY_NAME
+// - RT_RCDATA 1 and 2 with the same TEST_RCDATA_SIZE bytes of test_rcdata_byte()
+// - RT_RCDATA TEST_RCDATA_NAME in TEST_LANGUAGE and TEST_OTHER_LANGUAGE
+#define TEST_NUMB_RESOURCES 8
+uint8_t *test_image_create(size_t *size);
+
+uint8_t test_rcdata_byte(size_t idx);
+// Adds a resource that owns name and data, like one a caller would add
+void test_add_resource(resource_table_t *resource_table, uint32_t type_id, const char *name, uint32_t name_id, uint32_t language_id, uint8_t *data, size_t size);
+// By name when name is set, by name_id otherwise. NULL when it isn't there.
+resource_t *test_find_resource(const resource_table_t *resource_table, uint32_t type_id, const char *name, uint32_t name_id, uint32_t language_id);
+void test_icon_pixel(uint32_t x, uint32_t y, uint8_t rgba[4]);
+
+// What the checksum field of the image should say
+uint32_t test_image_checksum(const uint8_t *buffer, size_t size);
+size_t test_image_checksum_offset(const uint8_t *buffer);
+
+void test_fail(const char *file, int line, const char *cond);
+void test_write_file(const char *filename, const uint8_t *buffer, size_t size);
+uint8_t *test_read_file(const char *filename, size_t *size);
+
+#endif /* TEST_TEST_COMMON_H_ */
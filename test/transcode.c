@@ -0,0 +1,236 @@
+/* Copyright 2021 Hein-Pieter van Braam-Stewart
+ *
+ * This file is part of ppelib (Portable Portable Executable LIBrary)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <iconv.h>
+
+#ifdef LIBICONV_INTERNAL
+#define iconv_t ppelib_iconv_t
+#define iconv ppelib_iconv
+#define iconv_open ppelib_iconv_open
+#define iconv_close ppelib_iconv_close
+#endif
+
+#include "ppe_error.h"
+#include "test_common.h"
+#include "utils.h"
+
+// Longer than two SIMD blocks of either encoding
+#define MAX_UNITS 48
+
+typedef struct encoded {
+	uint8_t utf8[MAX_UNITS * 4];
+	size_t utf8_size;
+	uint8_t utf16[MAX_UNITS * 4];
+	size_t utf16_size;
+} encoded_t;
+
+static void append(encoded_t *encoded, uint32_t c) {
+	uint8_t *u8 = encoded->utf8 + encoded->utf8_size;
+	if (c < 0x80) {
+		u8[0] = (uint8_t)c;
+		encoded->utf8_size += 1;
+	} else if (c < 0x800) {
+		u8[0] = (uint8_t)(0xC0 | (c >> 6));
+		u8[1] = (uint8_t)(0x80 | (c & 0x3F));
+		encoded->utf8_size += 2;
+	} else if (c < 0x10000) {
+		u8[0] = (uint8_t)(0xE0 | (c >> 12));
+		u8[1] = (uint8_t)(0x80 | ((c >> 6) & 0x3F));
+		u8[2] = (uint8_t)(0x80 | (c & 0x3F));
+		encoded->utf8_size += 3;
+	} else {
+		u8[0] = (uint8_t)(0xF0 | (c >> 18));
+		u8[1] = (uint8_t)(0x80 | ((c >> 12) & 0x3F));
+		u8[2] = (uint8_t)(0x80 | ((c >> 6) & 0x3F));
+		u8[3] = (uint8_t)(0x80 | (c & 0x3F));
+		encoded->utf8_size += 4;
+	}
+
+	uint8_t *u16 = encoded->utf16 + encoded->utf16_size;
+	if (c < 0x10000) {
+		write_uint16_t(u16, (uint16_t)c);
+		encoded->utf16_size += 2;
+	} else {
+		write_uint16_t(u16, (uint16_t)(0xD800 | ((c - 0x10000) >> 10)));
+		write_uint16_t(u16 + 2, (uint16_t)(0xDC00 | ((c - 0x10000) & 0x3FF)));
+		encoded->utf16_size += 4;
+	}
+}
+
+// What iconv makes of it, SIZE_MAX when it refuses
+static size_t iconv_convert(const char *to, const char *from, const uint8_t *in, size_t in_size, uint8_t *out, size_t out_size) {
+	iconv_t cd = iconv_open(to, from);
+	CHECK(cd != (iconv_t)-1);
+
+	char *inptr = (char *)in;
+	char *outptr = (char *)out;
+	size_t outleft = out_size;
+	size_t ret = iconv(cd, &inptr, &in_size, &outptr, &outleft);
+	iconv_close(cd);
+
+	return ret == (size_t)-1 ? SIZE_MAX : out_size - outleft;
+}
+
+static void check_both_ways(const encoded_t *encoded) {
+	uint8_t out[MAX_UNITS * 8];
+	uint8_t expected[MAX_UNITS * 8];
+
+	size_t written = utf16le_to_utf8(encoded->utf16, encoded->utf16_size, out);
+	CHECK(written == encoded->utf8_size);
+	CHECK(!memcmp(out, encoded->utf8, written));
+	CHECK(iconv_convert("UTF-8", "UTF-16LE", encoded->utf16, encoded->utf16_size, expected, sizeof(expected)) == written);
+	CHECK(!memcmp(out, expected, written));
+
+	written = utf8_to_utf16le(encoded->utf8, encoded->utf8_size, out);
+	CHECK(written == encoded->utf16_size);
+	CHECK(!memcmp(out, encoded->utf16, written));
+	CHECK(iconv_convert("UTF-16LE", "UTF-8", encoded->utf8, encoded->utf8_size, expected, sizeof(expected)) == written);
+	CHECK(!memcmp(out, expected, written));
+}
+
+// One wide character in ASCII, at every position around the block edges
+static void test_block_boundaries() {
+	const uint32_t wide[] = {0xE9, 0x20AC, 0xFFFD, 0x1F600, 0x10FFFF};
+
+	for (size_t w = 0; w < sizeof(wide) / sizeof(wide[0]); ++w) {
+		for (size_t length = 1; length <= 40; ++length) {
+			for (size_t pos = 0; pos < length; ++pos) {
+				encoded_t encoded = {0};
+				for (size_t i = 0; i < length; ++i) {
+					append(&encoded, i == pos ? wide[w] : 'a' + (uint32_t)(i % 26));
+				}
+
+				check_both_ways(&encoded);
+			}
+		}
+	}
+
+	// Only ASCII, for every tail length
+	for (size_t length = 0; length <= 40; ++length) {
+		encoded_t encoded = {0};
+		for (size_t i = 0; i < length; ++i) {
+			append(&encoded, 0x20 + (uint32_t)i);
+		}
+
+		check_both_ways(&encoded);
+	}
+}
+
+static void test_surrogate_pairs() {
+	encoded_t encoded = {0};
+	append(&encoded, 0x1F600);
+	append(&encoded, 0x10000);
+	append(&encoded, 0x10FFFF);
+
+	const uint8_t utf16[] = {0x3D, 0xD8, 0x00, 0xDE, 0x00, 0xD8, 0x00, 0xDC, 0xFF, 0xDB, 0xFF, 0xDF};
+	CHECK(encoded.utf16_size == sizeof(utf16) && !memcmp(encoded.utf16, utf16, sizeof(utf16)));
+	check_both_ways(&encoded);
+}
+
+// The transcoder turns them down, the strings come out like iconv has them
+static void check_lone_surrogate(const uint8_t *in, size_t in_size) {
+	uint8_t out[MAX_UNITS * 8];
+	CHECK(utf16le_to_utf8(in, in_size, out) == NOT_CONVERTED);
+
+	uint8_t expected[MAX_UNITS * 8];
+	size_t expected_size = iconv_convert("UTF-8", "UTF-16LE", in, in_size, expected, sizeof(expected));
+
+	ppelib_reset_error();
+	char *string = get_utf16_string(in, in_size, 0, in_size);
+	if (expected_size == SIZE_MAX) {
+		CHECK(!string);
+		CHECK(ppelib_error_peek());
+	} else {
+		CHECK(string);
+		CHECK(strlen(string) == expected_size && !memcmp(string, expected, expected_size));
+	}
+	free(string);
+}
+
+static void test_lone_surrogates() {
+	const uint16_t units[] = {0xD83D, 0xDE00, 0xDBFF};
+
+	for (size_t u = 0; u < sizeof(units) / sizeof(units[0]); ++u) {
+		// Around the end of the first block, and last
+		for (size_t pos = 6; pos < 11; ++pos) {
+			uint8_t in[MAX_UNITS * 2];
+			size_t length = pos == 10 ? 9 : 20;
+			for (size_t i = 0; i < length; ++i) {
+				write_uint16_t(in + i * 2, 'a');
+			}
+			write_uint16_t(in + (pos == 10 ? 8 : pos) * 2, units[u]);
+
+			check_lone_surrogate(in, length * 2);
+		}
+	}
+
+	// A pair the wrong way around
+	const uint8_t swapped[] = {0x00, 0xDE, 0x3D, 0xD8};
+	check_lone_surrogate(swapped, sizeof(swapped));
+}
+
+static void test_rejected() {
+	uint8_t out[64];
+
+	// Odd sizes never make it to the transcoder's loop
+	const uint8_t odd[] = {'a', 0, 'b'};
+	CHECK(utf16le_to_utf8(odd, sizeof(odd), out) == NOT_CONVERTED);
+
+	const char *invalid[] = {
+		"\xC0\x80",         // Overlong NUL
+		"\xE0\x80\xAF",     // Overlong slash
+		"\xED\xA0\x80",     // Encoded surrogate
+		"\xF4\x90\x80\x80", // Past U+10FFFF
+		"\xF8\x88\x80\x80", // Five byte lead
+		"\xE2\x82",         // Cut short
+		"abcdefghijklmno\x80", // Stray continuation after a block
+	};
+
+	for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i) {
+		size_t size = strlen(invalid[i]);
+		CHECK(utf8_to_utf16le((const uint8_t *)invalid[i], size, out) == NOT_CONVERTED);
+
+		char *string = NULL;
+		ppelib_reset_error();
+		size_t written = convert_utf8_string(invalid[i], &string);
+		if (iconv_convert("UTF-16LE", "UTF-8", (const uint8_t *)invalid[i], size, out, sizeof(out)) == SIZE_MAX) {
+			CHECK(!written);
+			CHECK(ppelib_error_peek());
+		} else {
+			free(string);
+		}
+	}
+
+	// Past the end of the buffer
+	const uint8_t in[] = {'a', 0, 'b', 0};
+	ppelib_reset_error();
+	CHECK(!get_utf16_string(in, sizeof(in), 2, 4));
+	CHECK(ppelib_error_peek());
+}
+
+int main() {
+	test_block_boundaries();
+	test_surrogate_pairs();
+	test_lone_surrogates();
+	test_rejected();
+
+	close_string_converters();
+	return 0;
+}
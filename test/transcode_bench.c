@@ -0,0 +1,147 @@
+/* Copyright 2021 Hein-Pieter van Braam-Stewart
+ *
+ * This file is part of ppelib (Portable Portable Executable LIBrary)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <iconv.h>
+
+#ifdef LIBICONV_INTERNAL
+#define iconv_t ppelib_iconv_t
+#define iconv ppelib_iconv
+#define iconv_open ppelib_iconv_open
+#define iconv_close ppelib_iconv_close
+#endif
+
+#include "utils.h"
+
+// Bytes of UTF-16LE per sample, about the size of a large string table
+#define SAMPLE_UNITS (64 * 1024)
+#define ROUNDS 200
+
+typedef struct sample {
+	const char *name;
+	// Repeated until the sample is full
+	uint16_t units[8];
+	size_t numb_units;
+} sample_t;
+
+static const sample_t samples[] = {
+		{"ascii", {'V', 'e', 'r', 's', 'i', 'o', 'n', ' '}, 8},
+		{"latin", {'C', 'a', 'f', 0xE9, ' ', 'n', 0xE4, 'r'}, 8},
+		{"cjk", {0x6587, 0x4EF6, 0x7248, 0x672C, 0x8CC7, 0x8A0A, 0x3002, ' '}, 8},
+		{"surrogates", {0xD83D, 0xDE00, 'o', 'k', 0xD83C, 0xDF89, ' ', ' '}, 8},
+};
+
+static double now() {
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static size_t run_iconv(iconv_t cd, const uint8_t *in, size_t in_size, uint8_t *out, size_t out_size) {
+	iconv(cd, NULL, NULL, NULL, NULL);
+
+	char *inptr = (char *)in;
+	char *outptr = (char *)out;
+	size_t outleft = out_size;
+	if (iconv(cd, &inptr, &in_size, &outptr, &outleft) == (size_t)-1) {
+		return NOT_CONVERTED;
+	}
+
+	return out_size - outleft;
+}
+
+static void report(const char *sample, const char *direction, size_t bytes, double builtin, double with_iconv) {
+	double mb = (double)bytes * ROUNDS / (1024.0 * 1024.0);
+	printf("%-10s %-8s built-in %8.1f MB/s  iconv %8.1f MB/s  %5.1fx\n", sample, direction, mb / builtin, mb / with_iconv,
+			with_iconv / builtin);
+}
+
+// Times the built-in transcoder against iconv, both ways, on the samples
+int main() {
+	int retval = 0;
+
+	size_t utf16_size = SAMPLE_UNITS * 2;
+	uint8_t *utf16 = malloc(utf16_size);
+	uint8_t *utf8 = malloc(utf16_size * 2);
+	uint8_t *out = malloc(utf16_size * 2);
+	uint8_t *expected = malloc(utf16_size * 2);
+
+	iconv_t to_utf8 = iconv_open("UTF-8", "UTF-16LE");
+	iconv_t to_utf16 = iconv_open("UTF-16LE", "UTF-8");
+
+	if (!utf16 || !utf8 || !out || !expected || to_utf8 == (iconv_t)-1 || to_utf16 == (iconv_t)-1) {
+		printf("Setup failed\n");
+		retval = 1;
+		goto out;
+	}
+
+	for (size_t s = 0; s < sizeof(samples) / sizeof(samples[0]); ++s) {
+		const sample_t *sample = &samples[s];
+		for (size_t i = 0; i < SAMPLE_UNITS; ++i) {
+			write_uint16_t(utf16 + i * 2, sample->units[i % sample->numb_units]);
+		}
+
+		size_t utf8_size = utf16le_to_utf8(utf16, utf16_size, utf8);
+		if (utf8_size == NOT_CONVERTED || run_iconv(to_utf8, utf16, utf16_size, expected, utf16_size * 2) != utf8_size ||
+				memcmp(utf8, expected, utf8_size)) {
+			printf("%s: built-in and iconv disagree\n", sample->name);
+			retval = 1;
+			goto out;
+		}
+
+		double start = now();
+		for (size_t r = 0; r < ROUNDS; ++r) {
+			utf16le_to_utf8(utf16, utf16_size, out);
+		}
+		double builtin = now() - start;
+
+		start = now();
+		for (size_t r = 0; r < ROUNDS; ++r) {
+			run_iconv(to_utf8, utf16, utf16_size, out, utf16_size * 2);
+		}
+		report(sample->name, "to utf8", utf16_size, builtin, now() - start);
+
+		start = now();
+		for (size_t r = 0; r < ROUNDS; ++r) {
+			utf8_to_utf16le(utf8, utf8_size, out);
+		}
+		builtin = now() - start;
+
+		start = now();
+		for (size_t r = 0; r < ROUNDS; ++r) {
+			run_iconv(to_utf16, utf8, utf8_size, out, utf16_size * 2);
+		}
+		report(sample->name, "to utf16", utf8_size, builtin, now() - start);
+	}
+
+out:
+	if (to_utf8 != (iconv_t)-1) {
+		iconv_close(to_utf8);
+	}
+	if (to_utf16 != (iconv_t)-1) {
+		iconv_close(to_utf16);
+	}
+	free(utf16);
+	free(utf8);
+	free(out);
+	free(expected);
+	return retval;
+}
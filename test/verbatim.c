@@ -0,0 +1,179 @@
+/* Copyright 2021 Hein-Pieter van Braam-Stewart
+ *
+ * This file is part of ppelib (Portable Portable Executable LIBrary)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "ppe_error.h"
+#include "test_common.h"
+
+static uint8_t *write_image(ppelib_file_t *pe, size_t *size) {
+	update_resource_table(pe);
+	CHECK(!ppelib_error_peek());
+
+	*size = ppelib_write_to_buffer(pe, NULL, 0);
+	CHECK(*size);
+	uint8_t *out = malloc(*size);
+	CHECK(out);
+	CHECK(ppelib_write_to_buffer(pe, out, *size) == *size);
+	return out;
+}
+
+static section_t *resource_section(ppelib_file_t *pe) {
+	return pe->data_directories[DIR_RESOURCE_TABLE].section;
+}
+
+static version_info_t *get_versioninfo(ppelib_file_t *pe) {
+	CHECK(resource_get_numb_versioninfo(&pe->resource_table) == 1);
+	version_info_t *versioninfo = resource_get_versioninfo(&pe->resource_table, 0);
+	CHECK(!ppelib_error_peek());
+	CHECK(versioninfo);
+	return versioninfo;
+}
+
+static void check_version(const version_t *version, uint16_t major, uint16_t minor, uint16_t patch, uint16_t build) {
+	CHECK(version->major_version == major);
+	CHECK(version->minor_version == minor);
+	CHECK(version->patch_version == patch);
+	CHECK(version->build_version == build);
+}
+
+// The original is the section's own bytes, not a copy
+static void test_unchanged(const uint8_t *buffer, size_t size) {
+	ppelib_file_t *pe = ppelib_create_from_buffer(buffer, size);
+	CHECK(!ppelib_error_peek());
+	CHECK(pe->resource_table.original_section == resource_section(pe));
+
+	// Looking at the versioninfo isn't changing it
+	get_versioninfo(pe);
+
+	size_t out_size;
+	uint8_t *out = write_image(pe, &out_size);
+	CHECK(out_size == size);
+	CHECK(!memcmp(out, buffer, size));
+	CHECK(pe->resource_table.original_section);
+
+	free(out);
+	ppelib_destroy(pe);
+}
+
+static void test_versions(const uint8_t *buffer, size_t size) {
+	ppelib_file_t *pe = ppelib_create_from_buffer(buffer, size);
+	CHECK(!ppelib_error_peek());
+
+	version_info_t *versioninfo = get_versioninfo(pe);
+	versioninfo_set_file_version(versioninfo, 5, 6, 7, 8);
+	CHECK(!ppelib_error_peek());
+	check_version(&versioninfo->file_version, 5, 6, 7, 8);
+
+	// Assigned directly, without a setter
+	versioninfo->product_version.major_version = 9;
+
+	size_t out_size;
+	uint8_t *out = write_image(pe, &out_size);
+	CHECK(out_size == size);
+	CHECK(memcmp(out, buffer, size));
+	ppelib_destroy(pe);
+
+	pe = ppelib_create_from_buffer(out, out_size);
+	CHECK(!ppelib_error_peek());
+	versioninfo = get_versioninfo(pe);
+	check_version(&versioninfo->file_version, 5, 6, 7, 8);
+	check_version(&versioninfo->product_version, 9, TEST_FILE_VERSION_MINOR, TEST_FILE_VERSION_PATCH, TEST_FILE_VERSION_BUILD);
+
+	CHECK(!resource_get_versioninfo(&pe->resource_table, 1));
+	CHECK(ppelib_error_peek());
+
+	free(out);
+	ppelib_destroy(pe);
+}
+
+// A payload patched into a borrowed original mustn't touch the caller's buffer
+static void test_borrowed(const uint8_t *buffer, size_t size) {
+	uint8_t *copy = malloc(size);
+	CHECK(copy);
+	memcpy(copy, buffer, size);
+
+	ppelib_file_t *pe = ppelib_create_from_buffer_borrowed(copy, size);
+	CHECK(!ppelib_error_peek());
+
+	resource_t *resource = test_find_resource(&pe->resource_table, RT_RCDATA, NULL, 1, TEST_LANGUAGE);
+	CHECK(resource);
+	uint8_t *data = malloc(TEST_RCDATA_SIZE);
+	CHECK(data);
+	memset(data, 0x5A, TEST_RCDATA_SIZE);
+	resource_set_data(resource, data, TEST_RCDATA_SIZE);
+
+	size_t out_size;
+	uint8_t *out = write_image(pe, &out_size);
+	CHECK(out_size == size);
+	CHECK(pe->resource_table.original_section);
+	CHECK(!memcmp(copy, buffer, size));
+	ppelib_destroy(pe);
+
+	pe = ppelib_create_from_buffer(out, out_size);
+	CHECK(!ppelib_error_peek());
+	resource = test_find_resource(&pe->resource_table, RT_RCDATA, NULL, 1, TEST_LANGUAGE);
+	CHECK(resource && resource->size == TEST_RCDATA_SIZE);
+	CHECK(resource->data[0] == 0x5A && resource->data[TEST_RCDATA_SIZE - 1] == 0x5A);
+
+	resource = test_find_resource(&pe->resource_table, RT_RCDATA, NULL, 2, TEST_LANGUAGE);
+	CHECK(resource && resource->data[0] == test_rcdata_byte(0));
+
+	free(out);
+	free(copy);
+	ppelib_destroy(pe);
+}
+
+// A payload that no longer fits means laying the table out again
+static void test_grown(const uint8_t *buffer, size_t size) {
+	ppelib_file_t *pe = ppelib_create_from_buffer(buffer, size);
+	CHECK(!ppelib_error_peek());
+
+	resource_t *resource = test_find_resource(&pe->resource_table, RT_RCDATA, NULL, 1, TEST_LANGUAGE);
+	CHECK(resource);
+	uint8_t *data = calloc(TEST_RCDATA_SIZE * 2, 1);
+	CHECK(data);
+	resource_set_data(resource, data, TEST_RCDATA_SIZE * 2);
+
+	size_t out_size;
+	uint8_t *out = write_image(pe, &out_size);
+	CHECK(!pe->resource_table.original_section);
+	ppelib_destroy(pe);
+
+	pe = ppelib_create_from_buffer(out, out_size);
+	CHECK(!ppelib_error_peek());
+	resource = test_find_resource(&pe->resource_table, RT_RCDATA, NULL, 1, TEST_LANGUAGE);
+	CHECK(resource && resource->size == TEST_RCDATA_SIZE * 2);
+
+	free(out);
+	ppelib_destroy(pe);
+}
+
+int main() {
+	size_t size;
+	uint8_t *buffer = test_image_create(&size);
+
+	test_unchanged(buffer, size);
+	test_versions(buffer, size);
+	test_borrowed(buffer, size);
+	test_grown(buffer, size);
+
+	free(buffer);
+	return 0;
+}
@@ -0,0 +1,180 @@
+/* Copyright 2021 Hein-Pieter van Braam-Stewart
+ *
+ * This file is part of ppelib (Portable Portable Executable LIBrary)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "main.h"
+#include "ppe_error.h"
+#include "test_common.h"
+
+#define IMAGE_FILE "write_fd.exe"
+#define OUT_FILE "write_fd.out.exe"
+
+#define PREFIX_SIZE 100
+// Past COPY_RANGE_MIN, so the overlay is copied between the files
+#define LARGE_OVERLAY_SIZE (128 * 1024)
+
+typedef struct sink {
+	uint8_t *buffer;
+	size_t size;
+	// Writes fail once this much has been written
+	size_t limit;
+} sink_t;
+
+static size_t sink_write(void *userdata, const uint8_t *buffer, size_t size) {
+	sink_t *sink = userdata;
+
+	size = MIN(size, sink->limit - sink->size);
+	memcpy(sink->buffer + sink->size, buffer, size);
+	sink->size += size;
+
+	return size;
+}
+
+static void test_sink(const ppelib_file_t *pe, const uint8_t *buffer, size_t size) {
+	sink_t sink = {malloc(size), 0, size};
+	CHECK(sink.buffer);
+
+	CHECK(ppelib_write_to_sink(pe, sink_write, &sink) == size);
+	CHECK(!ppelib_error_peek());
+	CHECK(sink.size == size);
+	CHECK(!memcmp(sink.buffer, buffer, size));
+
+	sink.size = 0;
+	sink.limit = size / 2;
+	CHECK(ppelib_write_to_sink(pe, sink_write, &sink) < size);
+	CHECK(ppelib_error_peek());
+
+	free(sink.buffer);
+}
+
+#if !defined _WIN32
+// Each write goes where the previous one left off
+static void test_seekable(const ppelib_file_t *pe, const uint8_t *buffer, size_t size) {
+	int fd = open(OUT_FILE, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	CHECK(fd >= 0);
+
+	uint8_t prefix[PREFIX_SIZE];
+	memset(prefix, 0xAA, sizeof(prefix));
+	CHECK(write(fd, prefix, sizeof(prefix)) == sizeof(prefix));
+
+	CHECK(ppelib_write_to_fd(pe, fd) == size);
+	CHECK(!ppelib_error_peek());
+	CHECK(lseek(fd, 0, SEEK_CUR) == (off_t)(PREFIX_SIZE + size));
+
+	CHECK(ppelib_write_to_fd(pe, fd) == size);
+	CHECK(!ppelib_error_peek());
+	CHECK(lseek(fd, 0, SEEK_CUR) == (off_t)(PREFIX_SIZE + 2 * size));
+	close(fd);
+
+	size_t out_size;
+	uint8_t *out = test_read_file(OUT_FILE, &out_size);
+	CHECK(out_size == PREFIX_SIZE + 2 * size);
+	CHECK(!memcmp(out, prefix, PREFIX_SIZE));
+	CHECK(!memcmp(out + PREFIX_SIZE, buffer, size));
+	CHECK(!memcmp(out + PREFIX_SIZE + size, buffer, size));
+	free(out);
+}
+
+static void test_pipe(const ppelib_file_t *pe, const uint8_t *buffer, size_t size) {
+	int fds[2];
+	CHECK(!pipe(fds));
+
+	// Large enough that the write has to wait for the reader
+	if (fork() == 0) {
+		close(fds[0]);
+		size_t written = ppelib_write_to_fd(pe, fds[1]);
+		_exit(written == size && !ppelib_error_peek() ? 0 : 1);
+	}
+	close(fds[1]);
+
+	uint8_t *out = malloc(size + 1);
+	CHECK(out);
+
+	size_t total = 0;
+	ssize_t retsize;
+	while ((retsize = read(fds[0], out + total, size + 1 - total)) > 0) {
+		total += (size_t)retsize;
+	}
+	close(fds[0]);
+
+	CHECK(total == size);
+	CHECK(!memcmp(out, buffer, size));
+	free(out);
+}
+
+static void test_errors(const ppelib_file_t *pe) {
+	int fd = open(IMAGE_FILE, O_RDONLY);
+	CHECK(fd >= 0);
+
+	CHECK(!ppelib_write_to_fd(pe, fd));
+	CHECK(ppelib_error_peek());
+	CHECK(lseek(fd, 0, SEEK_CUR) == 0);
+
+	close(fd);
+}
+#endif
+
+int main() {
+#if defined _WIN32
+	return TEST_SKIP;
+#else
+	size_t image_size;
+	uint8_t *image = test_image_create(&image_size);
+
+	size_t size = image_size + LARGE_OVERLAY_SIZE;
+	uint8_t *buffer = malloc(size);
+	CHECK(buffer);
+
+	memcpy(buffer, image, image_size);
+	for (size_t i = image_size; i < size; ++i) {
+		buffer[i] = (uint8_t)(i * 7);
+	}
+	free(image);
+
+	test_write_file(IMAGE_FILE, buffer, size);
+
+	// Everything in memory, and everything still in the file
+	ppelib_file_t *copied = ppelib_create_from_buffer(buffer, size);
+	CHECK(!ppelib_error_peek());
+	ppelib_file_t *mapped = ppelib_create_from_file_mapped(IMAGE_FILE);
+	CHECK(!ppelib_error_peek());
+
+	const ppelib_file_t *handles[] = {copied, mapped};
+	for (size_t i = 0; i < 2; ++i) {
+		test_seekable(handles[i], buffer, size);
+		test_pipe(handles[i], buffer, size);
+		test_sink(handles[i], buffer, size);
+		test_errors(handles[i]);
+	}
+
+	ppelib_destroy(copied);
+	ppelib_destroy(mapped);
+
+	remove(IMAGE_FILE);
+	remove(OUT_FILE);
+	free(buffer);
+	return 0;
+#endif
+}